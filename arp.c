@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 
 #include "platform.h"
@@ -21,14 +24,35 @@
 #define ARP_OP_REQUEST 1
 #define ARP_OP_REPLY   2
 
-#define ARP_CACHE_SIZE 32
-#define ARP_CACHE_TIMEOUT 30 // seconds
+#define ARP_CACHE_SIZE_MIN 64    // ハッシュテーブルの初期サイズ（2のべき乗）
+#define ARP_CACHE_SIZE_MAX 131072 // ハッシュテーブルの最大サイズ（エントリ数はこの半分まで）
+
+// 到達性確認（NUD）のタイマー（秒）
+#define ARP_REACHABLE_TIME 30         // 確認が取れてからREACHABLEのままでいる時間
+#define ARP_STALE_TIMEOUT 60          // 使われないSTALEのエントリを削除するまでの時間
+#define ARP_DELAY_FIRST_PROBE_TIME 5  // STALEのエントリを使ってから上位層の確認を待つ時間
+
+#define ARP_GENERATION_SIZE 1024  // 近隣ごとの世代番号の数（2のべき乗, 衝突したものは一緒に進む）
+
+// アドレス解決待ちの間に保留できるパケットの合計バイト数（宛先ごと）
+// NOTE: 数で制限すると大きなデータグラムのフラグメントの先頭が溢れて再構築できなくなるので、バイト数で制限する
+//       （最大長のデータグラムを最小のMTUで分けたフラグメントが全て入る大きさ, Linuxのunres_qlen_bytesと同程度）
+#define ARP_PENDING_BYTES_MAX (4 * IP_TOTAL_SIZE_MAX)
+#define ARP_REQUEST_INTERVAL 1     // ARP要求の再送間隔（秒）
+#define ARP_TIMER_REQUEST_MAX 64   // タイマーの1回の処理で送るARP要求の最大数（超えた分は次の回に送る）
+#define ARP_REQUEST_RETRY_MAX 3    // ARP要求の最大送信回数（超えたら保留中のパケットと共に破棄する, PROBEのユニキャストも同じ）
 
 // ARPキャッシュの状態を表す定数
 #define ARP_CACHE_STATE_FREE       0
 #define ARP_CACHE_STATE_INCOMPLETE 1
-#define ARP_CACHE_STATE_RESOLVED   2
-#define ARP_CACHE_STATE_STATIC     3
+#define ARP_CACHE_STATE_REACHABLE  2 // 到達性を確認済み
+#define ARP_CACHE_STATE_STALE      3 // 確認から時間が経っている（使われたらDELAYへ）
+#define ARP_CACHE_STATE_DELAY      4 // 上位層からの確認を待っている
+#define ARP_CACHE_STATE_PROBE      5 // ユニキャストのARP要求で確認している
+#define ARP_CACHE_STATE_STATIC     6
+
+// ハードウェアアドレスを使って送信できる状態
+#define ARP_CACHE_STATE_USABLE(x) ((x) >= ARP_CACHE_STATE_REACHABLE)
 
 // ARPヘッダの構造体
 struct arp_hdr {
@@ -50,16 +74,40 @@ struct arp_ether_ip {
     uint8_t tpa[IP_ADDR_LEN];    // プロトコルアドレス(IPアドレス)
 };
 
+// アドレス解決待ちのパケット
+struct arp_pending {
+    struct arp_pending *next;
+    size_t len;
+    uint8_t data[];
+};
+
 // ARPキャッシュの構造体
+// NOTE: seqは書き換え中に奇数になる（ロックを取らずに読む側はseqが変化していないことで整合性を確認する）
 struct arp_cache {
+    atomic_uint seq;
     unsigned char state;        // キャッシュの状態
+    struct net_iface *iface;    // キーの一部（インタフェースごとに別のエントリとする）
     ip_addr_t pa;               // プロトコルアドレス, IPアドレス
     uint8_t ha[ETHER_ADDR_LEN]; // ハードウェアアドレス
-    struct timeval timestamp;   // 最終更新時刻
+    struct timeval timestamp;   // 最終更新時刻（INCOMPLETEの間は最後にARP要求を送った時刻）
+    unsigned int retries;       // ARP要求の送信回数
+    struct arp_pending *head;   // アドレス解決待ちのパケット（INCOMPLETEの間のみ）
+    struct arp_pending *tail;
+    size_t pending;             // 保留中のパケットの合計バイト数
+};
+
+// ARPテーブル（オープンアドレス法のハッシュテーブル）
+struct arp_table {
+    struct arp_table *next; // 拡張前のテーブル（ロックを取らない読み手が参照している可能性があるので解放しない）
+    unsigned int size;      // スロット数（2のべき乗）
+    unsigned int used;      // 使用中のエントリ数
+    struct arp_cache entries[];
 };
 
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct arp_cache caches[ARP_CACHE_SIZE]; // ARPキャッシュの配列（ARPテーブル）
+static struct arp_table *_Atomic table; // ARPテーブル（書き換えはmutexを取得して行う）
+static uint32_t seed;
+static atomic_uint generations[ARP_GENERATION_SIZE]; // 近隣ごとの世代番号
 
 static char *arp_opcode_ntoa(uint16_t opcode) {
     switch (ntoh16(opcode)) {
@@ -101,57 +149,253 @@ static void arp_dump(const uint8_t *data, size_t len) {
 
 /*
     ARP Cache
-    NOTE: ARP Cache functions must be called after mutex locked
+    NOTE: ARP Cache functions must be called after mutex locked (except arp_cache_read())
 */
 
+// キャッシュのキーにはデバイスの代表のIPインタフェースを使う（同じデバイスに複数のアドレスがあっても近隣の情報は共有する）
+static struct net_iface *arp_cache_iface(struct net_iface *iface) {
+    return net_device_get_iface(iface->dev, NET_IFACE_FAMILY_IP);
+}
+
+static uint32_t arp_cache_hash(struct net_iface *iface, ip_addr_t pa) {
+    return hash32_3words(pa, (uint32_t)(uintptr_t)iface, 0, seed);
+}
+
+// 宛先キャッシュは解決したアドレスと一緒に近隣の世代番号を覚えておき、変わっていたらarp_resolve()を通し直す
+// NOTE: エントリはテーブルの拡張や削除で移動するので、世代番号はエントリとは別の固定の配列に置く
+static atomic_uint *arp_generation_slot(struct net_iface *iface, ip_addr_t pa) {
+    return &generations[arp_cache_hash(iface, pa) & (ARP_GENERATION_SIZE - 1)];
+}
+
+// この近隣のアドレスを覚えている宛先キャッシュを無効にする（他の近隣を使う宛先キャッシュには影響しない）
+static void arp_generation_bump(struct arp_cache *cache) {
+    atomic_fetch_add_explicit(arp_generation_slot(cache->iface, cache->pa), 1, memory_order_release);
+}
+
+static void arp_cache_write_begin(struct arp_cache *cache) {
+    atomic_fetch_add_explicit(&cache->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void arp_cache_write_end(struct arp_cache *cache) {
+    atomic_fetch_add_explicit(&cache->seq, 1, memory_order_release);
+}
+
+static struct arp_table *arp_table_alloc(unsigned int size) {
+    struct arp_table *t;
+
+    t = memory_alloc(sizeof(*t) + sizeof(struct arp_cache) * size);
+    if (!t) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    t->size = size;
+    return t;
+}
+
+// エントリのキー・値を別のスロットへ写す（seqは写さない）
+static void arp_cache_copy(struct arp_cache *dst, const struct arp_cache *src) {
+    arp_cache_write_begin(dst);
+    dst->state = src->state;
+    dst->iface = src->iface;
+    dst->pa = src->pa;
+    memcpy(dst->ha, src->ha, ETHER_ADDR_LEN);
+    dst->timestamp = src->timestamp;
+    dst->retries = src->retries;
+    dst->head = src->head;
+    dst->tail = src->tail;
+    dst->pending = src->pending;
+    arp_cache_write_end(dst);
+}
+
+static void arp_cache_set_state(struct arp_cache *cache, unsigned char state, const struct timeval *now) {
+    arp_cache_write_begin(cache);
+    cache->state = state;
+    cache->timestamp = *now;
+    cache->retries = 0;
+    arp_cache_write_end(cache);
+}
+
+static struct arp_cache *arp_cache_select(struct net_iface *iface, ip_addr_t pa) {
+    struct arp_table *t;
+    struct arp_cache *entry;
+    unsigned int i, mask;
+
+    t = atomic_load_explicit(&table, memory_order_relaxed);
+    mask = t->size - 1;
+    // キャッシュの中からインタフェースとプロトコルアドレスが一致するエントリを探して返す（線形探索で空きスロットに当たったら終わり）
+    for (i = arp_cache_hash(iface, pa) & mask; ; i = (i + 1) & mask) {
+        entry = &t->entries[i];
+        if (entry->state == ARP_CACHE_STATE_FREE)
+            return NULL;
+        if (entry->iface == iface && entry->pa == pa)
+            return entry;
+    }
+}
+
+// テーブルを拡張して全てのエントリを入れ直す
+static int arp_cache_resize(unsigned int size) {
+    struct arp_table *old, *new;
+    struct arp_cache *src, *dst;
+    unsigned int i, mask;
+
+    old = atomic_load_explicit(&table, memory_order_relaxed);
+    new = arp_table_alloc(size);
+    if (!new)
+        return -1;
+    mask = size - 1;
+    for (src = old->entries; src < old->entries + old->size; src++) {
+        if (src->state == ARP_CACHE_STATE_FREE)
+            continue;
+        for (i = arp_cache_hash(src->iface, src->pa) & mask; new->entries[i].state != ARP_CACHE_STATE_FREE; i = (i + 1) & mask)
+            ;
+        dst = &new->entries[i];
+        arp_cache_copy(dst, src);
+        new->used++;
+    }
+    new->next = old;
+    atomic_store_explicit(&table, new, memory_order_release);
+    infof("resized, size=%u, used=%u", size, new->used);
+    return 0;
+}
+
+static void arp_pending_free(struct arp_pending *head) {
+    struct arp_pending *p;
+
+    while (head) {
+        p = head;
+        head = head->next;
+        memory_free(p);
+    }
+}
+
+// パケットを解決待ちのキューに入れる（溢れたら古いものから捨てる）
+static int arp_pending_push(struct arp_cache *cache, const uint8_t *data, size_t len) {
+    struct arp_pending *p;
+
+    p = memory_alloc(sizeof(*p) + len);
+    if (!p) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    p->len = len;
+    memcpy(p->data, data, len);
+    while (cache->head && cache->pending + len > ARP_PENDING_BYTES_MAX) {
+        struct arp_pending *old = cache->head;
+        cache->head = old->next;
+        if (!cache->head)
+            cache->tail = NULL;
+        cache->pending -= old->len;
+        memory_free(old);
+        debugf("pending queue overflow, drop oldest");
+    }
+    if (cache->tail)
+        cache->tail->next = p;
+    else
+        cache->head = p;
+    cache->tail = p;
+    cache->pending += len;
+    return 0;
+}
+
+// キューから外したパケットを解決したアドレス宛に送る（mutexを解放してから呼ぶ）
+static void arp_pending_flush(struct net_iface *iface, struct arp_pending *head, const uint8_t *ha) {
+    struct arp_pending *p;
+
+    for (p = head; p; p = p->next) {
+        if (net_device_output(iface->dev, NET_PROTOCOL_TYPE_IP, p->data, p->len, ha) == -1)
+            errorf("net_device_output() failure, dev=%s", iface->dev->name);
+    }
+    arp_pending_free(head);
+}
+
 static void arp_cache_delete(struct arp_cache *cache) {
+    struct arp_table *t;
+    unsigned int i, j, k, mask;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
     debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
-
-    // キャッシュのエントリを削除する
-    // stateは未使用（FREE）の状態にする
-    // 各フィールドを0にする
-    // timestampはtimerclear()でクリアする
+    // 解決できなかったパケットは破棄する
+    arp_pending_free(cache->head);
+    // このアドレスを覚えている宛先キャッシュを無効にする
+    if (ARP_CACHE_STATE_USABLE(cache->state))
+        arp_generation_bump(cache);
+
+    // 後続のエントリを詰めて探索の連鎖が途切れないようにする（墓標を使わない削除）
+    t = atomic_load_explicit(&table, memory_order_relaxed);
+    mask = t->size - 1;
+    i = cache - t->entries;
+    for (j = (i + 1) & mask; t->entries[j].state != ARP_CACHE_STATE_FREE; j = (j + 1) & mask) {
+        k = arp_cache_hash(t->entries[j].iface, t->entries[j].pa) & mask;
+        // 本来の位置kが(i, j]の範囲にあるエントリは動かさない
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        arp_cache_copy(&t->entries[i], &t->entries[j]);
+        i = j;
+    }
+    cache = &t->entries[i];
+    arp_cache_write_begin(cache);
     cache->state = ARP_CACHE_STATE_FREE;
+    cache->iface = NULL;
     cache->pa = 0;
-    cache->ha[0] = '\0';
+    memset(cache->ha, 0, ETHER_ADDR_LEN);
     timerclear(&(cache->timestamp));
+    cache->retries = 0;
+    cache->head = cache->tail = NULL;
+    cache->pending = 0;
+    arp_cache_write_end(cache);
+    t->used--;
 }
 
-static struct arp_cache *arp_cache_alloc(void) {
+// 一番古い動的エントリを追い出す（テーブルが最大サイズに達した時だけ）
+static void arp_cache_evict(void) {
+    struct arp_table *t;
     struct arp_cache *entry, *oldest = NULL;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        // ARPキャッシュのテーブルを巡回
-
-        // 使用されていないエントリを返す
-        if (entry->state == ARP_CACHE_STATE_FREE)
-            return entry;
-
-        // 空きがなかったときのために一番古いエントリも一緒に探す
+    t = atomic_load_explicit(&table, memory_order_relaxed);
+    for (entry = t->entries; entry < t->entries + t->size; entry++) {
+        if (entry->state == ARP_CACHE_STATE_FREE || entry->state == ARP_CACHE_STATE_STATIC)
+            continue;
         if (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >))
             oldest = entry;
     }
-    arp_cache_delete(oldest);
-    return oldest;
+    if (oldest)
+        arp_cache_delete(oldest);
 }
 
-static struct arp_cache *arp_cache_select(ip_addr_t pa) {
+// キーを設定した空きエントリを確保する（状態と値は呼び出し側で設定する）
+static struct arp_cache *arp_cache_alloc(struct net_iface *iface, ip_addr_t pa) {
+    struct arp_table *t;
     struct arp_cache *entry;
-    // キャッシュの中からプロトコルアドレスが一致するエントリを探して返す
-    // 念のためFREE状態ではないエントリの中から探す
-    // 見つからなかったらNULLを返す
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->pa == pa) 
-            return entry;
+    unsigned int i, mask;
+
+    t = atomic_load_explicit(&table, memory_order_relaxed);
+    // 負荷率が1/2を超えたら拡張する（探索の長さを短く保つ）
+    if ((t->used + 1) * 2 > t->size) {
+        if (t->size >= ARP_CACHE_SIZE_MAX || arp_cache_resize(t->size * 2) == -1)
+            arp_cache_evict();
+        t = atomic_load_explicit(&table, memory_order_relaxed);
+        if ((t->used + 1) * 2 > t->size) {
+            errorf("cache full");
+            return NULL;
+        }
     }
-    return NULL;
+    mask = t->size - 1;
+    for (i = arp_cache_hash(iface, pa) & mask; t->entries[i].state != ARP_CACHE_STATE_FREE; i = (i + 1) & mask)
+        ;
+    entry = &t->entries[i];
+    entry->iface = iface;
+    entry->pa = pa;
+    t->used++;
+    return entry;
 }
 
-static struct arp_cache *arp_cache_update(ip_addr_t pa, const uint8_t *ha) {
+// NOTE: solicitedは自分宛のARP応答かどうか（到達性の確認になるのは自分の送った要求を待っている間だけ）
+static struct arp_cache *arp_cache_update(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha, int solicited) {
     struct arp_cache *cache;
+    unsigned char state;
+    int changed;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
@@ -159,24 +403,39 @@ static struct arp_cache *arp_cache_update(ip_addr_t pa, const uint8_t *ha) {
 
     // arp_cache_select()でエントリを検索する
     // 見つからなかったらエラー（NULL）を返す
-    cache = arp_cache_select(pa);
+    cache = arp_cache_select(iface, pa);
     if (!cache)
         return NULL;
-    
+    if (cache->state == ARP_CACHE_STATE_STATIC)
+        return cache; /* never overwritten */
+
     // エントリの情報を更新する
-    // stateは解決済み（RESOLVE）の状態にする
-    // timestampはgettimeofday()で設定する
-    cache->state = ARP_CACHE_STATE_RESOLVED;
-    cache->pa = pa;
+    // 自分の要求（INCOMPLETEかPROBEの間に送ったもの）への応答でアドレスが変わらなければREACHABLE
+    // それ以外（要求, 頼んでいない応答やGratuitous ARP, アドレスが変わった応答）で新しく分かった・変わったアドレスはSTALEにする
+    // NOTE: 偽の応答で確認済みのエントリを書き換えられても、使う前に到達性を確認し直すことになる
+    // 確認にならないメッセージでアドレスも変わらなければ状態は変えない
+    changed = ARP_CACHE_STATE_USABLE(cache->state) && memcmp(cache->ha, ha, ETHER_ADDR_LEN) != 0;
+    if (changed)
+        arp_generation_bump(cache); /* address changed */
+    if (solicited && !changed && (cache->state == ARP_CACHE_STATE_INCOMPLETE || cache->state == ARP_CACHE_STATE_PROBE))
+        state = ARP_CACHE_STATE_REACHABLE;
+    else if (cache->state == ARP_CACHE_STATE_INCOMPLETE || changed)
+        state = ARP_CACHE_STATE_STALE;
+    else
+        return cache;
+    arp_cache_write_begin(cache);
+    cache->state = state;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
     gettimeofday(&(cache->timestamp), NULL);
+    cache->retries = 0;
+    arp_cache_write_end(cache);
 
     debugf("UPDATE: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
 
 // ARPキャッシュの登録
-static struct arp_cache *arp_cache_insert(ip_addr_t pa, const uint8_t *ha) {
+static struct arp_cache *arp_cache_insert(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha) {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
@@ -184,26 +443,57 @@ static struct arp_cache *arp_cache_insert(ip_addr_t pa, const uint8_t *ha) {
     // キャッシュに新しくエントリを登録する
 
     // arp_cache_alloc()でエントリの登録スペースを確保する
-    cache = arp_cache_alloc();
+    cache = arp_cache_alloc(iface, pa);
     if (!cache) {
         errorf("arp_cache_alloc() failure");
         return NULL;
     }
 
     // エントリの情報を設定する
-    // stateは解決済み（RESOLVED）の状態にする
+    // stateはSTALEにする（自分宛の要求を受け取った相手, 到達性は使う時に確認する）
     // timestampはgettimeofday()で設定する
-    cache->state = ARP_CACHE_STATE_RESOLVED;
-    cache->pa = pa;
+    arp_cache_write_begin(cache);
+    cache->state = ARP_CACHE_STATE_STALE;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
     gettimeofday(&(cache->timestamp), NULL);
+    arp_cache_write_end(cache);
 
     debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
 
+// ロックを取らずにエントリを探して状態を返す（見つからない・書き換え中の場合はFREEを返すのでロックを取って探し直す）
+static unsigned char arp_cache_read(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, struct timeval *timestamp) {
+    struct arp_table *t;
+    struct arp_cache *entry;
+    unsigned int i, mask, seq;
+    unsigned char state;
+    int match;
+
+    t = atomic_load_explicit(&table, memory_order_acquire);
+    mask = t->size - 1;
+    for (i = arp_cache_hash(iface, pa) & mask; ; i = (i + 1) & mask) {
+        entry = &t->entries[i];
+        seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+        if (seq & 1)
+            return ARP_CACHE_STATE_FREE;
+        state = entry->state;
+        match = (entry->iface == iface && entry->pa == pa);
+        if (match) {
+            memcpy(ha, entry->ha, ETHER_ADDR_LEN);
+            *timestamp = entry->timestamp;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+            return ARP_CACHE_STATE_FREE;
+        if (state == ARP_CACHE_STATE_FREE || match)
+            return state;
+    }
+}
+
 // ARP要求の送信関数
-static int arp_request(struct net_iface *iface, ip_addr_t tpa) {
+// NOTE: dstを指定するとユニキャストで送る（到達性の確認用）, NULLならブロードキャスト
+static int arp_request(struct net_iface *iface, ip_addr_t tpa, const uint8_t *dst) {
     struct arp_ether_ip request;
 
     request.hdr.hdr = ntoh16(ARP_HDR_ETHER);
@@ -214,16 +504,19 @@ static int arp_request(struct net_iface *iface, ip_addr_t tpa) {
 
     memcpy(request.sha, iface->dev->addr, ETHER_ADDR_LEN);
     memcpy(request.spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
-    // memcpy(request.tha, 0, ETHER_ADDR_LEN);
+    if (dst)
+        memcpy(request.tha, dst, ETHER_ADDR_LEN);
+    else
+        memset(request.tha, 0, ETHER_ADDR_LEN);
     memcpy(request.tpa, &tpa, IP_ADDR_LEN);
 
     debugf("dev=%s, len=%zu", iface->dev->name, sizeof(request));
     arp_dump((uint8_t *)&request, sizeof(request));
 
     // デバイスの送信関数を呼び出してARP要求のメッセージを送信する
-    // 宛先はデバイスに設定されているブロードキャストアドレスとする
+    // 宛先は指定がなければデバイスに設定されているブロードキャストアドレスとする
     // デバイスの送信関数の戻り値をこの関数の戻り値とする
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), dst ? dst : iface->dev->broadcast);
 }
 
 // ARP応答の送信
@@ -255,6 +548,9 @@ static void arp_input(const uint8_t *data, size_t len, struct net_device *dev) {
     struct arp_ether_ip *msg;
     ip_addr_t spa, tpa;
     struct net_iface *iface;
+    struct ip_iface *target;
+    struct arp_cache *cache;
+    struct arp_pending *pending = NULL;
 
     // 更新の可否を示すグラフ
     int merge = 0;
@@ -289,42 +585,62 @@ static void arp_input(const uint8_t *data, size_t len, struct net_device *dev) {
     memcpy(&spa, msg->spa, sizeof(spa));
     memcpy(&tpa, msg->tpa, sizeof(tpa));
 
+    // デバイスに紐づくIPインタフェースを取得する（キャッシュのキーにも使う）
+    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    if (!iface)
+        return;
+
+    // ターゲットプロトコルアドレスが自分のアドレス（デバイスに設定されたいずれか）か確認する
+    target = ip_iface_lookup(dev, tpa);
+    if (target && target->unicast != tpa)
+        target = NULL;
+
     // キャッシュへのアクセスをミューテックスで保護
     mutex_lock(&mutex);
 
     // ARPメッセージを受信したら、まず送信元アドレスのキャッシュ情報を更新する（更新なので未登録の場合には失敗する）
-    if (arp_cache_update(spa, msg->sha)) {
+    cache = arp_cache_update(iface, spa, msg->sha, target && ntoh16(msg->hdr.op) == ARP_OP_REPLY);
+    if (cache) {
         /* updated */
         merge = 1;
+        // アドレス解決を待っていたパケットを取り出す
+        pending = cache->head;
+        cache->head = cache->tail = NULL;
+        cache->pending = 0;
     }
 
     // アンロックを忘れずに
     mutex_unlock(&mutex);
 
-    // デバイスに紐づくIPインタフェースを取得する
-    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    // 取り出したパケットを解決したアドレス宛に送る
+    if (pending)
+        arp_pending_flush(iface, pending, msg->sha);
 
-    // ARP要求のターゲットプロトコルアドレスと一致するか確認
-    if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
+    // 自分宛のメッセージなら送信元を登録して、要求には応答する
+    if (target) {
         // 先の処理で送信元アドレスのキャッシュ情報が更新されていなかったら（まだ未登録だったら）
         if (!merge) {
             mutex_lock(&mutex);
             infof("merge arp cache");
-            arp_cache_insert(spa, msg->sha);
+            arp_cache_insert(iface, spa, msg->sha);
             mutex_unlock(&mutex);
         }
         
         // ARP要求への応答
         // メッセージ種別がARP要求だったらarp_reply()を呼び出してARP応答を送信する
         if (ntoh16(msg->hdr.op) == ARP_OP_REQUEST)
-            arp_reply(iface, msg->sha, spa, msg->sha);
+            arp_reply(NET_IFACE(target), msg->sha, spa, msg->sha);
     }
 }
 
 // アドレス解決を実行する関数
 // アドレスをキャッシュに記憶させる
-int arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha) {
+// NOTE: dataを渡すと解決待ちの間はパケットを保留し、ARP応答を受け取った時に送信する
+int arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, const uint8_t *data, size_t len) {
+    struct net_iface *key;
     struct arp_cache *cache;
+    unsigned char state;
+    struct timeval now;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
@@ -337,20 +653,27 @@ int arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha) {
         debugf("unsupported protocol address type");
         return ARP_RESOLVE_ERROR;
     }
+    key = arp_cache_iface(iface);
+
+    // 解決済みのエントリはロックを取らずに読む（STALEはDELAYへ移すのでロックを取る）
+    state = arp_cache_read(key, pa, ha, &now);
+    if (ARP_CACHE_STATE_USABLE(state) && state != ARP_CACHE_STATE_STALE)
+        return ARP_RESOLVE_FOUND;
 
     // ARPキャッシュへのアクセスをmutexで保護
     mutex_lock(&mutex);
 
-    // ARPキャッシュを検索（キー：プロトコルアドレス）
-    cache = arp_cache_select(pa);
+    // ARPキャッシュを検索（キー：インタフェースとプロトコルアドレス）
+    cache = arp_cache_select(key, pa);
     if (!cache) {
         debugf("cache not found, pa=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)));
         // ARPキャッシュに問い合わせ中のエントリを作成
         
         // 新しいエントリの領域を確保
         // 領域を確保できなかったらERRORを返す
-        cache = arp_cache_alloc();
+        cache = arp_cache_alloc(key, pa);
         if (!cache) {
+            mutex_unlock(&mutex);
             errorf("arp_cache_alloc() failure");
             return ARP_RESOLVE_ERROR;
         }
@@ -360,27 +683,38 @@ int arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha) {
         // pa:引数で受け取ったプロトコルアドレス
         // ha:未設定（なにもしない）
         // timestamp:現在時刻（gettimeofday()）
+        arp_cache_write_begin(cache);
         cache->state = ARP_CACHE_STATE_INCOMPLETE;
-        cache->pa = pa;
         gettimeofday(&(cache->timestamp), NULL);
+        cache->retries = 1;
+        arp_cache_write_end(cache);
+        if (data)
+            arp_pending_push(cache, data, len);
 
         mutex_unlock(&mutex);
 
-        // ARP要求の送信関数を呼び出す
-        arp_request(iface, pa);
+        // ARP要求の送信関数を呼び出す（送信元アドレスには送信に使うインタフェースのアドレスを使う）
+        arp_request(iface, pa, NULL);
 
         // 問い合わせ中なのでINCOMPLETEを返す
         return ARP_RESOLVE_INCOMPLETE;
     }
 
-    // 見つかったらエントリがINCOMPLETEのままだったらパケロスしているかもしれないので念のため再送する
-    // タイムスタンプは更新しない
+    // INCOMPLETEのままならパケットを保留して応答を待つ
+    // NOTE: ARP要求の再送はタイマーで行う（送信の度にブロードキャストしない）
     if (cache->state == ARP_CACHE_STATE_INCOMPLETE) {
+        if (data)
+            arp_pending_push(cache, data, len);
         mutex_unlock(&mutex);
-        arp_request(iface, pa);
         return ARP_RESOLVE_INCOMPLETE;
     }
 
+    // STALEのエントリは使われたのでDELAYにして上位層からの確認を待つ（確認が来なければPROBEへ）
+    if (cache->state == ARP_CACHE_STATE_STALE) {
+        gettimeofday(&now, NULL);
+        arp_cache_set_state(cache, ARP_CACHE_STATE_DELAY, &now);
+    }
+
     // 見つかったらハードウェアアドレスをコピー
     memcpy(ha, cache->ha, ETHER_ADDR_LEN);
 
@@ -390,29 +724,378 @@ int arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha) {
     return ARP_RESOLVE_FOUND;
 }
 
+// 上位層で相手との通信が進んだこと（TCPのACKなど）を到達性の確認として扱う
+void arp_confirm(struct net_iface *iface, ip_addr_t pa) {
+    struct arp_cache *cache;
+    struct timeval now, timestamp, diff;
+    uint8_t ha[ETHER_ADDR_LEN];
+
+    iface = arp_cache_iface(iface);
+    gettimeofday(&now, NULL);
+    // 確認して間もないREACHABLEのエントリはロックを取らずに済ませる（ACKの度にロックを取らない）
+    if (arp_cache_read(iface, pa, ha, &timestamp) == ARP_CACHE_STATE_REACHABLE) {
+        timersub(&now, &timestamp, &diff);
+        if (diff.tv_sec < ARP_REACHABLE_TIME / 2)
+            return;
+    }
+    mutex_lock(&mutex);
+    cache = arp_cache_select(iface, pa);
+    if (cache && cache->state != ARP_CACHE_STATE_INCOMPLETE && cache->state != ARP_CACHE_STATE_STATIC)
+        arp_cache_set_state(cache, ARP_CACHE_STATE_REACHABLE, &now);
+    mutex_unlock(&mutex);
+}
+
+const atomic_uint *arp_generation(struct net_iface *iface, ip_addr_t pa) {
+    return arp_generation_slot(arp_cache_iface(iface), pa);
+}
+
+// 自分のアドレスを知らせるGratuitous ARP（送信元と問い合わせ先が自分のアドレスのARP要求）を送る
+int arp_announce(struct net_device *dev) {
+    struct net_iface *iface;
+
+    for (iface = dev->ifaces; iface; iface = iface->next) {
+        if (iface->family != NET_IFACE_FAMILY_IP)
+            continue;
+        if (arp_request(iface, ((struct ip_iface *)iface)->unicast, NULL) == -1) {
+            errorf("arp_request() failure, dev=%s", dev->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 静的エントリの登録（期限切れにならず、受信したARPメッセージで上書きされない）
+int arp_static_add(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha) {
+    struct arp_cache *cache;
+    struct arp_pending *pending = NULL;
+
+    iface = arp_cache_iface(iface);
+    mutex_lock(&mutex);
+    cache = arp_cache_select(iface, pa);
+    if (!cache) {
+        cache = arp_cache_alloc(iface, pa);
+        if (!cache) {
+            mutex_unlock(&mutex);
+            errorf("arp_cache_alloc() failure");
+            return -1;
+        }
+    }
+    arp_cache_write_begin(cache);
+    cache->state = ARP_CACHE_STATE_STATIC;
+    memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+    gettimeofday(&(cache->timestamp), NULL);
+    cache->retries = 0;
+    arp_cache_write_end(cache);
+    arp_generation_bump(cache);
+    // 解決待ちだったパケットは登録したアドレス宛に送る
+    pending = cache->head;
+    cache->head = cache->tail = NULL;
+    cache->pending = 0;
+    mutex_unlock(&mutex);
+    if (pending)
+        arp_pending_flush(iface, pending, ha);
+    return 0;
+}
+
+int arp_static_del(struct net_iface *iface, ip_addr_t pa) {
+    struct arp_cache *cache;
+
+    iface = arp_cache_iface(iface);
+    mutex_lock(&mutex);
+    cache = arp_cache_select(iface, pa);
+    if (!cache || cache->state != ARP_CACHE_STATE_STATIC) {
+        mutex_unlock(&mutex);
+        errorf("not found");
+        return -1;
+    }
+    arp_cache_delete(cache);
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/*
+    Snapshot
+    NOTE: 再起動の前後でキャッシュを引き継ぐためのファイル形式（マルチバイトの値はネットワークバイトオーダー）
+*/
+
+#define ARP_SNAPSHOT_MAGIC "ARPC"
+#define ARP_SNAPSHOT_VERSION 1
+
+#define ARP_SNAPSHOT_FLG_STATIC 0x01
+
+struct arp_snapshot_hdr {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t count;
+};
+
+struct arp_snapshot_entry {
+    char dev[IFNAMSIZ];          // デバイス名
+    uint8_t unicast[IP_ADDR_LEN]; // インタフェースのアドレス（同じデバイスに複数のインタフェースがある場合の区別）
+    uint8_t pa[IP_ADDR_LEN];
+    uint8_t ha[ETHER_ADDR_LEN];
+    uint8_t flags;
+    uint8_t reserved;
+};
+
+// 解決済みのエントリをファイルに書き出す
+// NOTE: 一時ファイルに書き出してからrenameで置き換える（途中で失敗しても前回のスナップショットが残る）
+int arp_save(const char *path) {
+    FILE *fp;
+    struct arp_table *t;
+    struct arp_cache *entry;
+    struct arp_snapshot_hdr hdr;
+    struct arp_snapshot_entry rec;
+    char tmp[PATH_MAX];
+    uint32_t count = 0;
+    int err = 0;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errorf("too long path, path=%s", path);
+        return -1;
+    }
+    fp = fopen(tmp, "wb");
+    if (!fp) {
+        errorf("fopen() failure, path=%s", tmp);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) { /* count is written later */
+        errorf("write failure, path=%s", tmp);
+        fclose(fp);
+        remove(tmp);
+        return -1;
+    }
+    mutex_lock(&mutex);
+    t = atomic_load_explicit(&table, memory_order_relaxed);
+    for (entry = t->entries; entry < t->entries + t->size; entry++) {
+        if (!ARP_CACHE_STATE_USABLE(entry->state))
+            continue;
+        memset(&rec, 0, sizeof(rec));
+        strncpy(rec.dev, entry->iface->dev->name, sizeof(rec.dev)-1);
+        memcpy(rec.unicast, &((struct ip_iface *)entry->iface)->unicast, IP_ADDR_LEN);
+        memcpy(rec.pa, &entry->pa, IP_ADDR_LEN);
+        memcpy(rec.ha, entry->ha, ETHER_ADDR_LEN);
+        if (entry->state == ARP_CACHE_STATE_STATIC)
+            rec.flags |= ARP_SNAPSHOT_FLG_STATIC;
+        if (fwrite(&rec, sizeof(rec), 1, fp) != 1) {
+            err = 1;
+            break;
+        }
+        count++;
+    }
+    mutex_unlock(&mutex);
+    memcpy(hdr.magic, ARP_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = hton16(ARP_SNAPSHOT_VERSION);
+    hdr.count = hton32(count);
+    // 全てのエントリとヘッダを書けた場合だけ置き換える（fcloseは失敗しても必ず呼ぶ）
+    if (err || fseek(fp, 0, SEEK_SET) == -1 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        err = 1;
+    if (fclose(fp) == EOF)
+        err = 1;
+    if (err || rename(tmp, path) == -1) {
+        errorf("write failure, path=%s, written=%u", tmp, count);
+        remove(tmp);
+        return -1;
+    }
+    infof("saved, path=%s, entries=%u", path, count);
+    return 0;
+}
+
+static struct net_iface *arp_snapshot_iface(const struct arp_snapshot_entry *rec) {
+    char name[IFNAMSIZ] = {};
+    struct net_device *dev;
+    struct net_iface *iface;
+
+    memcpy(name, rec->dev, sizeof(name)-1);
+    dev = net_device_get_by_name(name);
+    if (!dev)
+        return NULL;
+    for (iface = dev->ifaces; iface; iface = iface->next) {
+        if (iface->family == NET_IFACE_FAMILY_IP && memcmp(&((struct ip_iface *)iface)->unicast, rec->unicast, IP_ADDR_LEN) == 0)
+            return arp_cache_iface(iface);
+    }
+    return NULL;
+}
+
+// ファイルからエントリを読み込む
+// NOTE: 動的なエントリはSTALEとして登録する（すぐに使え、使われた時点で到達性を確認し直す）
+// NOTE: 全てのエントリを読めてから登録する（途中で切れたファイルは何も登録せずに-1を返す）
+int arp_load(const char *path) {
+    FILE *fp;
+    struct arp_snapshot_hdr hdr;
+    struct arp_snapshot_entry *recs, *rec;
+    struct net_iface *iface;
+    struct arp_cache *cache;
+    struct timeval now;
+    ip_addr_t pa;
+    uint32_t count, i, loaded = 0;
+    long size;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        errorf("fopen() failure, path=%s", path);
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, ARP_SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 || ntoh16(hdr.version) != ARP_SNAPSHOT_VERSION) {
+        errorf("invalid snapshot, path=%s", path);
+        fclose(fp);
+        return -1;
+    }
+    count = ntoh32(hdr.count);
+    // 確保する前にファイルの大きさとエントリ数が合っているかを確かめる
+    if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1 || fseek(fp, sizeof(hdr), SEEK_SET) == -1) {
+        errorf("fseek() failure, path=%s", path);
+        fclose(fp);
+        return -1;
+    }
+    if ((uint64_t)(size - sizeof(hdr)) < (uint64_t)count * sizeof(*recs)) {
+        errorf("truncated snapshot, path=%s, count=%u", path, count);
+        fclose(fp);
+        return -1;
+    }
+    recs = memory_alloc(count ? count * sizeof(*recs) : 1);
+    if (!recs) {
+        errorf("memory_alloc() failure");
+        fclose(fp);
+        return -1;
+    }
+    if (fread(recs, sizeof(*recs), count, fp) != count) {
+        errorf("truncated snapshot, path=%s", path);
+        memory_free(recs);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    gettimeofday(&now, NULL);
+    for (i = 0; i < count; i++) {
+        rec = &recs[i];
+        // 今の構成にないインタフェースのエントリは捨てる
+        iface = arp_snapshot_iface(rec);
+        if (!iface)
+            continue;
+        memcpy(&pa, rec->pa, IP_ADDR_LEN);
+        if (rec->flags & ARP_SNAPSHOT_FLG_STATIC) {
+            if (arp_static_add(iface, pa, rec->ha) == 0)
+                loaded++;
+            continue;
+        }
+        mutex_lock(&mutex);
+        // 既に解決済みのエントリは上書きしない
+        if (!arp_cache_select(iface, pa)) {
+            cache = arp_cache_alloc(iface, pa);
+            if (cache) {
+                arp_cache_write_begin(cache);
+                cache->state = ARP_CACHE_STATE_STALE;
+                memcpy(cache->ha, rec->ha, ETHER_ADDR_LEN);
+                cache->timestamp = now;
+                arp_cache_write_end(cache);
+                loaded++;
+            }
+        }
+        mutex_unlock(&mutex);
+    }
+    memory_free(recs);
+    infof("loaded, path=%s, entries=%u", path, loaded);
+    return 0;
+}
+
+// タイマーで送るARP要求（mutexを解放してから送る）
+struct arp_timer_request {
+    struct net_iface *iface;
+    ip_addr_t pa;
+    int unicast;
+    uint8_t ha[ETHER_ADDR_LEN];
+};
+
 // ARPのタイマーハンドラ
 static void arp_timer_handler(void) {
+    struct arp_table *t;
     struct arp_cache *entry;
     struct timeval now, diff;
+    struct arp_timer_request requests[ARP_TIMER_REQUEST_MAX], *req;
+    unsigned int i, n = 0;
 
     mutex_lock(&mutex); // ARPキャッシュへのアクセスをmutexで保護
     gettimeofday(&now, NULL);
-    for (entry = caches; entry < tailof(caches); entry++) {
-        // 未使用のエントリと静的エントリは除外
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->state != ARP_CACHE_STATE_STATIC) {
-            // エントリのタイムスタンプから現在までの経過時間を求める
-            timersub(&now, &entry->timestamp, &diff);
-
-            // タイムアウト時間（ARP_CACHE_TIMEOUT）が経過していたらエントリを削除する
-            if (diff.tv_sec > ARP_CACHE_TIMEOUT)
+    t = atomic_load_explicit(&table, memory_order_relaxed);
+    for (i = 0; i < t->size; i++) {
+        entry = &t->entries[i];
+        timersub(&now, &entry->timestamp, &diff);
+        switch (entry->state) {
+        case ARP_CACHE_STATE_INCOMPLETE:
+        case ARP_CACHE_STATE_PROBE:
+            // 一定間隔でARP要求を再送し、回数を超えたらエントリを削除する（PROBEは知っているアドレスへユニキャストで送る）
+            // NOTE: 削除で後ろのエントリが詰められるので同じスロットをもう一度調べる
+            if (diff.tv_sec < ARP_REQUEST_INTERVAL)
+                break;
+            if (entry->retries >= ARP_REQUEST_RETRY_MAX) {
                 arp_cache_delete(entry);
+                i--;
+                break;
+            }
+            if (n == ARP_TIMER_REQUEST_MAX)
+                break;
+            entry->retries++;
+            entry->timestamp = now;
+            req = &requests[n++];
+            req->iface = entry->iface;
+            req->pa = entry->pa;
+            req->unicast = entry->state == ARP_CACHE_STATE_PROBE;
+            memcpy(req->ha, entry->ha, ETHER_ADDR_LEN);
+            break;
+        case ARP_CACHE_STATE_REACHABLE:
+            // 確認から時間が経ったらSTALEにする（アドレスはそのまま使える）
+            // NOTE: この近隣を使う宛先キャッシュを無効にして次の送信でarp_resolve()を通す（使われていればDELAYへ移る）
+            if (diff.tv_sec >= ARP_REACHABLE_TIME) {
+                arp_cache_set_state(entry, ARP_CACHE_STATE_STALE, &now);
+                arp_generation_bump(entry);
+            }
+            break;
+        case ARP_CACHE_STATE_STALE:
+            // しばらく使われなかったエントリは削除する
+            if (diff.tv_sec >= ARP_STALE_TIMEOUT) {
+                arp_cache_delete(entry);
+                i--;
+            }
+            break;
+        case ARP_CACHE_STATE_DELAY:
+            // 上位層からの確認が来なかったのでユニキャストのARP要求で確かめる
+            if (diff.tv_sec >= ARP_DELAY_FIRST_PROBE_TIME && n < ARP_TIMER_REQUEST_MAX) {
+                arp_cache_set_state(entry, ARP_CACHE_STATE_PROBE, &now);
+                entry->retries = 1;
+                req = &requests[n++];
+                req->iface = entry->iface;
+                req->pa = entry->pa;
+                req->unicast = 1;
+                memcpy(req->ha, entry->ha, ETHER_ADDR_LEN);
+            }
+            break;
+        default:
+            // 未使用のエントリと静的エントリは除外
+            break;
         }
     }
     mutex_unlock(&mutex);
+
+    // ARP要求はデバイスの送信まで進むので、ロックを解放してから送る（arp_resolve()と同じ）
+    for (i = 0; i < n; i++) {
+        req = &requests[i];
+        arp_request(req->iface, req->pa, req->unicast ? req->ha : NULL);
+    }
 }
 
 int arp_init(void) {
     struct timeval interval = {1, 0}; /* 1s */
+    struct arp_table *t;
+
+    // ARPテーブルを確保
+    t = arp_table_alloc(ARP_CACHE_SIZE_MIN);
+    if (!t)
+        return -1;
+    atomic_store(&table, t);
+    seed = random();
 
     // ARPの入力関数(arp_input)をIPに登録
     // プロトコル番号はnet.hに定義してある定数を使う
@@ -1,7 +1,9 @@
 #ifndef ARP_H
 #define ARP_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 #include "net.h"
 #include "ip.h"
@@ -10,7 +12,18 @@
 #define ARP_RESOLVE_INCOMPLETE 0
 #define ARP_RESOLVE_FOUND      1
 
-extern int arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha);
+extern int arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, const uint8_t *data, size_t len);
+extern void arp_confirm(struct net_iface *iface, ip_addr_t pa);
+// 近隣ごとの世代番号（解決したアドレスが使えなくなったり変わったりすると進む）
+extern const atomic_uint *arp_generation(struct net_iface *iface, ip_addr_t pa);
+extern int arp_announce(struct net_device *dev);
+
+extern int arp_static_add(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha);
+extern int arp_static_del(struct net_iface *iface, ip_addr_t pa);
+
+/* snapshot of the cache to warm it up after a restart */
+extern int arp_save(const char *path);
+extern int arp_load(const char *path);
 extern int arp_init(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "capture.h"
+
+#define CAPTURE_RING_SIZE 4096
+#define CAPTURE_FLUSH_INTERVAL 10000000 /* nano seconds */
+
+/* see https://www.tcpdump.org/linktypes.html */
+#define CAPTURE_LINKTYPE_LINUX_SLL 113
+
+#define CAPTURE_SLL_HOST     0
+#define CAPTURE_SLL_OUTGOING 4
+
+/* see include/uapi/linux/if_arp.h */
+#define CAPTURE_ARPHRD_ETHER    1
+#define CAPTURE_ARPHRD_LOOPBACK 772
+#define CAPTURE_ARPHRD_NONE     0xfffe
+
+/* see https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-01.html */
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 0x00000001
+#define PCAPNG_BLOCK_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_NAME  2
+
+#define PCAPNG_PAD(x) (((x) + 3) & ~3)
+
+// Linux cooked capture (SLL) ヘッダ
+// デバイスに渡される時点のデータにはリンク層ヘッダが無いのでこれで種別と向きを記録する
+struct capture_sll_hdr {
+    uint16_t pkttype;
+    uint16_t hatype;
+    uint16_t halen;
+    uint8_t addr[8];
+    uint16_t protocol;
+};
+
+// リングのスロットに格納するレコード
+struct capture_record {
+    struct timeval ts;
+    uint32_t len;    /* original length (include SLL header) */
+    uint32_t caplen; /* captured length (include SLL header) */
+    uint8_t data[];
+};
+
+struct capture {
+    atomic_int active;
+    atomic_int inflight; // capture_packet()を実行中のスレッド数
+    atomic_int terminate;
+    struct ring *ring;
+    size_t snaplen;
+    struct capture_filter filter;
+    FILE *fp;
+    pthread_t thread;
+    atomic_ulong captured;
+    atomic_ulong filtered;
+    atomic_ulong dropped;
+    atomic_ulong written;
+};
+
+struct pcapng_block_hdr {
+    uint32_t type;
+    uint32_t len;
+};
+
+struct pcapng_shb {
+    struct pcapng_block_hdr hdr;
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    uint32_t section_len[2]; /* int64_t (-1: not specified) */
+    uint32_t len;
+};
+
+struct pcapng_idb {
+    struct pcapng_block_hdr hdr;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+};
+
+struct pcapng_epb {
+    struct pcapng_block_hdr hdr;
+    uint32_t ifid;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct pcapng_opt {
+    uint16_t code;
+    uint16_t len;
+};
+
+static const uint8_t pcapng_pad[4];
+
+static int capture_write_shb(FILE *fp) {
+    struct pcapng_shb shb;
+
+    shb.hdr.type = PCAPNG_BLOCK_SHB;
+    shb.hdr.len = sizeof(shb);
+    shb.magic = PCAPNG_BYTE_ORDER_MAGIC;
+    shb.major = 1;
+    shb.minor = 0;
+    shb.section_len[0] = shb.section_len[1] = 0xffffffff;
+    shb.len = sizeof(shb);
+    return fwrite(&shb, sizeof(shb), 1, fp) == 1 ? 0 : -1;
+}
+
+static int capture_write_idb(FILE *fp, struct net_device *dev, size_t snaplen) {
+    struct pcapng_idb idb;
+    struct pcapng_opt opt;
+    size_t nlen;
+    uint32_t len;
+
+    nlen = strlen(dev->name);
+    len = sizeof(idb) + sizeof(opt) + PCAPNG_PAD(nlen) + sizeof(opt) + sizeof(len);
+    idb.hdr.type = PCAPNG_BLOCK_IDB;
+    idb.hdr.len = len;
+    idb.linktype = CAPTURE_LINKTYPE_LINUX_SLL;
+    idb.reserved = 0;
+    idb.snaplen = sizeof(struct capture_sll_hdr) + snaplen;
+    fwrite(&idb, sizeof(idb), 1, fp);
+    opt.code = PCAPNG_OPT_IF_NAME;
+    opt.len = nlen;
+    fwrite(&opt, sizeof(opt), 1, fp);
+    fwrite(dev->name, nlen, 1, fp);
+    fwrite(pcapng_pad, PCAPNG_PAD(nlen) - nlen, 1, fp);
+    opt.code = PCAPNG_OPT_ENDOFOPT;
+    opt.len = 0;
+    fwrite(&opt, sizeof(opt), 1, fp);
+    return fwrite(&len, sizeof(len), 1, fp) == 1 ? 0 : -1;
+}
+
+static int capture_write_epb(FILE *fp, const struct capture_record *rec) {
+    struct pcapng_epb epb;
+    uint64_t ts;
+    uint32_t len;
+
+    ts = (uint64_t)rec->ts.tv_sec * 1000000 + rec->ts.tv_usec; /* if_tsresol: 10^-6 (default) */
+    len = sizeof(epb) + PCAPNG_PAD(rec->caplen) + sizeof(len);
+    epb.hdr.type = PCAPNG_BLOCK_EPB;
+    epb.hdr.len = len;
+    epb.ifid = 0;
+    epb.ts_high = ts >> 32;
+    epb.ts_low = ts & 0xffffffff;
+    epb.caplen = rec->caplen;
+    epb.len = rec->len;
+    fwrite(&epb, sizeof(epb), 1, fp);
+    fwrite(rec->data, rec->caplen, 1, fp);
+    fwrite(pcapng_pad, PCAPNG_PAD(rec->caplen) - rec->caplen, 1, fp);
+    return fwrite(&len, sizeof(len), 1, fp) == 1 ? 0 : -1;
+}
+
+// リングに溜まっているレコードを全てファイルへ書き出す
+static unsigned long capture_flush(struct capture *cap) {
+    struct capture_record *rec;
+    unsigned long n = 0;
+
+    while ((rec = ring_peek(cap->ring)) != NULL) {
+        if (capture_write_epb(cap->fp, rec) == -1) {
+            errorf("capture_write_epb() failure");
+        }
+        ring_release(cap->ring, rec);
+        n++;
+    }
+    if (n) {
+        atomic_fetch_add_explicit(&cap->written, n, memory_order_relaxed);
+        fflush(cap->fp);
+    }
+    return n;
+}
+
+// 書き込みスレッド（パケットを処理するスレッドではファイルI/Oを行わない）
+static void *capture_thread(void *arg) {
+    struct capture *cap;
+    const struct timespec interval = {0, CAPTURE_FLUSH_INTERVAL};
+
+    cap = (struct capture *)arg;
+    while (1) {
+        if (capture_flush(cap))
+            continue;
+        if (atomic_load(&cap->terminate))
+            break;
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+static int capture_match(const struct capture_filter *filter, uint16_t type, const uint8_t *data, size_t len) {
+    const struct ip_hdr *hdr;
+
+    if (filter->type && filter->type != type)
+        return 0;
+    if (!filter->protocol && filter->host == IP_ADDR_ANY)
+        return 1;
+    // プロトコル番号とアドレスによる絞り込みはIPの場合のみ
+    if (type != NET_PROTOCOL_TYPE_IP || len < IP_HDR_SIZE_MIN)
+        return 0;
+    hdr = (const struct ip_hdr *)data;
+    if (filter->protocol && filter->protocol != hdr->protocol)
+        return 0;
+    if (filter->host != IP_ADDR_ANY && filter->host != hdr->src && filter->host != hdr->dst)
+        return 0;
+    return 1;
+}
+
+static uint16_t capture_hatype(struct net_device *dev) {
+    switch (dev->type) {
+        case NET_DEVICE_TYPE_ETHERNET:
+            return CAPTURE_ARPHRD_ETHER;
+        case NET_DEVICE_TYPE_LOOPBACK:
+            return CAPTURE_ARPHRD_LOOPBACK;
+    }
+    return CAPTURE_ARPHRD_NONE;
+}
+
+void capture_packet(struct net_device *dev, int dir, uint16_t type, const uint8_t *data, size_t len) {
+    struct capture *cap;
+    struct capture_record *rec;
+    struct capture_sll_hdr *sll;
+    size_t caplen;
+
+    cap = dev->capture;
+    if (!atomic_load(&cap->active))
+        return;
+    // capture_close()がリングを解放しないように実行中であることを示す
+    atomic_fetch_add(&cap->inflight, 1);
+    if (!atomic_load(&cap->active))
+        goto out;
+    if (!capture_match(&cap->filter, type, data, len)) {
+        atomic_fetch_add_explicit(&cap->filtered, 1, memory_order_relaxed);
+        goto out;
+    }
+    // リングが一杯の場合は待たずに捨てる（パケット処理を止めない）
+    rec = ring_reserve(cap->ring);
+    if (!rec) {
+        atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+        goto out;
+    }
+    gettimeofday(&rec->ts, NULL);
+    caplen = MIN(len, cap->snaplen);
+    sll = (struct capture_sll_hdr *)rec->data;
+    memset(sll, 0, sizeof(*sll));
+    sll->pkttype = hton16(dir == CAPTURE_DIR_OUT ? CAPTURE_SLL_OUTGOING : CAPTURE_SLL_HOST);
+    sll->hatype = hton16(capture_hatype(dev));
+    if (dir == CAPTURE_DIR_OUT) {
+        sll->halen = hton16(MIN(dev->alen, sizeof(sll->addr)));
+        memcpy(sll->addr, dev->addr, MIN(dev->alen, sizeof(sll->addr)));
+    }
+    sll->protocol = hton16(type);
+    memcpy(sll + 1, data, caplen);
+    rec->len = sizeof(*sll) + len;
+    rec->caplen = sizeof(*sll) + caplen;
+    ring_commit(cap->ring, rec);
+    atomic_fetch_add_explicit(&cap->captured, 1, memory_order_relaxed);
+out:
+    atomic_fetch_sub(&cap->inflight, 1);
+}
+
+/* NOTE: must not be called concurrently for the same device */
+int capture_open(struct net_device *dev, const char *path, size_t snaplen, const struct capture_filter *filter) {
+    struct capture *cap;
+    int err;
+
+    if (!snaplen)
+        snaplen = CAPTURE_SNAPLEN_DEFAULT;
+    if (snaplen > CAPTURE_SNAPLEN_MAX)
+        snaplen = CAPTURE_SNAPLEN_MAX;
+    cap = dev->capture;
+    if (!cap) {
+        // キャプチャの構造体は一度確保したら解放しない（ロックなしで参照するため）
+        cap = memory_alloc(sizeof(*cap));
+        if (!cap) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+    } else if (atomic_load(&cap->active)) {
+        errorf("already opened, dev=%s", dev->name);
+        return -1;
+    }
+    cap->snaplen = snaplen;
+    if (filter) {
+        cap->filter = *filter;
+    } else {
+        memset(&cap->filter, 0, sizeof(cap->filter));
+    }
+    cap->ring = ring_alloc(CAPTURE_RING_SIZE, sizeof(struct capture_record) + sizeof(struct capture_sll_hdr) + snaplen);
+    if (!cap->ring) {
+        errorf("ring_alloc() failure");
+        goto error;
+    }
+    cap->fp = fopen(path, "wb");
+    if (!cap->fp) {
+        errorf("fopen: %s, path=%s", strerror(errno), path);
+        goto error;
+    }
+    if (capture_write_shb(cap->fp) == -1 || capture_write_idb(cap->fp, dev, snaplen) == -1) {
+        errorf("failed to write header, path=%s", path);
+        goto error;
+    }
+    atomic_store(&cap->terminate, 0);
+    atomic_store(&cap->captured, 0);
+    atomic_store(&cap->filtered, 0);
+    atomic_store(&cap->dropped, 0);
+    atomic_store(&cap->written, 0);
+    err = pthread_create(&cap->thread, NULL, capture_thread, cap);
+    if (err) {
+        errorf("pthread_create() %s", strerror(err));
+        goto error;
+    }
+    atomic_store(&cap->active, 1);
+    dev->capture = cap;
+    infof("dev=%s, path=%s, snaplen=%zu", dev->name, path, snaplen);
+    return 0;
+
+error:
+    if (cap->fp) {
+        fclose(cap->fp);
+        cap->fp = NULL;
+    }
+    ring_free(cap->ring);
+    cap->ring = NULL;
+    if (!dev->capture)
+        memory_free(cap);
+    return -1;
+}
+
+int capture_close(struct net_device *dev) {
+    struct capture *cap;
+
+    cap = dev->capture;
+    if (!cap || !atomic_load(&cap->active)) {
+        errorf("not opened, dev=%s", dev->name);
+        return -1;
+    }
+    atomic_store(&cap->active, 0);
+    // 実行中のcapture_packet()が抜けるまで待つ
+    while (atomic_load(&cap->inflight))
+        sched_yield();
+    // 書き込みスレッドは残りのレコードを書き出してから終了する
+    atomic_store(&cap->terminate, 1);
+    pthread_join(cap->thread, NULL);
+    fclose(cap->fp);
+    cap->fp = NULL;
+    ring_free(cap->ring);
+    cap->ring = NULL;
+    infof("dev=%s, captured=%lu, filtered=%lu, dropped=%lu, written=%lu",
+        dev->name, atomic_load(&cap->captured), atomic_load(&cap->filtered), atomic_load(&cap->dropped), atomic_load(&cap->written));
+    return 0;
+}
+
+int capture_get_stats(struct net_device *dev, struct capture_stats *stats) {
+    struct capture *cap;
+
+    cap = dev->capture;
+    if (!cap) {
+        return -1;
+    }
+    stats->captured = atomic_load(&cap->captured);
+    stats->filtered = atomic_load(&cap->filtered);
+    stats->dropped = atomic_load(&cap->dropped);
+    stats->written = atomic_load(&cap->written);
+    return 0;
+}
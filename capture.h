@@ -0,0 +1,37 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+#include "ip.h"
+
+#define CAPTURE_DIR_IN  0
+#define CAPTURE_DIR_OUT 1
+
+#define CAPTURE_SNAPLEN_DEFAULT 256
+#define CAPTURE_SNAPLEN_MAX     UINT16_MAX
+
+// キャプチャ対象を絞り込むための簡易フィルタ（0/IP_ADDR_ANYのフィールドは条件に含めない）
+struct capture_filter {
+    uint16_t type;     /* NET_PROTOCOL_TYPE_XXX */
+    uint8_t protocol;  /* IP_PROTOCOL_XXX */
+    ip_addr_t host;    /* src or dst */
+};
+
+struct capture_stats {
+    unsigned long captured;
+    unsigned long filtered;
+    unsigned long dropped; /* ring full */
+    unsigned long written;
+};
+
+extern int capture_open(struct net_device *dev, const char *path, size_t snaplen, const struct capture_filter *filter);
+extern int capture_close(struct net_device *dev);
+extern int capture_get_stats(struct net_device *dev, struct capture_stats *stats);
+
+/* NOTE: called from net_device_output() and net_input_handler() only when dev->capture is set */
+extern void capture_packet(struct net_device *dev, int dir, uint16_t type, const uint8_t *data, size_t len);
+
+#endif
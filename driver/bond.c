@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+#include "platform.h"
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "ether.h"
+
+#include "driver/bond.h"
+
+/*
+ * リンクアグリゲーション（ボンディング）
+ * 複数のEthernetデバイスを束ねて1つのデバイスとして見せる
+ *   送信: L3/L4のハッシュでフローごとにメンバを選ぶ（同じフローのパケットの順序は入れ替わらない）
+ *   受信: メンバの受信はnet_input_handler()でボンディングデバイスの受信として扱う
+ *   障害: 送信に失敗したメンバやダウンしたメンバを外し、一定時間後に戻す
+ */
+
+#define BOND_RESTORE_INTERVAL 1 /* seconds */
+
+struct bond_member {
+    struct net_device *dev;
+    atomic_int active;
+    struct timeval down; // 切り離した時刻
+    atomic_ulong tx_packets;
+    atomic_ulong tx_errors;
+    atomic_ulong failovers;
+};
+
+struct bond {
+    struct bond *next;
+    struct net_device *dev;
+    uint32_t seed;
+    int num;
+    struct bond_member members[BOND_MEMBER_MAX];
+    mutex_t mutex; // NOTE: protects down
+};
+
+#define PRIV(x) ((struct bond *)x->priv)
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
+static struct bond *bonds;
+
+static int bond_member_usable(struct bond_member *m) {
+    return atomic_load(&m->active) && NET_DEVICE_IS_UP(m->dev);
+}
+
+// ハッシュ値から使用可能なメンバを選ぶ
+// メンバの位置はダウンしても変えないので、ダウンしたメンバに割り当てられていたフロー以外は移らない
+// NOTE: 割り当て先がダウンしている場合は使用可能なメンバの中からrendezvous hashingで選び直す（メンバが増減しても他のフローは動かない）
+static struct bond_member *bond_select(struct bond *bond, uint32_t hash) {
+    struct bond_member *m, *best = NULL;
+    uint32_t score, max = 0;
+    int i;
+
+    if (!bond->num)
+        return NULL;
+    m = &bond->members[hash % bond->num];
+    if (bond_member_usable(m))
+        return m;
+    for (i = 0; i < bond->num; i++) {
+        m = &bond->members[i];
+        if (!bond_member_usable(m))
+            continue;
+        score = hash32_3words(hash, i, 0, bond->seed);
+        if (!best || score > max) {
+            best = m;
+            max = score;
+        }
+    }
+    return best;
+}
+
+static void bond_member_down(struct bond *bond, struct bond_member *m) {
+    if (!atomic_exchange(&m->active, 0))
+        return;
+    mutex_lock(&bond->mutex);
+    gettimeofday(&m->down, NULL);
+    mutex_unlock(&bond->mutex);
+    atomic_fetch_add(&m->failovers, 1);
+    warnf("member down, bond=%s, dev=%s", bond->dev->name, m->dev->name);
+}
+
+static int bond_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    struct bond *bond;
+    struct bond_member *m;
+    uint32_t hash = 0;
+    int i;
+
+    bond = PRIV(dev);
+    // IP以外（ARPなど）は常に同じメンバから送る
+    if (type == NET_PROTOCOL_TYPE_IP)
+        hash = ip_flow_hash(data, len, bond->seed);
+    for (i = 0; i < bond->num; i++) {
+        m = bond_select(bond, hash);
+        if (!m)
+            break;
+        if (net_device_output(m->dev, type, data, len, dst) != -1) {
+            atomic_fetch_add_explicit(&m->tx_packets, 1, memory_order_relaxed);
+            return 0;
+        }
+        // 失敗したメンバを外して残りのメンバで送り直す
+        atomic_fetch_add(&m->tx_errors, 1);
+        bond_member_down(bond, m);
+    }
+    errorf("no active member, dev=%s", dev->name);
+    return -1;
+}
+
+static int bond_set_mtu(struct net_device *dev, uint16_t mtu) {
+    struct bond *bond;
+    int i;
+
+    bond = PRIV(dev);
+    for (i = 0; i < bond->num; i++) {
+        if (net_device_set_mtu(bond->members[i].dev, mtu) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// 切り離してから一定時間経ったメンバを戻す（まだ送れなければ再び外れる）
+static void bond_timer(void) {
+    struct bond *bond;
+    struct bond_member *m;
+    struct timeval now, diff;
+    int i;
+
+    gettimeofday(&now, NULL);
+    for (bond = bonds; bond; bond = bond->next) {
+        mutex_lock(&bond->mutex);
+        for (i = 0; i < bond->num; i++) {
+            m = &bond->members[i];
+            if (atomic_load(&m->active) || !NET_DEVICE_IS_UP(m->dev))
+                continue;
+            timersub(&now, &m->down, &diff);
+            if (diff.tv_sec >= BOND_RESTORE_INTERVAL) {
+                atomic_store(&m->active, 1);
+                infof("member restored, bond=%s, dev=%s", bond->dev->name, m->dev->name);
+            }
+        }
+        mutex_unlock(&bond->mutex);
+    }
+}
+
+static struct net_device_ops bond_ops = {
+    .transmit = bond_transmit,
+    .set_mtu = bond_set_mtu,
+};
+
+/* NOTE: must not be call after net_run() */
+int bond_enslave(struct net_device *dev, struct net_device *member) {
+    struct bond *bond;
+    struct bond_member *m;
+
+    bond = PRIV(dev);
+    if (member->type != NET_DEVICE_TYPE_ETHERNET || member == dev || member->master || member->ifaces) {
+        errorf("not available, dev=%s", member->name);
+        return -1;
+    }
+    if (bond->num >= BOND_MEMBER_MAX) {
+        errorf("too many members, dev=%s", dev->name);
+        return -1;
+    }
+    m = &bond->members[bond->num++];
+    m->dev = member;
+    atomic_store(&m->active, 1);
+    // メンバはボンディングデバイスのアドレスで送受信する
+    memcpy(member->addr, dev->addr, ETHER_ADDR_LEN);
+    member->master = dev;
+    // 全てのメンバが送れる大きさに合わせる
+    if (bond->num == 1 || member->mtu < dev->mtu)
+        dev->mtu = member->mtu;
+    infof("enslaved, bond=%s, dev=%s, members=%d", dev->name, member->name, bond->num);
+    return 0;
+}
+
+int bond_get_stats(struct net_device *dev, struct bond_member_stats *stats, int size) {
+    struct bond *bond;
+    struct bond_member *m;
+    int i;
+
+    bond = PRIV(dev);
+    for (i = 0; i < bond->num && i < size; i++) {
+        m = &bond->members[i];
+        strncpy(stats[i].name, m->dev->name, sizeof(stats[i].name)-1);
+        stats[i].active = bond_member_usable(m);
+        stats[i].tx_packets = atomic_load(&m->tx_packets);
+        stats[i].tx_errors = atomic_load(&m->tx_errors);
+        stats[i].failovers = atomic_load(&m->failovers);
+    }
+    return i;
+}
+
+struct net_device *bond_init(const char *addr) {
+    struct net_device *dev;
+    struct bond *bond;
+    struct timeval interval = {BOND_RESTORE_INTERVAL, 0};
+
+    dev = net_device_alloc();
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    // Ethernetデバイスとして振る舞う（ARPもボンディングデバイスで行う）
+    ether_setup_helper(dev);
+    if (!addr || ether_addr_pton(addr, dev->addr) == -1) {
+        errorf("invalid address, addr=%s", addr ? addr : "(null)");
+        return NULL;
+    }
+    dev->ops = &bond_ops;
+
+    bond = memory_alloc(sizeof(*bond));
+    if (!bond) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    bond->dev = dev;
+    bond->seed = random();
+    mutex_init(&bond->mutex);
+    dev->priv = bond;
+
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(bond);
+        return NULL;
+    }
+    if (!bonds && net_timer_register(interval, bond_timer) == -1) {
+        errorf("net_timer_register() failure");
+        return NULL;
+    }
+    bond->next = bonds;
+    bonds = bond;
+    infof("bond device initialized, dev=%s", dev->name);
+    return dev;
+}
@@ -0,0 +1,20 @@
+#ifndef BOND_H
+#define BOND_H
+
+#include "net.h"
+
+#define BOND_MEMBER_MAX 8
+
+struct bond_member_stats {
+    char name[IFNAMSIZ];
+    int active;
+    unsigned long tx_packets;
+    unsigned long tx_errors;
+    unsigned long failovers; /* times taken out of service */
+};
+
+extern struct net_device *bond_init(const char *addr);
+extern int bond_enslave(struct net_device *bond, struct net_device *member);
+extern int bond_get_stats(struct net_device *bond, struct bond_member_stats *stats, int size);
+
+#endif
@@ -1,38 +1,567 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/time.h>
 
 #include "platform.h"
 #include "util.h"
 #include "net.h"
+#include "ip.h"
+
+#include "driver/dummy.h"
 
 #define DUMMY_MTU UINT16_MAX /* maximum size of IP datagram */
 
 #define DUMMY_IRQ INTR_IRQ_BASE
 
-static int dummy_transmit(
-    struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+#define DUMMY_GEN_BURST 32        /* packets per interrupt */
+#define DUMMY_GEN_TICK  1000000   /* nano seconds */
+#define DUMMY_PEER_RTO  200000    /* micro seconds */
+
+#define DUMMY_PEER_CLOSED      0
+#define DUMMY_PEER_SYN_SENT    1
+#define DUMMY_PEER_ESTABLISHED 2
+
+#define DUMMY_TCP_FLG_FIN 0x01
+#define DUMMY_TCP_FLG_SYN 0x02
+#define DUMMY_TCP_FLG_RST 0x04
+#define DUMMY_TCP_FLG_PSH 0x08
+#define DUMMY_TCP_FLG_ACK 0x10
+
+#define PRIV(x) ((struct dummy *)x->priv)
+
+// 合成するパケットのヘッダ（各プロトコルの実装とは独立に持つ）
+struct dummy_icmp_hdr {
+    uint8_t type;
+    uint8_t code;
+    uint16_t sum;
+    uint16_t id;
+    uint16_t seq;
+};
+
+struct dummy_udp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint16_t len;
+    uint16_t sum;
+};
+
+struct dummy_tcp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t off;
+    uint8_t flg;
+    uint16_t wnd;
+    uint16_t sum;
+    uint16_t up;
+};
+
+struct dummy_pseudo_hdr {
+    uint32_t src;
+    uint32_t dst;
+    uint8_t zero;
+    uint8_t protocol;
+    uint16_t len;
+};
+
+// スクリプト化されたTCPの対向ノード（受信側のスタックに向けてデータを送り続ける）
+struct dummy_peer {
+    int state;
+    uint32_t iss;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint16_t wnd;
+    struct timeval last; // 最後に進捗があった時刻
+};
+
+struct dummy {
+    struct dummy_generator gen;
+    atomic_int running;
+    atomic_int busy;           // 割り込みハンドラが作業用バッファを使用中
+    atomic_int pending;        // 割り込みを発生済みでまだ処理されていない
+    atomic_ulong credits;      // 注入してよいパケット数（pps指定時）
+    unsigned long injected;
+    uint8_t *frame;            // テンプレート（TCPの場合は作業用バッファ）
+    uint8_t *scratch;          // 直接入力で渡すテンプレートの複製（スタックが書き換える）
+    size_t flen;
+    mutex_t mutex;             // NOTE: protects peer
+    struct dummy_peer peer;
+    pthread_t thread;
+    atomic_ulong rx_packets;
+    atomic_ulong rx_dropped;
+    atomic_ulong tx_packets;
+    atomic_ulong tx_bytes;
+    atomic_ulong tx_verified;
+    atomic_ulong tx_errors;
+};
+
+static void dummy_raise(struct net_device *dev) {
+    // 未処理の割り込みがあれば重ねて発生させない
+    if (!atomic_exchange(&PRIV(dev)->pending, 1))
+        intr_raise_irq(DUMMY_IRQ);
+}
+
+static uint16_t dummy_l4_cksum(uint8_t protocol, ip_addr_t src, ip_addr_t dst, const uint8_t *data, size_t len) {
+    struct dummy_pseudo_hdr pseudo;
+    uint16_t psum;
+
+    pseudo.src = src;
+    pseudo.dst = dst;
+    pseudo.zero = 0;
+    pseudo.protocol = protocol;
+    pseudo.len = hton16(len);
+    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    return cksum16((uint16_t *)data, len, psum);
+}
+
+static size_t dummy_ip_build(uint8_t *buf, uint8_t protocol, ip_addr_t src, ip_addr_t dst, size_t plen) {
+    struct ip_hdr *hdr;
+
+    hdr = (struct ip_hdr *)buf;
+    hdr->vhl = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+    hdr->tos = 0;
+    hdr->total = hton16(IP_HDR_SIZE_MIN + plen);
+    hdr->id = 0;
+    hdr->offset = 0;
+    hdr->ttl = 0xff;
+    hdr->protocol = protocol;
+    hdr->sum = 0;
+    hdr->src = src;
+    hdr->dst = dst;
+    hdr->sum = cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0);
+    return IP_HDR_SIZE_MIN + plen;
+}
+
+// ICMP/UDPはパケットの中身が変わらないので一度だけ生成しておく
+static void dummy_template_build(struct dummy *d) {
+    struct dummy_generator *gen;
+    struct dummy_icmp_hdr *icmp;
+    struct dummy_udp_hdr *udp;
+    uint8_t *l4;
+    size_t l4len;
+
+    gen = &d->gen;
+    l4 = d->frame + IP_HDR_SIZE_MIN;
+    switch (gen->mode) {
+        case DUMMY_GEN_ICMP:
+            l4len = sizeof(*icmp) + gen->len;
+            icmp = (struct dummy_icmp_hdr *)l4;
+            icmp->type = 8; /* Echo */
+            icmp->code = 0;
+            icmp->sum = 0;
+            icmp->id = hton16(1);
+            icmp->seq = hton16(1);
+            icmp->sum = cksum16((uint16_t *)icmp, l4len, 0);
+            d->flen = dummy_ip_build(d->frame, IP_PROTOCOL_ICMP, gen->src, gen->dst, l4len);
+            break;
+        case DUMMY_GEN_UDP:
+            l4len = sizeof(*udp) + gen->len;
+            udp = (struct dummy_udp_hdr *)l4;
+            udp->src = gen->sport;
+            udp->dst = gen->dport;
+            udp->len = hton16(l4len);
+            udp->sum = 0;
+            udp->sum = dummy_l4_cksum(IP_PROTOCOL_UDP, gen->src, gen->dst, l4, l4len);
+            d->flen = dummy_ip_build(d->frame, IP_PROTOCOL_UDP, gen->src, gen->dst, l4len);
+            break;
+    }
+}
+
+static int dummy_inject(struct net_device *dev, const uint8_t *frame, size_t len) {
+    // 割り込みハンドラの中から呼び出すので通常の受信と同じ経路でプロトコルスタックへ渡る
+    if (net_input_handler(NET_PROTOCOL_TYPE_IP, frame, len, dev) == -1) {
+        atomic_fetch_add_explicit(&PRIV(dev)->rx_dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&PRIV(dev)->rx_packets, 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * TCP scripted peer
+ * NOTE: peer functions must be called after mutex locked
+ */
+
+static size_t dummy_peer_build(struct dummy *d, uint32_t seq, uint8_t flg, size_t len) {
+    struct dummy_generator *gen;
+    struct dummy_tcp_hdr *hdr;
+    size_t total;
+
+    gen = &d->gen;
+    hdr = (struct dummy_tcp_hdr *)(d->frame + IP_HDR_SIZE_MIN);
+    total = sizeof(*hdr) + len;
+    hdr->src = gen->sport;
+    hdr->dst = gen->dport;
+    hdr->seq = hton32(seq);
+    hdr->ack = (flg & DUMMY_TCP_FLG_ACK) ? hton32(d->peer.rcv_nxt) : 0;
+    hdr->off = (sizeof(*hdr) >> 2) << 4;
+    hdr->flg = flg;
+    hdr->wnd = hton16(UINT16_MAX);
+    hdr->sum = 0;
+    hdr->up = 0;
+    hdr->sum = dummy_l4_cksum(IP_PROTOCOL_TCP, gen->src, gen->dst, (uint8_t *)hdr, total);
+    return dummy_ip_build(d->frame, IP_PROTOCOL_TCP, gen->src, gen->dst, total);
+}
+
+// 送信ウィンドウの範囲でデータセグメントを注入する（戻り値は注入したセグメント数）
+static unsigned long dummy_peer_output(struct net_device *dev, unsigned long n) {
+    struct dummy *d;
+    struct dummy_peer *peer;
+    struct timeval now, diff;
+    uint32_t inflight, avail;
+    unsigned long i = 0;
+    size_t len;
+
+    d = PRIV(dev);
+    peer = &d->peer;
+    gettimeofday(&now, NULL);
+    timersub(&now, &peer->last, &diff);
+    switch (peer->state) {
+        case DUMMY_PEER_SYN_SENT:
+            if (diff.tv_sec == 0 && diff.tv_usec < DUMMY_PEER_RTO)
+                break;
+            /* fall through */
+        case DUMMY_PEER_CLOSED:
+            // 能動オープン（応答がなければRTO経過後に再送する）
+            peer->iss = random();
+            peer->state = DUMMY_PEER_SYN_SENT;
+            peer->last = now;
+            dummy_inject(dev, d->frame, dummy_peer_build(d, peer->iss, DUMMY_TCP_FLG_SYN, 0));
+            i++;
+            break;
+        case DUMMY_PEER_ESTABLISHED:
+            // ACKが進まないままRTOを過ぎたら未確認の位置から送り直す
+            if (peer->snd_nxt != peer->snd_una && (diff.tv_sec || diff.tv_usec >= DUMMY_PEER_RTO)) {
+                peer->snd_nxt = peer->snd_una;
+                peer->last = now;
+            }
+            for (; i < n; i++) {
+                inflight = peer->snd_nxt - peer->snd_una;
+                avail = peer->wnd > inflight ? peer->wnd - inflight : 0;
+                if (!avail)
+                    break;
+                len = MIN(d->gen.len, avail);
+                dummy_inject(dev, d->frame, dummy_peer_build(d, peer->snd_nxt, DUMMY_TCP_FLG_ACK | DUMMY_TCP_FLG_PSH, len));
+                peer->snd_nxt += len;
+            }
+            // ゼロウィンドウならプローブを送ってウィンドウの更新を促す
+            if (!i && !peer->wnd && (diff.tv_sec || diff.tv_usec >= DUMMY_PEER_RTO)) {
+                dummy_inject(dev, d->frame, dummy_peer_build(d, peer->snd_una, DUMMY_TCP_FLG_ACK, 1));
+                peer->last = now;
+                i++;
+            }
+            break;
+    }
+    return i;
+}
+
+// スタックが送信したセグメントで対向ノードの状態を更新する
+static int dummy_peer_input(struct net_device *dev, const uint8_t *data, size_t len) {
+    struct dummy *d;
+    struct dummy_peer *peer;
+    const struct ip_hdr *iphdr;
+    const struct dummy_tcp_hdr *hdr;
+    uint16_t hlen, thlen;
+    uint32_t seq, ack, dlen;
+
+    d = PRIV(dev);
+    peer = &d->peer;
+    iphdr = (const struct ip_hdr *)data;
+    hlen = (iphdr->vhl & 0x0f) << 2;
+    if (iphdr->protocol != IP_PROTOCOL_TCP || len < hlen + sizeof(*hdr))
+        return 0;
+    hdr = (const struct dummy_tcp_hdr *)(data + hlen);
+    if (iphdr->dst != d->gen.src || hdr->src != d->gen.dport || hdr->dst != d->gen.sport)
+        return 0;
+    thlen = (hdr->off >> 4) << 2;
+    seq = ntoh32(hdr->seq);
+    ack = ntoh32(hdr->ack);
+    dlen = ntoh16(iphdr->total) - hlen - thlen;
+    mutex_lock(&d->mutex);
+    if (hdr->flg & DUMMY_TCP_FLG_RST) {
+        peer->state = DUMMY_PEER_CLOSED;
+    } else if (peer->state == DUMMY_PEER_SYN_SENT) {
+        if ((hdr->flg & (DUMMY_TCP_FLG_SYN | DUMMY_TCP_FLG_ACK)) == (DUMMY_TCP_FLG_SYN | DUMMY_TCP_FLG_ACK) && ack == peer->iss + 1) {
+            peer->rcv_nxt = seq + 1;
+            peer->snd_una = peer->snd_nxt = ack;
+            peer->wnd = ntoh16(hdr->wnd);
+            peer->state = DUMMY_PEER_ESTABLISHED;
+            gettimeofday(&peer->last, NULL);
+        }
+    } else if (peer->state == DUMMY_PEER_ESTABLISHED && (hdr->flg & DUMMY_TCP_FLG_ACK)) {
+        if (peer->snd_una < ack && ack <= peer->snd_nxt) {
+            peer->snd_una = ack;
+            gettimeofday(&peer->last, NULL);
+        }
+        peer->wnd = ntoh16(hdr->wnd);
+        if (dlen || (hdr->flg & DUMMY_TCP_FLG_FIN))
+            peer->rcv_nxt = seq + dlen + ((hdr->flg & DUMMY_TCP_FLG_FIN) ? 1 : 0);
+    }
+    mutex_unlock(&d->mutex);
+    return 1;
+}
+
+// 送信されたIPデータグラムのチェックサムを検証する
+static int dummy_verify(const uint8_t *data, size_t len) {
+    const struct ip_hdr *hdr;
+    const uint8_t *l4;
+    uint16_t hlen, total;
+
+    if (len < IP_HDR_SIZE_MIN)
+        return -1;
+    hdr = (const struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    total = ntoh16(hdr->total);
+    if ((hdr->vhl >> 4) != IP_VERSION_IPV4 || hlen < IP_HDR_SIZE_MIN || total > len || hlen > total)
+        return -1;
+    if (cksum16((uint16_t *)hdr, hlen, 0))
+        return -1;
+    if (ntoh16(hdr->offset) & 0x3fff)
+        return 0; /* fragment: L4 checksum can't be verified per packet */
+    l4 = data + hlen;
+    switch (hdr->protocol) {
+        case IP_PROTOCOL_ICMP:
+            return cksum16((uint16_t *)l4, total - hlen, 0) ? -1 : 0;
+        case IP_PROTOCOL_UDP:
+            if (total - hlen >= (int)sizeof(struct dummy_udp_hdr) && !((struct dummy_udp_hdr *)l4)->sum)
+                return 0; /* no checksum */
+            /* fall through */
+        case IP_PROTOCOL_TCP:
+            return dummy_l4_cksum(hdr->protocol, hdr->src, hdr->dst, l4, total - hlen) ? -1 : 0;
+    }
+    return 0;
+}
+
+// 送信されたデータを検査して対向ノードに渡す（統計のうち送信数は呼び出し側で数える）
+static void dummy_consume(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len) {
+    struct dummy *d;
+
+    d = PRIV(dev);
     debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, len);
     debugdump(data, len);
-    // drop data データを破棄
+    if (type == NET_PROTOCOL_TYPE_IP && atomic_load(&d->running)) {
+        if (d->gen.verify) {
+            if (dummy_verify(data, len) == -1)
+                atomic_fetch_add_explicit(&d->tx_errors, 1, memory_order_relaxed);
+            else
+                atomic_fetch_add_explicit(&d->tx_verified, 1, memory_order_relaxed);
+        }
+        if (d->gen.mode == DUMMY_GEN_TCP && len >= IP_HDR_SIZE_MIN)
+            dummy_peer_input(dev, data, len);
+    }
+}
 
-    // テスト用に割り込みを発生させる
-    intr_raise_irq(DUMMY_IRQ);
+static int dummy_transmit(
+    struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    struct dummy *d;
+
+    d = PRIV(dev);
+    // drop data データを破棄（数えるだけ）
+    dummy_consume(dev, type, data, len);
+    atomic_fetch_add_explicit(&d->tx_packets, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&d->tx_bytes, len, memory_order_relaxed);
+
+    // テスト用に割り込みを発生させる（ジェネレータ動作中は対向ノードの応答の契機になる）
+    dummy_raise(dev);
     return 0;
 }
 
+// 統計の更新と割り込みはまとめて1回だけ行う
+static int dummy_transmit_batch(struct net_device *dev, uint16_t type, const struct net_vec *vec, int num) {
+    struct dummy *d;
+    unsigned long bytes = 0;
+    int i;
+
+    d = PRIV(dev);
+    for (i = 0; i < num; i++) {
+        dummy_consume(dev, type, vec[i].data, vec[i].len);
+        bytes += vec[i].len;
+    }
+    atomic_fetch_add_explicit(&d->tx_packets, num, memory_order_relaxed);
+    atomic_fetch_add_explicit(&d->tx_bytes, bytes, memory_order_relaxed);
+    dummy_raise(dev);
+    return num;
+}
+
+// テンプレートのパケットを注入する（割り込み処理スレッドからのみ呼び出す）
+static void dummy_generate(struct net_device *dev) {
+    struct dummy *d;
+    unsigned long n, done;
+
+    d = PRIV(dev);
+    if (d->gen.pps) {
+        n = MIN(atomic_load(&d->credits), DUMMY_GEN_BURST);
+        atomic_fetch_sub(&d->credits, n);
+    } else {
+        n = DUMMY_GEN_BURST;
+    }
+    if (d->gen.count)
+        n = MIN(n, d->gen.count - d->injected);
+    if (d->gen.mode == DUMMY_GEN_TCP) {
+        mutex_lock(&d->mutex);
+        done = dummy_peer_output(dev, n);
+        mutex_unlock(&d->mutex);
+    } else {
+        for (done = 0; done < n; done++) {
+            memcpy(d->scratch, d->frame, d->flen);
+            dummy_inject(dev, d->scratch, d->flen);
+        }
+    }
+    d->injected += done;
+    if (d->gen.count && d->injected >= d->gen.count) {
+        atomic_store(&d->running, 0);
+        return;
+    }
+    // 注入できた場合はソフトウェア割り込みの処理後に続けて注入する
+    if (done && (!d->gen.pps || atomic_load(&d->credits)))
+        dummy_raise(dev);
+}
+
 static int dummy_isr(unsigned int irq, void *id) {
-    debugf("irq=%u, dev=%s", irq, ((struct net_device *)id)->name);
+    struct net_device *dev;
+    struct dummy *d;
+
+    dev = (struct net_device *)id;
+    d = PRIV(dev);
+    // 共有IRQなので自分宛ての割り込みかどうかを確認
+    if (!atomic_exchange(&d->pending, 0))
+        return 0;
+    // 作業用バッファを使っている間は印を付けておく（停止時に解放してよいかの判断に使う）
+    // NOTE: busyを立ててからrunningを読むので、停止側がrunningを下ろした後にbusyが0ならそれ以降は参照しない
+    atomic_store(&d->busy, 1);
+    if (atomic_load(&d->running))
+        dummy_generate(dev);
+    else
+        debugf("irq=%u, dev=%s", irq, dev->name);
+    atomic_store(&d->busy, 0);
+    return 0;
+}
+
+// ジェネレータのスレッド（pps指定時は経過時間に応じたクレジットを与え、定期的に割り込みを発生させる）
+static void *dummy_generator_thread(void *arg) {
+    struct net_device *dev;
+    struct dummy *d;
+    const struct timespec tick = {0, DUMMY_GEN_TICK};
+    struct timeval start, now, diff;
+    unsigned long given = 0, due;
+
+    dev = (struct net_device *)arg;
+    d = PRIV(dev);
+    gettimeofday(&start, NULL);
+    while (atomic_load(&d->running)) {
+        if (d->gen.pps) {
+            gettimeofday(&now, NULL);
+            timersub(&now, &start, &diff);
+            due = (unsigned long)((double)d->gen.pps * (diff.tv_sec + diff.tv_usec / 1000000.0));
+            atomic_fetch_add(&d->credits, due - given);
+            given = due;
+        }
+        dummy_raise(dev);
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+int dummy_generator_start(struct net_device *dev, const struct dummy_generator *gen) {
+    struct dummy *d;
+    int err;
+
+    d = PRIV(dev);
+    // 注入を終えていても停止するまでは開始できない（スレッドの回収とバッファの解放は停止時に行う）
+    if (dev->type != NET_DEVICE_TYPE_DUMMY || d->frame) {
+        errorf("not available, dev=%s", dev->name);
+        return -1;
+    }
+    if (gen->mode == DUMMY_GEN_NONE || gen->len > DUMMY_MTU - IP_HDR_SIZE_MIN - sizeof(struct dummy_tcp_hdr)) {
+        errorf("invalid parameter, mode=%d, len=%zu", gen->mode, gen->len);
+        return -1;
+    }
+    if (gen->mode == DUMMY_GEN_TCP && !gen->len) {
+        errorf("tcp requires payload");
+        return -1;
+    }
+    d->gen = *gen;
+    d->frame = memory_alloc((IP_HDR_SIZE_MIN + sizeof(struct dummy_tcp_hdr) + gen->len) * 2);
+    if (!d->frame) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    d->scratch = d->frame + IP_HDR_SIZE_MIN + sizeof(struct dummy_tcp_hdr) + gen->len;
+    // 受信キューを経由せずにIPへ渡す
+    // NOTE: TCPの対向ノードはmutexを保持したまま注入し、スタックの応答（dummy_transmit）でも同じmutexを取るので直接入力にはしない
+    if (gen->mode == DUMMY_GEN_TCP)
+        dev->flags &= ~NET_DEVICE_FLAG_DIRECT_INPUT;
+    else
+        dev->flags |= NET_DEVICE_FLAG_DIRECT_INPUT;
+    dummy_template_build(d);
+    memset(&d->peer, 0, sizeof(d->peer));
+    d->injected = 0;
+    atomic_store(&d->credits, 0);
+    atomic_store(&d->running, 1);
+    err = pthread_create(&d->thread, NULL, dummy_generator_thread, dev);
+    if (err) {
+        errorf("pthread_create() failure, err=%d", err);
+        atomic_store(&d->running, 0);
+        memory_free(d->frame);
+        d->frame = NULL;
+        return -1;
+    }
+    infof("dev=%s, mode=%d, len=%zu, pps=%lu, count=%lu", dev->name, gen->mode, gen->len, gen->pps, gen->count);
+    return 0;
+}
+
+int dummy_generator_stop(struct net_device *dev) {
+    struct dummy *d;
+
+    d = PRIV(dev);
+    if (dev->type != NET_DEVICE_TYPE_DUMMY || !d->frame) {
+        errorf("not started, dev=%s", dev->name);
+        return -1;
+    }
+    atomic_store(&d->running, 0);
+    pthread_join(d->thread, NULL);
+    // 割り込みハンドラが作業用バッファを使い終わるのを待ってから解放する
+    while (atomic_load(&d->busy))
+        sched_yield();
+    memory_free(d->frame);
+    d->frame = NULL;
+    d->scratch = NULL;
+    infof("dev=%s, injected=%lu", dev->name, d->injected);
+    return 0;
+}
+
+int dummy_get_stats(struct net_device *dev, struct dummy_stats *stats) {
+    struct dummy *d;
+
+    if (dev->type != NET_DEVICE_TYPE_DUMMY)
+        return -1;
+    d = PRIV(dev);
+    stats->rx_packets = atomic_load(&d->rx_packets);
+    stats->rx_dropped = atomic_load(&d->rx_dropped);
+    stats->tx_packets = atomic_load(&d->tx_packets);
+    stats->tx_bytes = atomic_load(&d->tx_bytes);
+    stats->tx_verified = atomic_load(&d->tx_verified);
+    stats->tx_errors = atomic_load(&d->tx_errors);
     return 0;
 }
 
 // デバイスドライバが実装している関数へのポインタを設定する
 static struct net_device_ops dummy_ops = {
     .transmit = dummy_transmit, // 送信関数(transmit)のみ設定
+    .transmit_batch = dummy_transmit_batch,
 };
 
 struct net_device *dummy_init(void) {
     struct net_device *dev;
+    struct dummy *d;
 
     // デバイスを設定
     dev = net_device_alloc();
@@ -46,13 +575,23 @@ struct net_device *dummy_init(void) {
     dev->hlen = 0; // ヘッダは存在しない
     dev->alen = 0; // アドレスは存在しない
     dev->ops = &dummy_ops; // デバイスドライバが実装している関数へのポインタを設定する
-    
+
+    // ジェネレータ用のプライベートなデータ
+    d = memory_alloc(sizeof(*d));
+    if (!d) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    mutex_init(&d->mutex);
+    dev->priv = d;
+
     // デバイスを登録する
     if (net_device_register(dev) == -1) {
         errorf("net_device_register() failure");
+        memory_free(d);
         return NULL;
     }
-    
+
     // 割り込みハンドラとして dummy_isr を登録する
     intr_request_irq(DUMMY_IRQ, dummy_isr, INTR_IRQ_SHARED, dev->name, dev);
     debugf("initialized, dev=%s", dev->name);
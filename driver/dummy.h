@@ -1,8 +1,43 @@
 #ifndef DUMMY_H
 #define DUMMY_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "net.h"
+#include "ip.h"
+
+// 受信トラフィックのテンプレート
+#define DUMMY_GEN_NONE 0
+#define DUMMY_GEN_ICMP 1 /* Echo request */
+#define DUMMY_GEN_UDP  2 /* datagram to dst:dport */
+#define DUMMY_GEN_TCP  3 /* scripted peer connects to dst:dport and sends data */
+
+struct dummy_generator {
+    int mode;
+    ip_addr_t src;          /* peer address (sender of synthesized packets) */
+    ip_addr_t dst;          /* local address */
+    uint16_t sport;         /* network byte order */
+    uint16_t dport;         /* network byte order */
+    size_t len;             /* payload length */
+    unsigned long pps;      /* 0: as fast as the stack can take */
+    unsigned long count;    /* 0: unlimited */
+    int verify;             /* verify checksums of outbound frames */
+};
+
+struct dummy_stats {
+    unsigned long rx_packets; /* injected into the stack */
+    unsigned long rx_dropped; /* rejected by net_input_handler() */
+    unsigned long tx_packets;
+    unsigned long tx_bytes;
+    unsigned long tx_verified;
+    unsigned long tx_errors;  /* verification failure */
+};
 
 extern struct net_device *dummy_init(void);
 
+extern int dummy_generator_start(struct net_device *dev, const struct dummy_generator *gen);
+extern int dummy_generator_stop(struct net_device *dev);
+extern int dummy_get_stats(struct net_device *dev, struct dummy_stats *stats);
+
 #endif
@@ -65,6 +65,27 @@ static int ether_tap_addr(struct net_device *dev) {
     return 0;
 }
 
+// OS側から見えているTAPデバイスのMTUを設定する
+static int ether_tap_mtu(struct net_device *dev, uint16_t mtu) {
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_mtu = mtu;
+    if (ioctl(soc, SIOCSIFMTU, &ifr) == -1) {
+        errorf("ioctl [SIOCSIFMTU]: %s, dev=%s", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    close(soc);
+    return 0;
+}
+
 // Ethernetデバイス（TAP）オープン/クローズ
 static int ether_tap_open(struct net_device *dev) {
     struct ether_tap *tap;
@@ -117,6 +138,15 @@ static int ether_tap_open(struct net_device *dev) {
         return -1;
     }
 
+    // デフォルト以外のMTUが設定されていたらOS側のTAPデバイスにも反映する
+    if (dev->mtu != ETHER_PAYLOAD_SIZE_MAX) {
+        if (ether_tap_mtu(dev, dev->mtu) == -1) {
+            errorf("ether_tap_mtu() failure, dev=%s", dev->name);
+            close(tap->fd);
+            return -1;
+        }
+    }
+
     //HWアドレスが明示的に設定されていなかったら
     if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         // OS側から見えているTAPデバイスのHWアドレスを取得して使用する
@@ -132,6 +162,7 @@ static int ether_tap_open(struct net_device *dev) {
 static int ether_tap_close(struct net_device *dev) {
     // ディスクリプタをクローズ
     close(PRIV(dev)->fd);
+    PRIV(dev)->fd = -1;
     return 0;
 }
 
@@ -208,10 +239,22 @@ static int ether_tap_isr(unsigned int irq, void *id) {
     return 0;
 }
 
+static int ether_tap_set_mtu(struct net_device *dev, uint16_t mtu) {
+    if (!ether_mtu_valid(mtu)) {
+        errorf("invalid mtu, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    // オープン前ならオープン時に反映する
+    if (PRIV(dev)->fd == -1)
+        return 0;
+    return ether_tap_mtu(dev, mtu);
+}
+
 static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
     .transmit = ether_tap_transmit,
+    .set_mtu = ether_tap_set_mtu,
 };
 
 // Ethernetデバイス（TAP）の生成
@@ -2,115 +2,203 @@
 #include <stddef.h> // NULLとoffsetof
 #include <stdint.h> // intの型たち
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/time.h>
 
 #include "platform.h"
 #include "util.h"
 #include "net.h"
 
+#include "driver/loopback.h"
+
 #define LOOPBACK_MTU UINT16_MAX
-#define LOOPBACK_QUEUE_LIMIT 16
+#define LOOPBACK_RING_SIZE 64
+#define LOOPBACK_WAIT_TIMEOUT 1000000 /* nano seconds */
 #define LOOPBACK_IRQ (INTR_IRQ_BASE+1)
 
 #define PRIV(x) ((struct loopback *)x->priv)
 
-/* 
+/*
  * ループバックデバイスのドライバ内で使用する
  * プライベートなデータを格納する構造体
  */
 struct loopback {
     int irq;
-    mutex_t mutex;
-    struct queue_head queue;
+    unsigned int num;     // リングのスロット数
+    struct ring *ring;    // 送信側（複数スレッド）と割り込みハンドラの間の受け渡し用リング
+    atomic_int pending;   // 割り込みを発生済みでまだ処理されていない
+    atomic_int waiters;   // リングの空きを待っている送信側スレッドの数
+    mutex_t mutex;        // NOTE: リングが一杯の時の待機にだけ使う（通常の送受信では使わない）
+    struct sched_ctx ctx;
 };
 
 /*
- * キューのエントリの構造体
- * データ本体と付随する情報（パラメータ）を格納
- * この構造体の最後のメンバは"フレキシブル配列メンバ"と呼ばれる特殊なメンバ変数
- * 構造体の最後にだけ配置できるサイズ不明の配列
- * メンバ変数としてアクセスできるが構造体のサイズには含まれない
- * （必ずデータ部分も含めてメモリを確保すること）
-*/ 
-struct loopback_queue_entry {
+ * リングのスロットの構造体
+ * スロットはデバイスのオープン時にMTU分のサイズで確保しておき、送受信のたびにメモリを確保しない
+*/
+struct loopback_frame {
     uint16_t type;
     size_t len;
     uint8_t data[];
 };
 
-static int loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
-    struct loopback_queue_entry *entry;
-    unsigned int num;
-
-    // キューへのアクセスをmutexで保護する（unlockを忘れずに）
-    mutex_lock(&PRIV(dev)->mutex);
-    
-    // キューの上限を超えていたらエラーを返す
-    if (PRIV(dev)->queue.num >= LOOPBACK_QUEUE_LIMIT) {
-        mutex_unlock(&(PRIV(dev))->mutex);
-        errorf("queue is full");
+static int loopback_open(struct net_device *dev) {
+    struct loopback *lo;
+
+    lo = PRIV(dev);
+    lo->ring = ring_alloc(lo->num, sizeof(struct loopback_frame) + dev->mtu);
+    if (!lo->ring) {
+        errorf("ring_alloc() failure, dev=%s", dev->name);
         return -1;
     }
+    atomic_store(&lo->pending, 0);
+    debugf("dev=%s, ring=%u, mtu=%u", dev->name, lo->num, dev->mtu);
+    return 0;
+}
 
-    // キューに格納するエントリのメモリを確保
-    entry = memory_alloc(sizeof(*entry) + len);
-    if (!entry) {
-        mutex_unlock(&PRIV(dev)->mutex);
-        errorf("memory_alloc() failure");
-        return -1;
+static int loopback_close(struct net_device *dev) {
+    ring_free(PRIV(dev)->ring);
+    PRIV(dev)->ring = NULL;
+    return 0;
+}
+
+// リングに溜まっているフレームを全てプロトコルスタックに渡す（割り込み処理スレッドからのみ呼び出す）
+static void loopback_drain(struct net_device *dev) {
+    struct loopback *lo;
+    struct loopback_frame *frame;
+    unsigned int n;
+
+    lo = PRIV(dev);
+    for (n = 0; n < lo->num; n++) {
+        frame = ring_peek(lo->ring);
+        if (!frame)
+            break;
+        debugf("ring poped, dev=%s, type=0x%04x, len=%zd", dev->name, frame->type, frame->len);
+        debugdump(frame->data, frame->len);
+        // スロットのデータをそのまま渡す（ロックは保持しない）
+        net_input_handler(frame->type, frame->data, frame->len, dev);
+        ring_release(lo->ring, frame);
+    }
+    // 空きを待っている送信側がいれば起床させる
+    if (n && atomic_load(&lo->waiters)) {
+        mutex_lock(&lo->mutex);
+        sched_wakeup(&lo->ctx);
+        mutex_unlock(&lo->mutex);
+    }
+}
+
+// リングが一杯の時に送信側を待たせる（エラーを返して捨てるのではなくバックプレッシャをかける）
+static int loopback_wait(struct net_device *dev) {
+    struct loopback *lo;
+    struct timespec abstime;
+    int ret = 0;
+
+    lo = PRIV(dev);
+    if (intr_in_interrupt()) {
+        // 割り込み処理スレッド自身が送信している場合は待っても空かないので自分で受信処理を進める
+        loopback_drain(dev);
+        return 0;
+    }
+    mutex_lock(&lo->mutex);
+    atomic_fetch_add(&lo->waiters, 1);
+    if (ring_count(lo->ring) >= lo->num) {
+        // 起床の取りこぼしに備えてタイムアウト付きで待つ
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        timespec_add_nsec(&abstime, LOOPBACK_WAIT_TIMEOUT);
+        if (sched_sleep(&lo->ctx, &lo->mutex, &abstime) == -1 && errno == EINTR)
+            ret = -1;
+    }
+    atomic_fetch_sub(&lo->waiters, 1);
+    mutex_unlock(&lo->mutex);
+    return ret;
+}
+
+// フレームをリングに積む（割り込みは呼び出し側で発生させる）
+static int loopback_push(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len) {
+    struct loopback *lo;
+    struct loopback_frame *frame;
+
+    lo = PRIV(dev);
+    // リングのスロットを確保（空きがなければ受信側が処理するまで待つ）
+    while (!(frame = ring_reserve(lo->ring))) {
+        if (!NET_DEVICE_IS_UP(dev) || loopback_wait(dev) == -1) {
+            errorf("ring is full, dev=%s", dev->name);
+            return -1;
+        }
     }
 
     // メタデータの設定とデータ本体のコピー
-    entry->type = type;
-    entry->len = len;
-    memcpy(entry->data, data, len);
-    
-    // エントリをキューへ格納
-    queue_push(&PRIV(dev)->queue, entry);
-
-    num = PRIV(dev)->queue.num;
-    mutex_unlock(&PRIV(dev)->mutex);
-    debugf("queue pushed (num:%u), dev=%s, type=0x%04x, len=%zd", num, dev->name, type, len);
+    // NOTE: 送信側は（IPのヘッダを付けたデータグラムを含めて）スタック上のバッファを渡してくるので、所有権を受け取れない
+    //       ここでの1回のコピーだけにして、受信側はスロットのデータをそのまま使う（メモリの確保とコピーはしない）
+    frame->type = type;
+    frame->len = len;
+    memcpy(frame->data, data, len);
+    ring_commit(lo->ring, frame);
+    debugf("ring pushed, dev=%s, type=0x%04x, len=%zd", dev->name, type, len);
     debugdump(data, len);
+    return 0;
+}
+
+static void loopback_raise(struct net_device *dev) {
+    // 未処理の割り込みがなければ割り込みを発生させる
+    if (!atomic_exchange(&PRIV(dev)->pending, 1))
+        intr_raise_irq(PRIV(dev)->irq);
+}
 
-    // 割り込みを発生させる
-    intr_raise_irq(PRIV(dev)->irq);
+static int loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    if (loopback_push(dev, type, data, len) == -1)
+        return -1;
+    loopback_raise(dev);
     return 0;
 }
 
+// まとめて積んでから割り込みを1回だけ発生させる
+static int loopback_transmit_batch(struct net_device *dev, uint16_t type, const struct net_vec *vec, int num) {
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if (loopback_push(dev, type, vec[i].data, vec[i].len) == -1)
+            break;
+    }
+    if (i)
+        loopback_raise(dev);
+    return i;
+}
+
 // ループバックの割り込みハンドラ
 static int loopback_isr(unsigned int irq, void *id) {
     struct net_device *dev;
-    struct loopback_queue_entry *entry;
 
     dev = (struct net_device *)id;
-    
-    // キューのアクセスをmutexで保護
-    mutex_lock(&PRIV(dev)->mutex);
-
-    while (1) {
-        entry = queue_pop(&PRIV(dev)->queue);
-        if (!entry)
-            break;
-        
-        debugf("queue poped (num:%u), dev=%s, type=0x%04x, len=%zd", PRIV(dev)->queue.num, dev->name, entry->type, entry->len);
-        debugdump(entry->data, entry->len);
-        
-        // net_input_handler()に受信データと本体と付随する情報を渡す
-        net_input_handler(entry->type, entry->data, entry->len, dev);
-
-        // エントリのメモリを開放する
-        memory_free(entry);
-    }
-
-    // 忘れずにmutexをunlock
-    mutex_unlock(&PRIV(dev)->mutex);
+    if (!PRIV(dev)->ring)
+        return 0;
+    atomic_exchange(&PRIV(dev)->pending, 0);
+    loopback_drain(dev);
+    // 処理しきれなかった分は次の割り込みで処理する
+    if (ring_count(PRIV(dev)->ring) && !atomic_exchange(&PRIV(dev)->pending, 1))
+        intr_raise_irq(irq);
     return 0;
 }
 
 static struct net_device_ops loopback_ops = {
+    .open = loopback_open,
+    .close = loopback_close,
     .transmit = loopback_transmit,
+    .transmit_batch = loopback_transmit_batch,
 };
 
+/* NOTE: must not be call after net_run() */
+int loopback_set_ring_size(struct net_device *dev, unsigned int num) {
+    if (dev->type != NET_DEVICE_TYPE_LOOPBACK || !num) {
+        errorf("invalid argument, dev=%s, num=%u", dev->name, num);
+        return -1;
+    }
+    PRIV(dev)->num = num;
+    return 0;
+}
+
 struct net_device *loopback_init(void) {
     struct net_device *dev;
     struct loopback *lo;
@@ -136,8 +224,9 @@ struct net_device *loopback_init(void) {
         return NULL;
     }
     lo->irq = LOOPBACK_IRQ;
+    lo->num = LOOPBACK_RING_SIZE;
     mutex_init(&lo->mutex);
-    queue_init(&lo->queue);
+    sched_ctx_init(&lo->ctx);
 
     // プライベートなデータをデバイス構造体に格納する
     // ドライバの関数が呼び出される際にはデバイス構造体が渡されるのでここなら取り出す
@@ -4,5 +4,6 @@
 #include "net.h"
 
 extern struct net_device *loopback_init(void);
+extern int loopback_set_ring_size(struct net_device *dev, unsigned int num);
 
-#endif
\ No newline at end of file
+#endif
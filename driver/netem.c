@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "platform.h"
+#include "util.h"
+#include "net.h"
+
+#include "driver/netem.h"
+
+#define NETEM_MTU UINT16_MAX
+#define NETEM_IRQ (INTR_IRQ_BASE+3)
+
+/*
+ * 回線エミュレーション
+ * 送信されたフレームに遅延・揺らぎ・損失・重複・順序入れ替え・帯域制限を加えてから送り出す
+ *   デバイスモード: netem_init() で生成した仮想回線。対向デバイス（または自分自身）の受信として割り込みで渡す
+ *   ラップモード  : netem_wrap() で既存デバイスの transmit を差し替え、遅延後に元のドライバで送信する
+ */
+
+struct netem_packet {
+    struct netem_packet *next;
+    uint64_t due; /* micro seconds (CLOCK_REALTIME) */
+    uint16_t type;
+    int has_dst;
+    uint8_t dst[NET_DEVICE_ADDR_LEN];
+    size_t len;
+    uint8_t data[];
+};
+
+struct netem {
+    struct netem *next;          // ラップしたデバイスのリスト
+    struct net_device *dev;
+    struct net_device *peer;     // デバイスモードの受け取り側
+    struct net_device_ops *lower; // ラップモードの元のドライバ
+    struct net_device_ops ops;    // ラップモードで差し替えるops
+    struct netem_params params;
+    uint64_t rng;
+    mutex_t mutex;
+    struct sched_ctx ctx;
+    pthread_t thread;
+    int running;
+    struct netem_packet *head;   // 送出予定時刻の順に並べる
+    unsigned int num;
+    uint64_t link_free;          // 帯域制限：回線が空く時刻
+    struct queue_head ready;     // デバイスモード：割り込みハンドラへの受け渡し
+    atomic_int pending;
+    struct netem_stats stats;
+};
+
+#define PRIV(x) ((struct netem *)x->priv)
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
+static struct netem *wraps;
+
+static uint64_t netem_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * RNG (xorshift64*)
+ * NOTE: must be called after mutex locked
+ */
+
+static void netem_rng_seed(struct netem *em, uint32_t seed) {
+    uint64_t z;
+
+    // splitmix64 で種を展開する（0 にならないように）
+    z = (uint64_t)seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    em->rng = (z ^ (z >> 31)) | 1;
+}
+
+static uint64_t netem_rng_next(struct netem *em) {
+    em->rng ^= em->rng >> 12;
+    em->rng ^= em->rng << 25;
+    em->rng ^= em->rng >> 27;
+    return em->rng * 0x2545f4914f6cdd1dULL;
+}
+
+// [0, 100) の一様乱数
+static double netem_rng_percent(struct netem *em) {
+    return (netem_rng_next(em) >> 11) * (100.0 / (1ULL << 53));
+}
+
+static int netem_chance(struct netem *em, double percent) {
+    if (percent <= 0)
+        return 0;
+    return netem_rng_percent(em) < percent;
+}
+
+/*
+ * Delay line
+ * NOTE: must be called after mutex locked
+ */
+
+static void netem_schedule(struct netem *em, struct netem_packet *pkt) {
+    struct netem_packet **p;
+
+    // 送出予定時刻の順に挿入する（同じ時刻なら到着順）
+    for (p = &em->head; *p && (*p)->due <= pkt->due; p = &(*p)->next)
+        ;
+    pkt->next = *p;
+    *p = pkt;
+    em->num++;
+}
+
+static uint64_t netem_delay(struct netem *em, size_t len) {
+    struct netem_params *params;
+    uint64_t now, start, delay;
+    long jitter;
+
+    params = &em->params;
+    now = netem_now();
+    delay = params->delay;
+    if (params->jitter) {
+        jitter = (long)(netem_rng_next(em) % (2 * params->jitter + 1)) - (long)params->jitter;
+        delay = (long)delay + jitter > 0 ? (uint64_t)((long)delay + jitter) : 0;
+    }
+    if (params->rate) {
+        // 直前のフレームの送出が終わるまで待ってからシリアライズ時間分だけ回線を占有する
+        start = em->link_free > now ? em->link_free : now;
+        em->link_free = start + (uint64_t)len * 8 * 1000000 / params->rate;
+        return em->link_free + delay;
+    }
+    return now + delay;
+}
+
+static struct netem_packet *netem_packet_alloc(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    struct netem_packet *pkt;
+
+    pkt = memory_alloc(sizeof(*pkt) + len);
+    if (!pkt) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    pkt->type = type;
+    if (dst) {
+        memcpy(pkt->dst, dst, dev->alen);
+        pkt->has_dst = 1;
+    }
+    pkt->len = len;
+    memcpy(pkt->data, data, len);
+    return pkt;
+}
+
+static int netem_enqueue(struct netem *em, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    struct netem_packet *pkt, *dup;
+    unsigned int limit;
+
+    mutex_lock(&em->mutex);
+    em->stats.packets++;
+    limit = em->params.limit ? em->params.limit : NETEM_LIMIT_DEFAULT;
+    if (em->num >= limit) {
+        em->stats.overlimit++;
+        mutex_unlock(&em->mutex);
+        return 0; /* dropped on the wire */
+    }
+    if (netem_chance(em, em->params.loss)) {
+        em->stats.lost++;
+        mutex_unlock(&em->mutex);
+        return 0;
+    }
+    pkt = netem_packet_alloc(em->dev, type, data, len, dst);
+    if (!pkt) {
+        mutex_unlock(&em->mutex);
+        return -1;
+    }
+    pkt->due = netem_delay(em, len);
+    if (em->params.delay && netem_chance(em, em->params.reorder)) {
+        // 遅延させずに送り出すことで先行するフレームを追い越させる
+        pkt->due = netem_now();
+        em->stats.reordered++;
+    }
+    netem_schedule(em, pkt);
+    if (netem_chance(em, em->params.duplicate)) {
+        dup = netem_packet_alloc(em->dev, type, data, len, dst);
+        if (dup) {
+            dup->due = pkt->due;
+            netem_schedule(em, dup);
+            em->stats.duplicated++;
+        }
+    }
+    sched_wakeup(&em->ctx);
+    mutex_unlock(&em->mutex);
+    return 0;
+}
+
+// 送出予定時刻を迎えたフレームを送り出すスレッド
+static void *netem_thread(void *arg) {
+    struct netem *em;
+    struct netem_packet *pkt;
+    struct timespec abstime;
+    uint64_t now;
+
+    em = (struct netem *)arg;
+    mutex_lock(&em->mutex);
+    while (em->running) {
+        pkt = em->head;
+        if (!pkt) {
+            sched_sleep(&em->ctx, &em->mutex, NULL);
+            continue;
+        }
+        now = netem_now();
+        if (pkt->due > now) {
+            abstime.tv_sec = pkt->due / 1000000;
+            abstime.tv_nsec = (pkt->due % 1000000) * 1000;
+            sched_sleep(&em->ctx, &em->mutex, &abstime);
+            continue;
+        }
+        em->head = pkt->next;
+        em->num--;
+        em->stats.delivered++;
+        if (em->lower) {
+            // ラップモード：元のドライバで送信する（ロックは保持しない）
+            mutex_unlock(&em->mutex);
+            if (em->lower->transmit(em->dev, pkt->type, pkt->data, pkt->len, pkt->has_dst ? pkt->dst : NULL) == -1)
+                errorf("transmit failure, dev=%s", em->dev->name);
+            memory_free(pkt);
+            mutex_lock(&em->mutex);
+        } else {
+            // デバイスモード：受信は割り込みハンドラから行う
+            queue_push(&em->ready, pkt);
+            if (!atomic_exchange(&em->pending, 1))
+                intr_raise_irq(NETEM_IRQ);
+        }
+    }
+    mutex_unlock(&em->mutex);
+    return NULL;
+}
+
+static int netem_start(struct netem *em) {
+    int err;
+
+    sched_ctx_init(&em->ctx);
+    em->running = 1;
+    err = pthread_create(&em->thread, NULL, netem_thread, em);
+    if (err) {
+        errorf("pthread_create() failure, err=%d", err);
+        em->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static void netem_stop(struct netem *em) {
+    struct netem_packet *pkt;
+
+    mutex_lock(&em->mutex);
+    em->running = 0;
+    sched_interrupt(&em->ctx);
+    mutex_unlock(&em->mutex);
+    pthread_join(em->thread, NULL);
+    // 回線上に残っているフレームは失われる
+    while ((pkt = em->head)) {
+        em->head = pkt->next;
+        memory_free(pkt);
+    }
+    em->num = 0;
+    while ((pkt = queue_pop(&em->ready)))
+        memory_free(pkt);
+}
+
+/*
+ * Device mode
+ */
+
+static int netem_open(struct net_device *dev) {
+    return netem_start(PRIV(dev));
+}
+
+static int netem_close(struct net_device *dev) {
+    netem_stop(PRIV(dev));
+    return 0;
+}
+
+static int netem_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, len);
+    debugdump(data, len);
+    return netem_enqueue(PRIV(dev), type, data, len, dst);
+}
+
+static int netem_isr(unsigned int irq, void *id) {
+    struct net_device *dev;
+    struct netem *em;
+    struct netem_packet *pkt;
+
+    dev = (struct net_device *)id;
+    em = PRIV(dev);
+    // 共有IRQなので自分宛ての割り込みかどうかを確認
+    if (!atomic_exchange(&em->pending, 0))
+        return 0;
+    while (1) {
+        mutex_lock(&em->mutex);
+        pkt = queue_pop(&em->ready);
+        mutex_unlock(&em->mutex);
+        if (!pkt)
+            break;
+        net_input_handler(pkt->type, pkt->data, pkt->len, em->peer);
+        memory_free(pkt);
+    }
+    return 0;
+}
+
+static struct net_device_ops netem_ops = {
+    .open = netem_open,
+    .close = netem_close,
+    .transmit = netem_transmit,
+};
+
+static struct netem *netem_alloc(struct net_device *dev) {
+    struct netem *em;
+
+    em = memory_alloc(sizeof(*em));
+    if (!em) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    em->dev = dev;
+    mutex_init(&em->mutex);
+    sched_ctx_init(&em->ctx);
+    queue_init(&em->ready);
+    netem_rng_seed(em, 0);
+    return em;
+}
+
+struct net_device *netem_init(void) {
+    struct net_device *dev;
+    struct netem *em;
+
+    dev = net_device_alloc();
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    dev->type = NET_DEVICE_TYPE_NETEM;
+    dev->mtu = NETEM_MTU;
+    dev->hlen = 0; // ヘッダは存在しない
+    dev->alen = 0; // アドレスは存在しない
+    dev->flags = NET_DEVICE_FLAG_P2P;
+    dev->ops = &netem_ops;
+
+    em = netem_alloc(dev);
+    if (!em)
+        return NULL;
+    em->peer = dev; // 対向が設定されるまでは自分自身に折り返す
+    dev->priv = em;
+
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        return NULL;
+    }
+    intr_request_irq(NETEM_IRQ, netem_isr, INTR_IRQ_SHARED, dev->name, dev);
+    debugf("initialized, dev=%s", dev->name);
+    return dev;
+}
+
+/* NOTE: must not be call after net_run() */
+int netem_pair(struct net_device *a, struct net_device *b) {
+    if (a->type != NET_DEVICE_TYPE_NETEM || b->type != NET_DEVICE_TYPE_NETEM) {
+        errorf("not a netem device, a=%s, b=%s", a->name, b->name);
+        return -1;
+    }
+    PRIV(a)->peer = b;
+    PRIV(b)->peer = a;
+    infof("paired, %s <-> %s", a->name, b->name);
+    return 0;
+}
+
+/*
+ * Wrap mode
+ */
+
+static struct netem *netem_wrap_lookup(struct net_device *dev) {
+    struct netem *em;
+
+    for (em = wraps; em; em = em->next) {
+        if (em->dev == dev)
+            return em;
+    }
+    return NULL;
+}
+
+static int netem_wrap_open(struct net_device *dev) {
+    struct netem *em;
+
+    em = netem_wrap_lookup(dev);
+    if (em->lower->open && em->lower->open(dev) == -1)
+        return -1;
+    return netem_start(em);
+}
+
+static int netem_wrap_close(struct net_device *dev) {
+    struct netem *em;
+
+    em = netem_wrap_lookup(dev);
+    netem_stop(em);
+    return em->lower->close ? em->lower->close(dev) : 0;
+}
+
+static int netem_wrap_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    return netem_enqueue(netem_wrap_lookup(dev), type, data, len, dst);
+}
+
+/* NOTE: must not be call after net_run() */
+int netem_wrap(struct net_device *dev) {
+    struct netem *em;
+
+    if (dev->type == NET_DEVICE_TYPE_NETEM || netem_wrap_lookup(dev)) {
+        errorf("already impaired, dev=%s", dev->name);
+        return -1;
+    }
+    em = netem_alloc(dev);
+    if (!em)
+        return -1;
+    // ドライバの ops は共有されている可能性があるので書き換えずにデバイスごとの複製を差し込む
+    em->lower = dev->ops;
+    em->ops = *dev->ops;
+    em->ops.open = netem_wrap_open;
+    em->ops.close = netem_wrap_close;
+    em->ops.transmit = netem_wrap_transmit;
+    em->ops.transmit_batch = NULL; // まとめて送る場合もnetem_wrap_transmit()を通す
+    dev->ops = &em->ops;
+    em->next = wraps;
+    wraps = em;
+    infof("wrapped, dev=%s", dev->name);
+    return 0;
+}
+
+/*
+ * Configuration
+ */
+
+static struct netem *netem_get(struct net_device *dev) {
+    if (dev->type == NET_DEVICE_TYPE_NETEM)
+        return PRIV(dev);
+    return netem_wrap_lookup(dev);
+}
+
+int netem_set_params(struct net_device *dev, const struct netem_params *params) {
+    struct netem *em;
+
+    em = netem_get(dev);
+    if (!em) {
+        errorf("not impaired, dev=%s", dev->name);
+        return -1;
+    }
+    if (params->loss < 0 || params->loss > 100 || params->duplicate < 0 || params->duplicate > 100 ||
+        params->reorder < 0 || params->reorder > 100) {
+        errorf("invalid probability");
+        return -1;
+    }
+    mutex_lock(&em->mutex);
+    em->params = *params;
+    netem_rng_seed(em, params->seed);
+    em->link_free = 0;
+    mutex_unlock(&em->mutex);
+    infof("dev=%s, delay=%luus, jitter=%luus, loss=%.2f%%, duplicate=%.2f%%, reorder=%.2f%%, rate=%lubps, seed=%u",
+        dev->name, params->delay, params->jitter, params->loss, params->duplicate, params->reorder, params->rate, params->seed);
+    return 0;
+}
+
+int netem_get_stats(struct net_device *dev, struct netem_stats *stats) {
+    struct netem *em;
+
+    em = netem_get(dev);
+    if (!em) {
+        errorf("not impaired, dev=%s", dev->name);
+        return -1;
+    }
+    mutex_lock(&em->mutex);
+    *stats = em->stats;
+    mutex_unlock(&em->mutex);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef NETEM_H
+#define NETEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+#define NETEM_LIMIT_DEFAULT 1000 /* packets */
+
+// 回線の劣化条件（確率は%で指定する）
+struct netem_params {
+    unsigned long delay;     /* micro seconds */
+    unsigned long jitter;    /* micro seconds (uniform, +/-) */
+    double loss;             /* % */
+    double duplicate;        /* % */
+    double reorder;          /* % (sent without delay, requires delay) */
+    unsigned long rate;      /* bits per second (0: unlimited) */
+    unsigned int limit;      /* packets in flight (0: NETEM_LIMIT_DEFAULT) */
+    uint32_t seed;           /* same seed, same impairment sequence */
+};
+
+struct netem_stats {
+    unsigned long packets;
+    unsigned long delivered;
+    unsigned long lost;
+    unsigned long duplicated;
+    unsigned long reordered;
+    unsigned long overlimit;
+};
+
+/*
+ * netem_init() creates a virtual wire device. Frames transmitted on it are
+ * delivered to the paired device (see netem_pair()), or back to itself.
+ * netem_wrap() impairs the transmit side of an existing device instead.
+ */
+extern struct net_device *netem_init(void);
+extern int netem_pair(struct net_device *a, struct net_device *b);
+extern int netem_wrap(struct net_device *dev);
+
+extern int netem_set_params(struct net_device *dev, const struct netem_params *params);
+extern int netem_get_stats(struct net_device *dev, struct netem_stats *stats);
+
+#endif
@@ -64,10 +64,16 @@ static void ether_dump(const uint8_t *frame, size_t flen) {
 
 // Ethernetフレームの生成と出力
 int ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ether_transmit_func_t callback) {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
+    uint8_t frame[ETHER_JUMBO_FRAME_SIZE_MAX];
     struct ether_hdr *hdr;
     size_t flen, pad = 0;
 
+    // フレームのサイズはデバイスのMTUで決まる
+    if (len > dev->mtu) {
+        errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
+        return -1;
+    }
+
     // Etherフレームの生成
     // ヘッダの各フィールドに値を設定
     // ヘッダの直後にデータをコピー
@@ -78,8 +84,11 @@ int ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *
     memcpy(hdr+1, data, len);
 
     // 最小サイズに満たない場合はパディングして挿入してサイズを調整
-    if (len < ETHER_PAYLOAD_SIZE_MIN)
+    // NOTE: バッファ全体はゼロクリアせず、パディング部分だけを埋める
+    if (len < ETHER_PAYLOAD_SIZE_MIN) {
         pad = ETHER_PAYLOAD_SIZE_MIN - len;
+        memset((uint8_t *)(hdr+1) + len, 0, pad);
+    }
     flen = sizeof(*hdr) + len + pad;
     
     debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, flen);
@@ -92,14 +101,15 @@ int ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *
 
 // Ethernetフレームの入力と検証
 int ether_input_helper(struct net_device *dev, ether_input_func_t callback) {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX];
+    uint8_t frame[ETHER_JUMBO_FRAME_SIZE_MAX];
     ssize_t flen;
     struct ether_hdr *hdr;
     uint16_t type;
 
     // 引数で渡された関数をコールバックしてEthernetフレームを読み込む
     // 実際の読み込みはether_input_helper()をよびだしたドライバの関数の中で行われ、ether_input_helper()は結果だけ受け取る
-    flen = callback(dev, frame, sizeof(frame));
+    // 読み込むサイズはデバイスのMTUに合わせる（MTUを超えるフレームは切り詰められる）
+    flen = callback(dev, frame, ETHER_HDR_SIZE + dev->mtu);
 
     // 読み込んだフレームのサイズEthernetヘッダより小さかったらエラーとする
     if (flen < (ssize_t)sizeof(*hdr)) {
@@ -136,3 +146,7 @@ void ether_setup_helper(struct net_device *dev) {
     dev->alen = ETHER_ADDR_LEN;
     memcpy(dev->broadcast, ETHER_ADDR_BROADCAST, ETHER_ADDR_LEN);
 }
+
+int ether_mtu_valid(uint16_t mtu) {
+    return ETHER_MTU_MIN <= mtu && mtu <= ETHER_JUMBO_PAYLOAD_SIZE_MAX;
+}
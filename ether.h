@@ -16,6 +16,11 @@
 #define ETHER_PAYLOAD_SIZE_MIN (ETHER_FRAME_SIZE_MIN - ETHER_HDR_SIZE)
 #define ETHER_PAYLOAD_SIZE_MAX (ETHER_FRAME_SIZE_MAX - ETHER_HDR_SIZE)
 
+// ジャンボフレーム（MTUはデバイスごとにnet_device_set_mtu()で変更する）
+#define ETHER_JUMBO_PAYLOAD_SIZE_MAX 9000
+#define ETHER_JUMBO_FRAME_SIZE_MAX (ETHER_HDR_SIZE + ETHER_JUMBO_PAYLOAD_SIZE_MAX)
+#define ETHER_MTU_MIN 68 /* minimum MTU of IPv4 (RFC 791) */
+
 /* see https://ww.iana.org/assignments/ieee-802-numbers/ieee-802-numbers.txt */
 #define ETHER_TYPE_IP   0x0800
 #define ETHER_TYPE_ARP  0x0806
@@ -33,5 +38,6 @@ typedef ssize_t (*ether_input_func_t)(struct net_device *dev, uint8_t *buf, size
 extern int ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ether_transmit_func_t callback);
 extern int ether_input_helper(struct net_device *dev, ether_input_func_t callback);
 extern void ether_setup_helper(struct net_device *dev);
+extern int ether_mtu_valid(uint16_t mtu);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,10 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
 
 #include "util.h"
 #include "ip.h"
@@ -8,6 +12,9 @@
 
 #define ICMP_BUFSIZ IP_PAYLOAD_SIZE_MAX
 
+#define ICMP_RATELIMIT_SOURCES 256 // 送信元ごとのバケットの数（2の累乗）
+#define ICMP_TOKEN 1000000         // 1トークン（creditは1usごとにrateずつ増える）
+
 // ICMPヘッダ構造体（メッセージ固有のフィールドは単なる32bitの値として扱う）
 struct icmp_hdr {
     uint8_t type;
@@ -25,6 +32,24 @@ struct icmp_echo {
     uint16_t seq;
 };
 
+// トークンバケット
+struct icmp_bucket {
+    ip_addr_t addr;  // 送信元ごとのバケットの場合の送信元
+    uint64_t last;   // 最後に補充した時刻（us）
+    uint64_t credit; // 残っているトークン（ICMP_TOKENで1つ）
+};
+
+/* NOTE: replies and errors are sent from the interrupt thread, but the limits can be changed from any thread */
+static mutex_t ratelimit_mutex = MUTEX_INITIALIZER;
+static struct icmp_ratelimit limits[] = {
+    [ICMP_RATELIMIT_REPLY] = {ICMP_REPLY_RATE, ICMP_REPLY_BURST, ICMP_REPLY_SOURCE_RATE, ICMP_REPLY_SOURCE_BURST},
+    [ICMP_RATELIMIT_ERROR] = {ICMP_ERROR_RATE, ICMP_ERROR_BURST, ICMP_ERROR_SOURCE_RATE, ICMP_ERROR_SOURCE_BURST},
+};
+static struct icmp_bucket global_buckets[2];
+static struct icmp_bucket source_buckets[2][ICMP_RATELIMIT_SOURCES];
+static uint32_t source_seed;
+static struct icmp_stats stats;
+
 static char *icmp_type_ntoa(uint8_t type) {
     switch (type) {
         case ICMP_TYPE_ECHOREPLY:
@@ -81,6 +106,97 @@ static void icmp_dump(const uint8_t *data, size_t len) {
     funlockfile(stderr);
 }
 
+static uint64_t icmp_now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// 経過時間分のトークンを補充して、1つ取り出せるかを返す（まだ取り出さない）
+static int icmp_bucket_refill(struct icmp_bucket *bucket, unsigned int rate, unsigned int burst, uint64_t now) {
+    uint64_t full, elapsed;
+
+    // rateが0なら制限しない
+    if (!rate)
+        return 1;
+    full = (uint64_t)burst * ICMP_TOKEN;
+    elapsed = now > bucket->last ? now - bucket->last : 0;
+    bucket->last = now;
+    // 長い時間が経っていれば満杯にする（掛け算が溢れないように先に比べる）
+    if (elapsed > (full - MIN(bucket->credit, full)) / rate)
+        bucket->credit = full;
+    else
+        bucket->credit += elapsed * rate;
+    return bucket->credit >= ICMP_TOKEN;
+}
+
+// icmp_bucket_refill()で取り出せると分かったトークンを1つ取り出す
+static void icmp_bucket_take(struct icmp_bucket *bucket, unsigned int rate) {
+    if (rate)
+        bucket->credit -= ICMP_TOKEN;
+}
+
+// dstへ送ってよいかを送信元ごとのバケットと全体のバケットで判定する
+// NOTE: 両方のバケットで送れると分かった時だけ両方から取り出す（片方だけ減らすと、断られた送信がもう一方のトークンを使ってしまう）
+static int icmp_ratelimit(int kind, ip_addr_t dst) {
+    struct icmp_ratelimit *limit;
+    struct icmp_bucket *bucket, *global;
+    uint64_t now;
+    int ok;
+
+    now = icmp_now();
+    mutex_lock(&ratelimit_mutex);
+    limit = &limits[kind];
+    bucket = &source_buckets[kind][hash32_3words(dst, 0, 0, source_seed) & (ICMP_RATELIMIT_SOURCES - 1)];
+    // 別の送信元が使っていたバケットは満杯の状態から使い直す（入れ替わりの多い送信元は全体のバケットで抑える）
+    if (bucket->addr != dst) {
+        bucket->addr = dst;
+        bucket->last = now;
+        bucket->credit = (uint64_t)limit->source_burst * ICMP_TOKEN;
+    }
+    global = &global_buckets[kind];
+    ok = icmp_bucket_refill(bucket, limit->source_rate, limit->source_burst, now) &&
+        icmp_bucket_refill(global, limit->rate, limit->burst, now);
+    if (ok) {
+        icmp_bucket_take(bucket, limit->source_rate);
+        icmp_bucket_take(global, limit->rate);
+    }
+    if (kind == ICMP_RATELIMIT_REPLY) {
+        if (ok)
+            stats.replies++;
+        else
+            stats.reply_limited++;
+    } else {
+        if (ok)
+            stats.errors++;
+        else
+            stats.error_limited++;
+    }
+    mutex_unlock(&ratelimit_mutex);
+    return ok;
+}
+
+// Echo要求をそのまま複製して種別だけ書き換える（チェックサムは差分だけ更新するので、データの長さによらない）
+static int icmp_echo_reply(const struct icmp_hdr *req, size_t len, ip_addr_t src, ip_addr_t dst) {
+    uint8_t buf[ICMP_BUFSIZ];
+    struct icmp_hdr *hdr;
+    uint16_t old, new;
+
+    if (len > sizeof(buf)) {
+        errorf("too long, len=%zu", len);
+        return -1;
+    }
+    hdr = (struct icmp_hdr *)buf;
+    memcpy(hdr, req, len);
+    memcpy(&old, &hdr->type, sizeof(old)); // typeとcodeの16bit
+    hdr->type = ICMP_TYPE_ECHOREPLY;
+    memcpy(&new, &hdr->type, sizeof(new));
+    hdr->sum = cksum16_adjust(hdr->sum, old, new);
+    icmp_dump((uint8_t *)hdr, len);
+    return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, len, src, dst);
+}
+
 // ICMPの登録
 void icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface) {
     struct icmp_hdr *hdr;
@@ -112,7 +228,17 @@ void icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, s
             // その他のパラメータは受信メッセージに含まれる値をそのまま渡す
             // 送信元はEchoメッセージを受信したインタフェース(iface)のユニキャストアドレス
             // 宛先はEchoメッセージの送信元(src)
-            icmp_output(ICMP_TYPE_ECHOREPLY, hdr->code, hdr->values, (uint8_t *)hdr + 1, len - sizeof(*hdr), dst, src);
+            // 応答の数を制限する（要求を大量に送りつけられても他の処理の時間を奪われないように、複製する前に捨てる）
+            if (!icmp_ratelimit(ICMP_RATELIMIT_REPLY, src)) {
+                debugf("rate limited, src=%s", ip_addr_ntop(src, addr1, sizeof(addr1)));
+                break;
+            }
+            icmp_echo_reply(hdr, len, dst, src);
+            break;
+        case ICMP_TYPE_DEST_UNREACH:
+            // 次のMTUはvaluesの下位16bit（RFC 1191）
+            if (hdr->code == ICMP_CODE_FRAGMENT_NEEDED)
+                ip_pmtu_input((uint8_t *)(hdr + 1), len - sizeof(*hdr), ntoh32(hdr->values) & 0xffff);
             break;
         default:
             /* ignore */
@@ -127,6 +253,22 @@ int icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
 
+    // エラーメッセージの数を制限する（Path MTU Discoveryが止まらないようにFragmentation Neededは除く）
+    switch (type) {
+        case ICMP_TYPE_DEST_UNREACH:
+            if (code == ICMP_CODE_FRAGMENT_NEEDED)
+                break;
+            /* fall through */
+        case ICMP_TYPE_SOURCE_QUENCH:
+        case ICMP_TYPE_REDIRECT:
+        case ICMP_TYPE_TIME_EXCEEDED:
+        case ICMP_TYPE_PARAM_PROBLEM:
+            if (!icmp_ratelimit(ICMP_RATELIMIT_ERROR, dst)) {
+                debugf("rate limited, dst=%s", ip_addr_ntop(dst, addr2, sizeof(addr2)));
+                return 0;
+            }
+            break;
+    }
     hdr = (struct icmp_hdr *)buf;
 
     // ICMPメッセージの生成
@@ -151,7 +293,52 @@ int icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data
     return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, src, dst);
 }
 
+// 応答やエラーメッセージの数の制限を変更する（rateを0にすると制限しない）
+int icmp_set_ratelimit(int kind, const struct icmp_ratelimit *limit) {
+    int i;
+
+    if (kind != ICMP_RATELIMIT_REPLY && kind != ICMP_RATELIMIT_ERROR) {
+        errorf("invalid kind, kind=%d", kind);
+        return -1;
+    }
+    if ((limit->rate && !limit->burst) || (limit->source_rate && !limit->source_burst)) {
+        errorf("burst must be at least 1");
+        return -1;
+    }
+    mutex_lock(&ratelimit_mutex);
+    limits[kind] = *limit;
+    // バケットは新しい設定で満杯の状態から使い直す
+    memset(&global_buckets[kind], 0, sizeof(global_buckets[kind]));
+    global_buckets[kind].credit = (uint64_t)limit->burst * ICMP_TOKEN;
+    for (i = 0; i < ICMP_RATELIMIT_SOURCES; i++)
+        source_buckets[kind][i].addr = IP_ADDR_ANY;
+    mutex_unlock(&ratelimit_mutex);
+    return 0;
+}
+
+int icmp_get_ratelimit(int kind, struct icmp_ratelimit *limit) {
+    if (kind != ICMP_RATELIMIT_REPLY && kind != ICMP_RATELIMIT_ERROR) {
+        errorf("invalid kind, kind=%d", kind);
+        return -1;
+    }
+    mutex_lock(&ratelimit_mutex);
+    *limit = limits[kind];
+    mutex_unlock(&ratelimit_mutex);
+    return 0;
+}
+
+void icmp_get_stats(struct icmp_stats *out) {
+    mutex_lock(&ratelimit_mutex);
+    *out = stats;
+    mutex_unlock(&ratelimit_mutex);
+}
+
 int icmp_init(void) {
+    int kind;
+
+    source_seed = random();
+    for (kind = 0; kind < 2; kind++)
+        global_buckets[kind].credit = (uint64_t)limits[kind].burst * ICMP_TOKEN;
     // ICMPの入力関数(icmp_input)をIPに登録
     // プロトコル番号はip.hに定義してある定数を使う
     if (ip_protocol_register(IP_PROTOCOL_ICMP, icmp_input) == -1) {
@@ -20,8 +20,50 @@
 #define ICMP_TYPE_INFO_REQUEST     15
 #define ICMP_TYPE_INFO_REPLY       16
 
+/* Destination Unreachable */
+#define ICMP_CODE_NET_UNREACH       0
+#define ICMP_CODE_HOST_UNREACH      1
+#define ICMP_CODE_PROTO_UNREACH     2
+#define ICMP_CODE_PORT_UNREACH      3
+#define ICMP_CODE_FRAGMENT_NEEDED   4
+
+/* Time Exceeded */
+#define ICMP_CODE_EXCEEDED_TTL      0
+#define ICMP_CODE_EXCEEDED_FRAGMENT 1
+
+/* rate limits (messages per second, 0 = unlimited) */
+#define ICMP_RATELIMIT_REPLY 0 // Echo応答
+#define ICMP_RATELIMIT_ERROR 1 // エラーメッセージ（Fragmentation Neededを除く）
+
+#define ICMP_REPLY_RATE         1000
+#define ICMP_REPLY_BURST        100
+#define ICMP_REPLY_SOURCE_RATE  100
+#define ICMP_REPLY_SOURCE_BURST 20
+#define ICMP_ERROR_RATE         1000
+#define ICMP_ERROR_BURST        50
+#define ICMP_ERROR_SOURCE_RATE  10
+#define ICMP_ERROR_SOURCE_BURST 6
+
+struct icmp_ratelimit {
+    unsigned int rate;         // 全体
+    unsigned int burst;
+    unsigned int source_rate;  // 送信元（応答やエラーメッセージの宛先）ごと
+    unsigned int source_burst;
+};
+
+struct icmp_stats {
+    unsigned long replies;       // 送ったEcho応答
+    unsigned long errors;        // 送ったエラーメッセージ
+    unsigned long reply_limited; // 制限を超えたので送らなかったEcho応答
+    unsigned long error_limited; // 制限を超えたので送らなかったエラーメッセージ
+};
+
 extern int icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
 
+extern int icmp_set_ratelimit(int kind, const struct icmp_ratelimit *limit);
+extern int icmp_get_ratelimit(int kind, struct icmp_ratelimit *limit);
+extern void icmp_get_stats(struct icmp_stats *stats);
+
 extern int icmp_init(void);
 
 #endif
\ No newline at end of file
@@ -4,54 +4,181 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sys/time.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
 #include "ip.h"
+#include "nat.h"
 #include "arp.h"
-
-// IPヘッダを表現するための構造体
-// この構造体にキャストすることでバイト列をIPヘッダと見なしてアクセスできる
-struct ip_hdr {
-    uint8_t vhl; // バージョン(4bit)とIPヘッダ長(4bit)をまとめて8bitとして扱う
-    uint8_t tos;
-    uint16_t total;
-    uint16_t id;
-    uint16_t offset; // フラグ(3bit)とフラグメントオフセット(13bit)をまとめて16bitとして扱う
-    uint8_t ttl;
-    uint8_t protocol;
-    uint16_t sum;
-    ip_addr_t src;
-    ip_addr_t dst;
-    uint8_t options[]; // オプション（可変長なのでフレキシブル配列メンバとする）
-};
+#include "icmp.h"
 
 // IPの上位プロトコルを管理するための構造体
 // struct net_protocolとほぼ同じ（受信キューがない分シンプル）
+// プロトコル番号で直接引ける256エントリの表で管理する
 struct ip_protocol {
-    struct ip_protocol *next;
     uint8_t type;
     void (*handler)(const uint8_t *data, size_t len, ip_addr_t str, ip_addr_t dst, struct ip_iface *iface);
+    int (*pmtu)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t mtu); // 送信したデータグラムがMTUを超えた（受け入れたら0、偽物なら-1を返す、なければNULL）
 };
 
-// 経路情報の構造体（リストで管理）
+// 次の中継先
+struct ip_nexthop {
+    ip_addr_t addr;         // 次の中継先アドレス（なければIP_ADDR_ANY）
+    struct ip_iface *iface; // この中継先への送信に使うインタフェース
+    uint8_t weight;         // マルチパスの経路で振り分ける割合
+};
+
+// 経路情報の構造体（ハッシュ表で管理し、検索はルーティングテーブルから番号で引く）
 struct ip_route {
-    struct ip_route *next;  // 次の経路情報へのポインタ
+    struct ip_route *next;  // 同じハッシュ値の経路情報へのポインタ（削除後は再利用待ちのリスト）
     ip_addr_t network;      // ネットワークアドレス
     ip_addr_t netmask;      // サブネットマスク
-    ip_addr_t nexthop;      // 次の中継先アドレス（なければIP_ADDR_ANY）
-    struct ip_iface *iface; // この経路への送信に使うインタフェース
+    uint8_t prefixlen;      // プレフィックス長
+    uint32_t id;            // ルーティングテーブルのエントリから参照する番号（1から）
+    _Atomic uint8_t num;    // 次の中継先の数（2つ以上ならマルチパス）
+    struct ip_nexthop nexthops[IP_ROUTE_NEXTHOP_MAX];
 };
 
+/*
+ * ルーティングテーブル（DIR-16-8-8）
+ *   宛先アドレスの上位16bitで引く表（tbl16）と、必要な所だけ確保する256エントリの表（tbl8）の最大3段で引く
+ *   エントリには経路の番号とプレフィックス長（更新時に長い方を優先するため）を入れる
+ *   検索はロックを取らない（tbl8と経路情報は一度確保したら解放しない）
+ */
+#define IP_ROUTE_TBL16_SIZE 65536
+#define IP_ROUTE_TBL8_SIZE 256
+#define IP_ROUTE_TBL8_CHUNK 256      // まとめて確保するtbl8の数
+#define IP_ROUTE_TBL8_CHUNK_MAX 1024
+#define IP_ROUTE_CHUNK 1024          // まとめて確保する経路情報の数
+#define IP_ROUTE_CHUNK_MAX 1024
+#define IP_ROUTE_HASH_SIZE 65536     // プレフィックスで経路情報を引くハッシュ表の大きさ
+
+#define IP_ROUTE_ENT_EXT 0x80000000  // 次の段のtbl8を指している
+#define IP_ROUTE_ENT(depth, index) (((uint32_t)(depth) << 25) | (index))
+#define IP_ROUTE_ENT_DEPTH(x) (((x) >> 25) & 0x3f)
+#define IP_ROUTE_ENT_INDEX(x) ((x) & 0x01ffffff)
+
 const ip_addr_t IP_ADDR_ANY       = 0x00000000; /* 0.0.0.0 */
 const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex */
 static struct ip_iface *ifaces;
-static struct ip_protocol *protocols; // 登録されているプロトコルのリスト（グローバル変数）
-static struct ip_route *routes;       // 経路情報のリスト（ルーティングテーブル）
+static struct ip_protocol protocols[UINT8_MAX+1]; // 登録されているプロトコルの表（プロトコル番号で引く, handlerがNULLなら未登録）
+
+static _Atomic uint32_t tbl16[IP_ROUTE_TBL16_SIZE];
+static _Atomic uint32_t *tbl8[IP_ROUTE_TBL8_CHUNK_MAX];
+static uint32_t tbl8_num;
+static struct ip_route *route_chunks[IP_ROUTE_CHUNK_MAX];
+static uint32_t route_num;
+static struct ip_route *route_free;
+static struct ip_route *route_hash[IP_ROUTE_HASH_SIZE];
+static mutex_t route_mutex = MUTEX_INITIALIZER; // NOTE: protects updates of the routing table (lookups are lock-free)
+static atomic_uint dst_genid; // 宛先キャッシュの世代番号
+static atomic_int multipath = IP_ROUTE_MULTIPATH_HASH; // マルチパスの経路で次の中継先を選ぶ方法
+static uint32_t route_seed;
+
+/*
+ * Path MTUの記憶（RFC 1191）
+ *   Fragmentation Neededで知らされた宛先ごとのMTUを覚えておく（宛先アドレスのハッシュ値で決まる位置に置き、衝突したら上書きする）
+ *   IP_PMTU_TIMEOUT経ったら忘れてデバイスのMTUに戻す（経路が変わって大きく送れるようになっているかもしれない）
+ */
+#define IP_PMTU_CACHE_SIZE 1024
+
+struct ip_pmtu {
+    ip_addr_t dst;
+    uint16_t mtu;
+    time_t expire;
+};
+
+static struct ip_pmtu pmtu_cache[IP_PMTU_CACHE_SIZE];
+static mutex_t pmtu_mutex = MUTEX_INITIALIZER;
+
+/*
+ * 自ホストのアドレス（ユニキャストとブロードキャスト）のハッシュ表
+ *   宛先アドレスから受信したデバイスのIPインタフェースを引く（登録されているアドレスの数によらず一定のコストで引ける）
+ *   エントリの数が表の大きさを超えたら2倍に広げる
+ */
+#define IP_ADDR_HASH_SIZE_MIN 64
+
+struct ip_addr_entry {
+    struct ip_addr_entry *next;
+    ip_addr_t addr;
+    struct net_device *dev;
+    struct ip_iface *iface;
+};
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex */
+static struct ip_addr_entry **addr_hash;
+static uint32_t addr_hash_size;
+static uint32_t addr_num;
+static uint32_t addr_seed;
+
+#define IP_ID_SPACE_SIZE 2048 // IDのカウンタの数（2の累乗）
+
+static atomic_ushort id_space[IP_ID_SPACE_SIZE];
+static uint32_t id_seed;
+
+/*
+ * フラグメントの再構築
+ *   (src, dst, id, protocol)をキーにハッシュ表で管理し、受け取った範囲を8byte単位のビットマップで記録する
+ *   重複を除いて受け取ったバイト数を数えておき、最後のフラグメントで分かる全長と一致したら完成とする
+ *   使用するメモリの合計に上限を設け、超えたら古いものから捨てる（フラグメントを大量に送りつけられた時の対策）
+ */
+#define IP_REASM_HASH_SIZE 256
+#define IP_REASM_TIMEOUT 30                // seconds
+#define IP_REASM_MEM_MAX (4 * 1024 * 1024) // bytes
+#define IP_REASM_BLOCKS ((IP_PAYLOAD_SIZE_MAX + 7) / 8)
+
+struct ip_reasm {
+    struct ip_reasm *next;  // 同じハッシュ値のエントリ
+    struct ip_reasm *older; // 作成順のリスト
+    struct ip_reasm *newer;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t id;
+    uint8_t protocol;
+    struct ip_iface *iface;
+    struct timeval first;   // 最初のフラグメントを受け取った時刻
+    uint16_t total;         // ペイロードの全長（最後のフラグメントを受け取るまでは0）
+    uint16_t end;           // 受け取った範囲の末尾
+    uint16_t received;      // 受け取ったバイト数
+    uint8_t head[IP_HDR_SIZE_MAX + 8]; // 先頭のフラグメントのヘッダとペイロードの先頭8byte（ICMPのエラーで返す）
+    uint16_t head_len;
+    uint8_t *data;          // ペイロード
+    size_t size;            // dataの確保済みサイズ
+    uint8_t bitmap[(IP_REASM_BLOCKS + 7) / 8];
+};
+
+static mutex_t reasm_mutex = MUTEX_INITIALIZER;
+static struct ip_reasm *reasm_hash[IP_REASM_HASH_SIZE];
+static struct ip_reasm *reasm_oldest;
+static struct ip_reasm *reasm_newest;
+static struct ip_reasm_stats reasm_stats;
+
+/*
+ * 転送（ルータとして動作する場合）
+ *   受信したバッファのままTTLとチェックサムだけ書き換えて送信する（ペイロードはコピーしない）
+ *   送信はソフトウェア割り込みの1回分の処理が終わった所で、送信するデバイスごとにまとめて行う
+ *   NOTE: ソフトウェア割り込みのスレッドでしか触らないのでロックは取らない
+ */
+#define IP_OUTPUT_BATCH 64 // ip_output_batch()でデバイスに一度に渡す数
+#define IP_FORWARD_BATCH 32
+
+struct ip_forward_entry {
+    struct net_device *dev;
+    uint8_t *data;
+    size_t len;
+    uint8_t ha[NET_DEVICE_ADDR_LEN];
+};
+
+static atomic_int forwarding;
+static struct ip_forward_entry forward_batch[IP_FORWARD_BATCH];
+static int forward_num;
+static struct ip_forward_stats forward_stats;
 
 // IPアドレスを文字列からネットワークバイトオーダーのバイナリ値(ip_addr_t)に変換
 int ip_addr_pton(const char *p, ip_addr_t *n) {
@@ -141,57 +268,464 @@ static void ip_dump(const uint8_t *data, size_t len) {
     funlockfile(stderr);
 }
 
-/* NOTE: must not be call after net_run() */
-static struct ip_route *ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface) {
+/*
+    Routing Table
+    NOTE: functions except ip_route_lookup() must be called after route_mutex locked
+*/
+
+static struct ip_route *ip_route_get(uint32_t id) {
+    if (!id)
+        return NULL;
+    id--;
+    return &route_chunks[id / IP_ROUTE_CHUNK][id % IP_ROUTE_CHUNK];
+}
+
+static _Atomic uint32_t *ip_route_tbl8(uint32_t index) {
+    return &tbl8[index / IP_ROUTE_TBL8_CHUNK][(index % IP_ROUTE_TBL8_CHUNK) * IP_ROUTE_TBL8_SIZE];
+}
+
+static struct ip_route **ip_route_hash_head(ip_addr_t network, uint8_t prefixlen) {
+    return &route_hash[hash32_3words(network, prefixlen, 0, 0) & (IP_ROUTE_HASH_SIZE - 1)];
+}
+
+static struct ip_route *ip_route_find(ip_addr_t network, uint8_t prefixlen) {
+    struct ip_route *route;
+
+    for (route = *ip_route_hash_head(network, prefixlen); route; route = route->next) {
+        if (route->network == network && route->prefixlen == prefixlen)
+            return route;
+    }
+    return NULL;
+}
+
+static struct ip_route *ip_route_alloc(void) {
     struct ip_route *route;
+
+    if (route_free) {
+        route = route_free;
+        route_free = route->next;
+        return route;
+    }
+    if (route_num % IP_ROUTE_CHUNK == 0) {
+        if (route_num / IP_ROUTE_CHUNK >= IP_ROUTE_CHUNK_MAX) {
+            errorf("too many routes");
+            return NULL;
+        }
+        route_chunks[route_num / IP_ROUTE_CHUNK] = memory_alloc(sizeof(struct ip_route) * IP_ROUTE_CHUNK);
+        if (!route_chunks[route_num / IP_ROUTE_CHUNK]) {
+            errorf("memory_alloc() failure");
+            return NULL;
+        }
+    }
+    route = ip_route_get(++route_num);
+    route->id = route_num;
+    return route;
+}
+
+// 経路を指していたエントリを次の段のtbl8に展開する（展開済みならそのtbl8を返す）
+static _Atomic uint32_t *ip_route_extend(_Atomic uint32_t *ent) {
+    _Atomic uint32_t *tbl;
+    uint32_t cur;
+    int i;
+
+    cur = atomic_load_explicit(ent, memory_order_relaxed);
+    if (cur & IP_ROUTE_ENT_EXT)
+        return ip_route_tbl8(IP_ROUTE_ENT_INDEX(cur));
+    if (tbl8_num % IP_ROUTE_TBL8_CHUNK == 0) {
+        if (tbl8_num / IP_ROUTE_TBL8_CHUNK >= IP_ROUTE_TBL8_CHUNK_MAX) {
+            errorf("too many tbl8");
+            return NULL;
+        }
+        tbl8[tbl8_num / IP_ROUTE_TBL8_CHUNK] = memory_alloc(sizeof(uint32_t) * IP_ROUTE_TBL8_SIZE * IP_ROUTE_TBL8_CHUNK);
+        if (!tbl8[tbl8_num / IP_ROUTE_TBL8_CHUNK]) {
+            errorf("memory_alloc() failure");
+            return NULL;
+        }
+    }
+    tbl = ip_route_tbl8(tbl8_num);
+    // 展開前と同じ経路で埋めてから公開する（検索中のスレッドが途中の状態を見ないように）
+    for (i = 0; i < IP_ROUTE_TBL8_SIZE; i++)
+        atomic_store_explicit(&tbl[i], cur, memory_order_relaxed);
+    atomic_store_explicit(ent, IP_ROUTE_ENT_EXT | tbl8_num, memory_order_release);
+    tbl8_num++;
+    return tbl;
+}
+
+// プレフィックスが覆うエントリの範囲を求める（必要ならtbl8を展開する）
+static _Atomic uint32_t *ip_route_range(uint32_t network, uint8_t prefixlen, uint32_t *count) {
+    _Atomic uint32_t *tbl;
+
+    if (prefixlen <= 16) {
+        *count = 1 << (16 - prefixlen);
+        return &tbl16[network >> 16];
+    }
+    tbl = ip_route_extend(&tbl16[network >> 16]);
+    if (!tbl)
+        return NULL;
+    if (prefixlen <= 24) {
+        *count = 1 << (24 - prefixlen);
+        return &tbl[(network >> 8) & 0xff];
+    }
+    tbl = ip_route_extend(&tbl[(network >> 8) & 0xff]);
+    if (!tbl)
+        return NULL;
+    *count = 1 << (32 - prefixlen);
+    return &tbl[network & 0xff];
+}
+
+// より短いプレフィックスの経路（または経路なし）を指しているエントリをvalで書き換える
+static void ip_route_fill(_Atomic uint32_t *ent, uint32_t val) {
+    _Atomic uint32_t *tbl;
+    uint32_t cur;
+    int i;
+
+    cur = atomic_load_explicit(ent, memory_order_relaxed);
+    if (cur & IP_ROUTE_ENT_EXT) {
+        tbl = ip_route_tbl8(IP_ROUTE_ENT_INDEX(cur));
+        for (i = 0; i < IP_ROUTE_TBL8_SIZE; i++)
+            ip_route_fill(&tbl[i], val);
+        return;
+    }
+    if (IP_ROUTE_ENT_DEPTH(cur) <= IP_ROUTE_ENT_DEPTH(val))
+        atomic_store_explicit(ent, val, memory_order_release);
+}
+
+// oldを指しているエントリをnewで書き換える（経路の削除）
+static void ip_route_replace(_Atomic uint32_t *ent, uint32_t old, uint32_t new) {
+    _Atomic uint32_t *tbl;
+    uint32_t cur;
+    int i;
+
+    cur = atomic_load_explicit(ent, memory_order_relaxed);
+    if (cur & IP_ROUTE_ENT_EXT) {
+        tbl = ip_route_tbl8(IP_ROUTE_ENT_INDEX(cur));
+        for (i = 0; i < IP_ROUTE_TBL8_SIZE; i++)
+            ip_route_replace(&tbl[i], old, new);
+        return;
+    }
+    if (cur == old)
+        atomic_store_explicit(ent, new, memory_order_release);
+}
+
+static int ip_route_prefixlen(ip_addr_t netmask) {
+    uint32_t mask, inv;
+
+    mask = ntoh32(netmask);
+    inv = ~mask;
+    // 上位から連続したビットでなければならない
+    if (inv & (inv + 1))
+        return -1;
+    return 32 - __builtin_popcount(inv);
+}
+
+// 経路情報を作成してルーティングテーブルへ追加する
+static struct ip_route *ip_route_create(ip_addr_t network, ip_addr_t netmask, int prefixlen, ip_addr_t nexthop, struct ip_iface *iface, uint8_t weight) {
+    struct ip_route *route, **head;
+    _Atomic uint32_t *ent;
+    uint32_t count, i;
+
+    route = ip_route_alloc();
+    if (!route) {
+        errorf("ip_route_alloc() failure");
+        return NULL;
+    }
+    route->network = network;
+    route->netmask = netmask;
+    route->prefixlen = prefixlen;
+    route->nexthops[0].addr = nexthop;
+    route->nexthops[0].iface = iface;
+    route->nexthops[0].weight = weight;
+    atomic_store_explicit(&route->num, 1, memory_order_release);
+    head = ip_route_hash_head(network, prefixlen);
+    route->next = *head;
+    *head = route;
+
+    // プレフィックスが覆うエントリのうち、より長いプレフィックスの経路を指しているもの以外をこの経路にする
+    ent = ip_route_range(ntoh32(network), prefixlen, &count);
+    if (!ent) {
+        *head = route->next;
+        route->next = route_free;
+        route_free = route;
+        errorf("ip_route_range() failure");
+        return NULL;
+    }
+    for (i = 0; i < count; i++)
+        ip_route_fill(&ent[i], IP_ROUTE_ENT(prefixlen, route->id));
+    return route;
+}
+
+// 経路情報の登録
+int ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface) {
+    int prefixlen;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
     char addr4[IP_ADDR_STR_LEN];
 
-    // 経路情報の登録
-    // ・新しい経路情報を作成してルーティングテーブルへ追加する（必要な情報は全て引数で受けっている）
-    route = memory_alloc(sizeof(*route));
+    prefixlen = ip_route_prefixlen(netmask);
+    if (prefixlen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    network &= netmask;
+    mutex_lock(&route_mutex);
+    if (ip_route_find(network, prefixlen)) {
+        mutex_unlock(&route_mutex);
+        errorf("already exists, network=%s, netmask=%s", ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    if (!ip_route_create(network, netmask, prefixlen, nexthop, iface, 1)) {
+        mutex_unlock(&route_mutex);
+        errorf("ip_route_create() failure");
+        return -1;
+    }
+    mutex_unlock(&route_mutex);
+    ip_dst_invalidate();
+
+    debugf("route added: network=%s, netmask=%s, nexthop=%s, iface=%s, dev=%s",
+        ip_addr_ntop(network, addr1, sizeof(addr1)),
+        ip_addr_ntop(netmask, addr2, sizeof(addr2)),
+        ip_addr_ntop(nexthop, addr3, sizeof(addr3)),
+        ip_addr_ntop(iface->unicast, addr4, sizeof(addr4)),
+        NET_IFACE(iface)->dev->name);
+    return 0;
+}
+
+// マルチパスの経路に次の中継先を加える（経路がなければ作る, 登録済みの中継先なら重みを変える）
+int ip_route_add_nexthop(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface, uint8_t weight) {
+    struct ip_route *route;
+    struct ip_nexthop *nh;
+    int prefixlen;
+    uint8_t num, i;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    char addr3[IP_ADDR_STR_LEN];
+
+    if (!weight) {
+        errorf("invalid weight");
+        return -1;
+    }
+    prefixlen = ip_route_prefixlen(netmask);
+    if (prefixlen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    network &= netmask;
+    mutex_lock(&route_mutex);
+    route = ip_route_find(network, prefixlen);
     if (!route) {
-        errorf("memory_alloc() failure");
-        return NULL;
+        if (!ip_route_create(network, netmask, prefixlen, nexthop, iface, weight)) {
+            mutex_unlock(&route_mutex);
+            errorf("ip_route_create() failure");
+            return -1;
+        }
+        num = 1;
+    } else {
+        num = atomic_load_explicit(&route->num, memory_order_relaxed);
+        for (i = 0; i < num; i++) {
+            nh = &route->nexthops[i];
+            if (nh->addr == nexthop && nh->iface == iface)
+                break;
+        }
+        if (i < num) {
+            nh->weight = weight;
+        } else {
+            if (num >= IP_ROUTE_NEXTHOP_MAX) {
+                mutex_unlock(&route_mutex);
+                errorf("too many nexthops, network=%s, netmask=%s", ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+                return -1;
+            }
+            // NOTE: 検索中のスレッドに見えるのは数を増やしてから
+            nh = &route->nexthops[num];
+            nh->addr = nexthop;
+            nh->iface = iface;
+            nh->weight = weight;
+            atomic_store_explicit(&route->num, ++num, memory_order_release);
+        }
     }
+    mutex_unlock(&route_mutex);
+    ip_dst_invalidate();
+    debugf("nexthop added: network=%s, netmask=%s, nexthop=%s, weight=%u, num=%u",
+        ip_addr_ntop(network, addr1, sizeof(addr1)),
+        ip_addr_ntop(netmask, addr2, sizeof(addr2)),
+        ip_addr_ntop(nexthop, addr3, sizeof(addr3)),
+        weight, num);
+    return 0;
+}
 
-    route->network = network;
-    route->netmask = netmask;
-    route->nexthop = nexthop;
-    route->iface = iface;
-    route->next = routes;
-    routes = route;
-    infof("route added: network=%s, netmask=%s, nethop=%s, iface=%s, dev=%s, route=%x",
-        ip_addr_ntop(route->network, addr1, sizeof(addr1)),
-        ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
-        ip_addr_ntop(route->nexthop, addr3, sizeof(addr3)),
-        ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
-        NET_IFACE(iface)->dev->name,
-        route);
-    return route;
+// マルチパスの経路から次の中継先を取り除く（最後の1つなら経路ごと削除する）
+int ip_route_del_nexthop(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface) {
+    struct ip_route *route;
+    int prefixlen;
+    uint8_t num, i;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    char addr3[IP_ADDR_STR_LEN];
+
+    prefixlen = ip_route_prefixlen(netmask);
+    if (prefixlen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    network &= netmask;
+    mutex_lock(&route_mutex);
+    route = ip_route_find(network, prefixlen);
+    num = route ? atomic_load_explicit(&route->num, memory_order_relaxed) : 0;
+    for (i = 0; i < num; i++) {
+        if (route->nexthops[i].addr == nexthop && route->nexthops[i].iface == iface)
+            break;
+    }
+    if (i == num) {
+        mutex_unlock(&route_mutex);
+        errorf("not found, network=%s, netmask=%s, nexthop=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)), ip_addr_ntop(nexthop, addr3, sizeof(addr3)));
+        return -1;
+    }
+    if (num == 1) {
+        mutex_unlock(&route_mutex);
+        return ip_route_del(network, netmask);
+    }
+    // 最後の中継先を空いた所へ移して数を減らす
+    // NOTE: 検索中のスレッドが移している途中の中継先を選ぶことがあるが、その1回の送信だけで済む
+    route->nexthops[i] = route->nexthops[num - 1];
+    atomic_store_explicit(&route->num, num - 1, memory_order_release);
+    mutex_unlock(&route_mutex);
+    ip_dst_invalidate();
+    debugf("nexthop deleted: network=%s, netmask=%s, nexthop=%s",
+        ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)), ip_addr_ntop(nexthop, addr3, sizeof(addr3)));
+    return 0;
 }
 
-// 経路情報の探索
-static struct ip_route *ip_route_lookup(ip_addr_t dst) {
-    struct ip_route *route, *candidate = NULL;
+// 経路情報の削除
+int ip_route_del(ip_addr_t network, ip_addr_t netmask) {
+    struct ip_route *route, *parent = NULL, **p;
+    _Atomic uint32_t *ent;
+    uint32_t count, i, mask;
+    int prefixlen, len;
     char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    prefixlen = ip_route_prefixlen(netmask);
+    if (prefixlen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    network &= netmask;
+    mutex_lock(&route_mutex);
+    route = ip_route_find(network, prefixlen);
+    if (!route) {
+        mutex_unlock(&route_mutex);
+        errorf("not found, network=%s, netmask=%s", ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    // この経路を指していたエントリは、同じ範囲を覆う次に長いプレフィックスの経路に引き継ぐ
+    for (len = prefixlen - 1; len >= 0 && !parent; len--) {
+        mask = len ? hton32(0xffffffff << (32 - len)) : 0;
+        parent = ip_route_find(network & mask, len);
+    }
+    ent = ip_route_range(ntoh32(network), prefixlen, &count);
+    for (i = 0; ent && i < count; i++)
+        ip_route_replace(&ent[i], IP_ROUTE_ENT(prefixlen, route->id), parent ? IP_ROUTE_ENT(parent->prefixlen, parent->id) : 0);
+    for (p = ip_route_hash_head(network, prefixlen); *p != route; p = &(*p)->next)
+        ;
+    *p = route->next;
+    // NOTE: 検索中のスレッドが参照しているかもしれないので解放せずに再利用する
+    route->next = route_free;
+    route_free = route;
+    mutex_unlock(&route_mutex);
+    ip_dst_invalidate();
+    debugf("route deleted: network=%s, netmask=%s", ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+    return 0;
+}
+
+// 経路情報の探索（ロンゲストマッチ）
+static struct ip_route *ip_route_lookup(ip_addr_t dst) {
+    uint32_t addr, ent;
+
+    // 上位16bit, 次の8bit, 最後の8bitの順に最大3回の表引きで決まる
+    addr = ntoh32(dst);
+    ent = atomic_load_explicit(&tbl16[addr >> 16], memory_order_acquire);
+    if (ent & IP_ROUTE_ENT_EXT) {
+        ent = atomic_load_explicit(&ip_route_tbl8(IP_ROUTE_ENT_INDEX(ent))[(addr >> 8) & 0xff], memory_order_acquire);
+        if (ent & IP_ROUTE_ENT_EXT)
+            ent = atomic_load_explicit(&ip_route_tbl8(IP_ROUTE_ENT_INDEX(ent))[addr & 0xff], memory_order_acquire);
+    }
+    return ip_route_get(IP_ROUTE_ENT_INDEX(ent));
+}
+
+/*
+ * マルチパス（ECMP）
+ *   同じプレフィックスの経路に重み付きの次の中継先を複数持たせ、フローのハッシュ値で1つを選ぶ（同じフローは同じ中継先を通る）
+ *   IP_ROUTE_MULTIPATH_HASH: ハッシュ値を重みの合計で割った余りで選ぶ（RFC 2992, 中継先が増減するとほとんどのフローの行き先が変わる）
+ *   IP_ROUTE_MULTIPATH_RENDEZVOUS: 中継先ごとにフローとのハッシュ値から重み付きのスコアを求めて最も良いものを選ぶ（増減した中継先のフローだけが移る）
+ */
+
+void ip_route_set_multipath(int mode) {
+    atomic_store(&multipath, mode);
+    infof("multipath %s", mode == IP_ROUTE_MULTIPATH_RENDEZVOUS ? "rendezvous" : "hash");
+}
+
+// ハッシュ値を(0,1]の一様な値uと見なして-log2(u)を16.16の固定小数点で求める
+// 小数部はlog2(1+m) ≒ m + 0.3466m(1-m)で近似する（誤差は0.01未満）
+static uint32_t ip_route_neglog2(uint32_t hash) {
+    uint64_t x;
+    uint32_t n, m, frac;
+
+    x = (uint64_t)hash + 1;
+    n = 63 - __builtin_clzll(x);
+    m = ((x << (63 - n)) >> 47) & 0xffff;
+    frac = m + ((((m * (65536 - m)) >> 16) * 22714) >> 16);
+    return ((32 - n) << 16) - frac;
+}
+
+// 経路の次の中継先からフローのハッシュ値で1つを選んで写す
+static int ip_route_select(struct ip_route *route, uint32_t hash, struct ip_nexthop *nh) {
+    struct ip_nexthop *p;
+    uint32_t total = 0, h, score, best = 0;
+    uint8_t num, i, sel = 0;
 
-    // ルーティングテーブルを巡回
-    for (route = routes; route; route = route->next) {
-        // 宛先が経路情報のネットワークに含まれているか確認
-        if ((dst & route->netmask) == (route->network & route->netmask)) {
-            // サブネットマスクがより長く一致する経路を選択する（ロンゲストマッチ）
-            // 長く一致する方がより詳細な経路情報となる
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
-                candidate = route;
+    num = atomic_load_explicit(&route->num, memory_order_acquire);
+    if (!num)
+        return -1;
+    if (num > 1) {
+        if (atomic_load_explicit(&multipath, memory_order_relaxed) == IP_ROUTE_MULTIPATH_RENDEZVOUS) {
+            // スコアは-log(u)/weightで小さい方が良い（weightに比例した割合で選ばれる）
+            // NOTE: 割り算を避けて score/weight < best/best_weight を掛け算で比べる
+            for (i = 0; i < num; i++) {
+                p = &route->nexthops[i];
+                score = ip_route_neglog2(hash32_3words(hash, p->addr, p->iface->unicast, route_seed));
+                if (!i || (uint64_t)score * route->nexthops[sel].weight < (uint64_t)best * p->weight) {
+                    best = score;
+                    sel = i;
+                }
             }
+        } else {
+            for (i = 0; i < num; i++)
+                total += route->nexthops[i].weight;
+            h = hash % total;
+            for (sel = 0; sel < num - 1 && h >= route->nexthops[sel].weight; sel++)
+                h -= route->nexthops[sel].weight;
         }
     }
+    *nh = route->nexthops[sel];
+    return 0;
+}
+
+// 宛先への経路を引いて次の中継先を選ぶ（直接届く場合のaddrは宛先そのもの）
+static int ip_route_nexthop(ip_addr_t dst, uint32_t hash, struct ip_nexthop *nh) {
+    struct ip_route *route;
+
+    route = ip_route_lookup(dst);
+    if (!route || ip_route_select(route, hash, nh) == -1)
+        return -1;
+    if (nh->addr == IP_ADDR_ANY)
+        nh->addr = dst;
+    return 0;
+}
 
-    infof("candidate: network: %s", ip_addr_ntop(candidate->network, addr1, sizeof(addr1)));
-    return candidate;
+// フローが分からない場合は宛先アドレスだけで選ぶ
+static uint32_t ip_route_dst_hash(ip_addr_t dst) {
+    return hash32_3words(dst, 0, 0, route_seed);
 }
 
 /* NOTE: must not be call after net_run() */
@@ -206,7 +740,7 @@ int ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway) {
     }
 
     // 0.0.0.0/0のサブネットワークへの経路情報として登録する
-    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
+    if (ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface) == -1) {
         errorf("ip_route_add() falure");
         return -1;
     }
@@ -214,12 +748,172 @@ int ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway) {
 }
 
 struct ip_iface *ip_route_get_iface(ip_addr_t dst) {
-    struct ip_route *route;
+    struct ip_nexthop nh;
 
-    route = ip_route_lookup(dst);
-    if (!route) 
+    if (ip_route_nexthop(dst, ip_route_dst_hash(dst), &nh) == -1)
         return NULL;
-    return route->iface;
+    return nh.iface;
+}
+
+/*
+    Destination Cache
+    NOTE: 1つのキャッシュを複数のスレッドで同時に使わないこと（TCPはPCBのmutexで保護される）
+*/
+
+// 経路が変わった時に呼び出して全ての宛先キャッシュを無効にする（近隣の変化はARPの世代番号で近隣ごとに検出する）
+void ip_dst_invalidate(void) {
+    atomic_fetch_add_explicit(&dst_genid, 1, memory_order_release);
+}
+
+// キャッシュが有効ならそのまま、無効なら経路を引き直して送信に使うインタフェースを返す
+// 引き直す時にdataがあれば送信するデータグラムのフロー（ポート番号を含む）で、なければ宛先アドレスでマルチパスの中継先を選ぶ
+static struct ip_iface *ip_dst_lookup(struct ip_dst *cache, ip_addr_t dst, ip_addr_t src, uint8_t protocol, const uint8_t *data, size_t len) {
+    struct ip_nexthop nh;
+    unsigned int genid;
+    uint32_t hash, ports = 0;
+
+    // NOTE: 先に世代番号を読む（引き直している間に変わった場合は次の送信で引き直す）
+    genid = atomic_load_explicit(&dst_genid, memory_order_acquire);
+    if (cache->iface && cache->genid == genid && cache->dst == dst)
+        return cache->iface;
+    if (data) {
+        // ip_flow_hash()と同じ組み合わせ
+        if ((protocol == IP_PROTOCOL_TCP || protocol == IP_PROTOCOL_UDP) && len >= sizeof(ports))
+            memcpy(&ports, data, sizeof(ports));
+        hash = hash32_3words(src, dst, ports ^ protocol, route_seed);
+    } else {
+        hash = ip_route_dst_hash(dst);
+    }
+    if (ip_route_nexthop(dst, hash, &nh) == -1) {
+        cache->iface = NULL;
+        return NULL;
+    }
+    // フラグメントに分けることになる場合は、ip_flow_hash()と同じくポート番号を除いて選び直す
+    if (ports && IP_HDR_SIZE_MIN + len > NET_IFACE(nh.iface)->dev->mtu) {
+        hash = hash32_3words(src, dst, protocol, route_seed);
+        if (ip_route_nexthop(dst, hash, &nh) == -1) {
+            cache->iface = NULL;
+            return NULL;
+        }
+    }
+    cache->genid = genid;
+    cache->dst = dst;
+    cache->nexthop = nh.addr;
+    cache->iface = nh.iface;
+    cache->resolved = 0;
+    return cache->iface;
+}
+
+struct ip_iface *ip_dst_iface(struct ip_dst *cache, ip_addr_t dst) {
+    return ip_dst_lookup(cache, dst, IP_ADDR_ANY, 0, NULL, 0);
+}
+
+// 宛先への次の中継先を返す（直接届く場合は宛先そのもの, 経路がなければIP_ADDR_ANY）
+ip_addr_t ip_route_get_nexthop(ip_addr_t dst) {
+    struct ip_nexthop nh;
+
+    if (ip_route_nexthop(dst, ip_route_dst_hash(dst), &nh) == -1)
+        return IP_ADDR_ANY;
+    return nh.addr;
+}
+
+// 上位層で宛先との通信が進んだことをARPに伝える（宛先キャッシュの次の中継先の到達性の確認になる）
+// NOTE: マルチパスの経路ではフローごとに中継先が異なるので、経路を引き直さずに送信に使っているものを確認する
+void ip_confirm_neighbor(struct ip_dst *cache) {
+    struct net_iface *iface;
+
+    if (!cache->iface)
+        return;
+    iface = NET_IFACE(cache->iface);
+    if (iface->dev->flags & NET_DEVICE_FLAG_NEED_ARP)
+        arp_confirm(iface, cache->nexthop);
+}
+
+/*
+    Path MTU Discovery
+*/
+
+static struct ip_pmtu *ip_pmtu_entry(ip_addr_t dst) {
+    return &pmtu_cache[hash32_3words(dst, 0, 0, route_seed) & (IP_PMTU_CACHE_SIZE - 1)];
+}
+
+// 宛先までの経路のMTU（覚えているものがなければ送信するデバイスのMTU, 経路がなければ0）
+uint16_t ip_pmtu_get(ip_addr_t dst) {
+    struct ip_iface *iface;
+    struct ip_pmtu *entry;
+    struct timeval now;
+    uint16_t mtu;
+
+    iface = ip_route_get_iface(dst);
+    if (!iface)
+        return 0;
+    mtu = NET_IFACE(iface)->dev->mtu;
+    gettimeofday(&now, NULL);
+    mutex_lock(&pmtu_mutex);
+    entry = ip_pmtu_entry(dst);
+    if (entry->dst == dst && now.tv_sec < entry->expire && entry->mtu < mtu)
+        mtu = entry->mtu;
+    mutex_unlock(&pmtu_mutex);
+    return mtu;
+}
+
+// 次のMTUを知らせないルータ（RFC 1191より前の実装）の場合は元の長さより小さい代表的な値を使う（RFC 1191 Section 7）
+static uint16_t ip_pmtu_plateau(uint16_t total) {
+    static const uint16_t plateaus[] = {32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68};
+    size_t i;
+
+    for (i = 0; i < countof(plateaus) - 1; i++) {
+        if (plateaus[i] < total)
+            break;
+    }
+    return plateaus[i];
+}
+
+// ICMPのFragmentation Neededを受け取った時に呼び出す（dataはメッセージに含まれる送信したデータグラムの先頭部分）
+void ip_pmtu_input(const uint8_t *data, size_t len, uint16_t mtu) {
+    const struct ip_hdr *hdr;
+    struct ip_protocol *entry;
+    struct ip_pmtu *cache;
+    struct timeval now;
+    uint16_t hlen;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (len < IP_HDR_SIZE_MIN)
+        return;
+    hdr = (const struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if ((hdr->vhl >> 4) != IP_VERSION_IPV4 || hlen < IP_HDR_SIZE_MIN || hlen > len)
+        return;
+    // 自ホストが送信したデータグラムでなければ偽物
+    if (!ip_iface_select(hdr->src)) {
+        debugf("not a local source, src=%s", ip_addr_ntop(hdr->src, addr, sizeof(addr)));
+        return;
+    }
+    // Path MTUを使うのは上位プロトコルがDFを付けて送る場合だけ（なければ覚えない）
+    entry = &protocols[hdr->protocol];
+    if (!entry->pmtu)
+        return;
+    if (!mtu)
+        mtu = ip_pmtu_plateau(ntoh16(hdr->total));
+    // 極端に小さい値は使わない（偽のICMPで小さなセグメントしか送れなくされるのを防ぐ）
+    if (mtu < IP_PMTU_MIN)
+        mtu = IP_PMTU_MIN;
+    // 上位プロトコルが自分の送信したデータだと確かめてから覚える（送信し直すデータの大きさもここで変える）
+    if (entry->pmtu(data + hlen, len - hlen, hdr->src, hdr->dst, mtu) == -1) {
+        debugf("rejected, dst=%s", ip_addr_ntop(hdr->dst, addr, sizeof(addr)));
+        return;
+    }
+    // 小さくなる場合だけ覚える（大きくなるのは忘れた後）
+    gettimeofday(&now, NULL);
+    mutex_lock(&pmtu_mutex);
+    cache = ip_pmtu_entry(hdr->dst);
+    if (cache->dst != hdr->dst || now.tv_sec >= cache->expire || mtu < cache->mtu) {
+        cache->dst = hdr->dst;
+        cache->mtu = mtu;
+        cache->expire = now.tv_sec + IP_PMTU_TIMEOUT;
+    }
+    mutex_unlock(&pmtu_mutex);
+    debugf("dst=%s, mtu=%u", ip_addr_ntop(hdr->dst, addr, sizeof(addr)), mtu);
 }
 
 struct ip_iface *ip_iface_alloc(const char *unicast, const char *netmask) {
@@ -255,12 +949,71 @@ struct ip_iface *ip_iface_alloc(const char *unicast, const char *netmask) {
     return iface;
 }
 
+static struct ip_addr_entry **ip_addr_hash_head(ip_addr_t addr) {
+    return &addr_hash[hash32_3words(addr, 0, 0, addr_seed) & (addr_hash_size - 1)];
+}
+
+// 同じデバイスのインタフェースが同じアドレスを持つ場合（ブロードキャスト）は先に登録した方を使う
+static int ip_addr_hash_add(ip_addr_t addr, struct ip_iface *iface) {
+    struct ip_addr_entry **old, *entry, *next, **head;
+    uint32_t size, i;
+
+    for (entry = addr_hash_size ? *ip_addr_hash_head(addr) : NULL; entry; entry = entry->next) {
+        if (entry->addr == addr && entry->dev == NET_IFACE(iface)->dev)
+            return 0;
+    }
+    if (addr_num >= addr_hash_size) {
+        // 表を広げて全てのエントリを入れ直す
+        old = addr_hash;
+        size = addr_hash_size;
+        addr_hash_size = size ? size * 2 : IP_ADDR_HASH_SIZE_MIN;
+        addr_hash = memory_alloc(sizeof(*addr_hash) * addr_hash_size);
+        if (!addr_hash) {
+            errorf("memory_alloc() failure");
+            addr_hash = old;
+            addr_hash_size = size;
+            return -1;
+        }
+        for (i = 0; i < size; i++) {
+            for (entry = old[i]; entry; entry = next) {
+                next = entry->next;
+                head = ip_addr_hash_head(entry->addr);
+                entry->next = *head;
+                *head = entry;
+            }
+        }
+        if (old)
+            memory_free(old);
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->addr = addr;
+    entry->dev = NET_IFACE(iface)->dev;
+    entry->iface = iface;
+    head = ip_addr_hash_head(addr);
+    entry->next = *head;
+    *head = entry;
+    addr_num++;
+    return 0;
+}
+
 /* NOTE: must not be call after net_run() */
 int ip_iface_register(struct net_device *dev, struct ip_iface *iface) {
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
 
+    struct ip_route *route;
+
+    // 同じアドレスを複数のインタフェースに設定することはできない
+    if (ip_iface_select(iface->unicast)) {
+        errorf("already exists, unicast=%s", ip_addr_ntop(iface->unicast, addr1, sizeof(addr1)));
+        return -1;
+    }
+
     // IPインタフェースの登録
     
     // デバイスにIPインタフェース(iface)を登録する
@@ -270,11 +1023,21 @@ int ip_iface_register(struct net_device *dev, struct ip_iface *iface) {
         return -1;
     }
 
+    // 受信したデータグラムの宛先から引けるように自ホストのアドレスとして登録する
+    if (ip_addr_hash_add(iface->unicast, iface) == -1 || ip_addr_hash_add(iface->broadcast, iface) == -1) {
+        errorf("ip_addr_hash_add() failure");
+        return -1;
+    }
+
     // インタフェース登録時にそのネットワーク宛の経路情報を自動で登録する
     // とりあえず未設定(0.0.0.0)を設定
-    if (!ip_route_add(iface->unicast, iface->netmask, IP_ADDR_ANY, iface)) {
-        errorf("ip_route_add() failure");
-        return -1;
+    // 同じネットワークのアドレスを既に登録していれば（同じデバイスに複数のアドレスを設定する場合など）その経路を使う
+    route = ip_route_lookup(iface->unicast);
+    if (!route || route->network != (iface->unicast & iface->netmask) || route->netmask != iface->netmask) {
+        if (ip_route_add(iface->unicast, iface->netmask, IP_ADDR_ANY, iface) == -1) {
+            errorf("ip_route_add() failure");
+            return -1;
+        }
     }
 
     // IPインタフェースのリスト(ifaces)の先頭にifaceを挿入する
@@ -292,11 +1055,26 @@ struct ip_iface *ip_iface_select(ip_addr_t addr) {
     // IPインタフェースの検索
     // 引数addrで指定されたIPアドレスを持つインタフェースを返す
     // 合致するインタフェースを発見できなかったらNULLを返す
-    struct ip_iface *iface;
+    struct ip_addr_entry *entry;
 
-    for (iface = ifaces; iface; iface = iface->next) {
-        if (iface->unicast == addr)
-            return iface;
+    if (!addr_hash_size)
+        return NULL;
+    for (entry = *ip_addr_hash_head(addr); entry; entry = entry->next) {
+        if (entry->addr == addr && entry->iface->unicast == addr)
+            return entry->iface;
+    }
+    return NULL;
+}
+
+// デバイスに設定されたアドレス（ユニキャストまたはブロードキャスト）からIPインタフェースを引く
+struct ip_iface *ip_iface_lookup(struct net_device *dev, ip_addr_t addr) {
+    struct ip_addr_entry *entry;
+
+    if (!addr_hash_size)
+        return NULL;
+    for (entry = *ip_addr_hash_head(addr); entry; entry = entry->next) {
+        if (entry->addr == addr && entry->dev == dev)
+            return entry->iface;
     }
     return NULL;
 }
@@ -306,37 +1084,252 @@ int ip_protocol_register(uint8_t type, void (*handler)(const uint8_t *data, size
     struct ip_protocol *entry;
 
     // 重複登録の確認
-    // プロトコルリスト(protocols)を巡回
     // 指定されたtypeのエントリが既に存在する場合はエラーを返す
-    for (entry = protocols; entry; entry = entry->next) {
-        if (entry->type == type) {
-            return -1;
-        }
+    entry = &protocols[type];
+    if (entry->handler) {
+        errorf("already registered, type=%u", type);
+        return -1;
     }
 
     // プロトコルの登録
-    // 新しいプロトコルのエントリようにメモリを確保
-    // 新しいプロトコルのエントリに値を設定
-    // プロトコルリスト(protocols)の先頭に挿入
-    entry = memory_alloc(sizeof(struct ip_protocol));
-    if (!entry) {
-        return -1;
-    }
+    // プロトコル番号のエントリに値を設定
     entry->type = type;
     entry->handler = handler;
-    entry->next = protocols;
-    protocols = entry;
 
     infof("registered, type=%u", entry->type);
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+int ip_protocol_set_pmtu(uint8_t type, int (*pmtu)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t mtu)) {
+    struct ip_protocol *entry;
+
+    entry = &protocols[type];
+    if (!entry->handler) {
+        errorf("not registered, type=%u", type);
+        return -1;
+    }
+    entry->pmtu = pmtu;
+    return 0;
+}
+
+/*
+    Reassembly
+    NOTE: Reassembly functions must be called after reasm_mutex locked
+*/
+
+static struct ip_reasm **ip_reasm_head(ip_addr_t src, ip_addr_t dst, uint16_t id, uint8_t protocol) {
+    return &reasm_hash[hash32_3words(src, dst, ((uint32_t)id << 8) | protocol, 0) & (IP_REASM_HASH_SIZE - 1)];
+}
+
+static void ip_reasm_free(struct ip_reasm *entry) {
+    struct ip_reasm **p;
+
+    for (p = ip_reasm_head(entry->src, entry->dst, entry->id, entry->protocol); *p != entry; p = &(*p)->next)
+        ;
+    *p = entry->next;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        reasm_oldest = entry->newer;
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        reasm_newest = entry->older;
+    reasm_stats.mem -= sizeof(*entry) + entry->size;
+    if (entry->data)
+        memory_free(entry->data);
+    memory_free(entry);
+}
+
+static struct ip_reasm *ip_reasm_get(const struct ip_hdr *hdr, struct ip_iface *iface) {
+    struct ip_reasm *entry, **head;
+
+    head = ip_reasm_head(hdr->src, hdr->dst, hdr->id, hdr->protocol);
+    for (entry = *head; entry; entry = entry->next) {
+        if (entry->src == hdr->src && entry->dst == hdr->dst && entry->id == hdr->id && entry->protocol == hdr->protocol)
+            return entry;
+    }
+    // エントリ自体の分も上限に含める
+    while (reasm_oldest && reasm_stats.mem + sizeof(*entry) > IP_REASM_MEM_MAX) {
+        ip_reasm_free(reasm_oldest);
+        reasm_stats.evicted++;
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    entry->src = hdr->src;
+    entry->dst = hdr->dst;
+    entry->id = hdr->id;
+    entry->protocol = hdr->protocol;
+    entry->iface = iface;
+    gettimeofday(&entry->first, NULL);
+    entry->next = *head;
+    *head = entry;
+    entry->older = reasm_newest;
+    if (reasm_newest)
+        reasm_newest->newer = entry;
+    else
+        reasm_oldest = entry;
+    reasm_newest = entry;
+    reasm_stats.mem += sizeof(*entry);
+    return entry;
+}
+
+// ペイロードの領域をendまで広げる（上限を超える分は古いエントリを捨てて空ける）
+static int ip_reasm_reserve(struct ip_reasm *entry, size_t end) {
+    uint8_t *data;
+    size_t size;
+
+    if (end <= entry->size)
+        return 0;
+    size = entry->size ? entry->size : 1024;
+    while (size < end)
+        size *= 2;
+    size = MIN(size, IP_PAYLOAD_SIZE_MAX);
+    while (reasm_oldest != entry && reasm_stats.mem + size - entry->size > IP_REASM_MEM_MAX) {
+        ip_reasm_free(reasm_oldest);
+        reasm_stats.evicted++;
+    }
+    if (reasm_stats.mem + size - entry->size > IP_REASM_MEM_MAX) {
+        errorf("memory limit exceeded");
+        return -1;
+    }
+    data = memory_alloc(size);
+    if (!data) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    if (entry->data) {
+        memcpy(data, entry->data, entry->end);
+        memory_free(entry->data);
+    }
+    reasm_stats.mem += size - entry->size;
+    entry->data = data;
+    entry->size = size;
+    return 0;
+}
+
+// 範囲[off, end)のブロックに印を付け、新たに埋まったバイト数を返す
+static size_t ip_reasm_mark(struct ip_reasm *entry, size_t off, size_t end) {
+    size_t block, last, added = 0;
+
+    last = (end - 1) >> 3;
+    for (block = off >> 3; block <= last; block++) {
+        if (entry->bitmap[block >> 3] & (1 << (block & 7)))
+            continue;
+        entry->bitmap[block >> 3] |= 1 << (block & 7);
+        // 8byteに満たないのは最後のブロックだけ
+        added += (block == last) ? end - (block << 3) : 8;
+    }
+    return added;
+}
+
+// フラグメントを取り込み、揃ったら再構築したペイロードを返す（呼び出し側でmemory_free()する）
+static uint8_t *ip_reasm_input(const struct ip_hdr *hdr, const uint8_t *payload, size_t len, struct ip_iface *iface, size_t *total) {
+    struct ip_reasm *entry;
+    uint16_t offset;
+    size_t off, end;
+    uint8_t *data;
+
+    offset = ntoh16(hdr->offset);
+    off = (offset & IP_OFFSET_MASK) << 3;
+    end = off + len;
+    mutex_lock(&reasm_mutex);
+    reasm_stats.fragments++;
+    // 最後以外のフラグメントは8byteの倍数でなければならない
+    if (!len || end > IP_PAYLOAD_SIZE_MAX || ((offset & IP_OFFSET_MF) && (len & 7))) {
+        errorf("invalid fragment, offset=%zu, len=%zu", off, len);
+        reasm_stats.failed++;
+        mutex_unlock(&reasm_mutex);
+        return NULL;
+    }
+    entry = ip_reasm_get(hdr, iface);
+    if (!entry) {
+        reasm_stats.failed++;
+        mutex_unlock(&reasm_mutex);
+        return NULL;
+    }
+    // 全長と矛盾するフラグメントを受け取ったらデータグラムごと捨てる
+    if ((!(offset & IP_OFFSET_MF) && ((entry->total && entry->total != end) || entry->end > end)) ||
+        (entry->total && end > entry->total) || ip_reasm_reserve(entry, end) == -1) {
+        errorf("reassembly failure, id=%u", ntoh16(hdr->id));
+        ip_reasm_free(entry);
+        reasm_stats.failed++;
+        mutex_unlock(&reasm_mutex);
+        return NULL;
+    }
+    if (!(offset & IP_OFFSET_MF))
+        entry->total = end;
+    if (!off) {
+        entry->head_len = ((hdr->vhl & 0x0f) << 2) + MIN(len, 8);
+        memcpy(entry->head, hdr, entry->head_len);
+    }
+    memcpy(entry->data + off, payload, len);
+    entry->end = MAX(entry->end, end);
+    entry->received += ip_reasm_mark(entry, off, end);
+    if (!entry->total || entry->received < entry->total) {
+        mutex_unlock(&reasm_mutex);
+        return NULL;
+    }
+    // 揃ったのでペイロードを引き取ってエントリを捨てる
+    data = entry->data;
+    *total = entry->total;
+    entry->data = NULL;
+    ip_reasm_free(entry);
+    reasm_stats.reassembled++;
+    mutex_unlock(&reasm_mutex);
+    return data;
+}
+
+// 時間内に揃わなかったデータグラムを捨てる（先頭のフラグメントを受け取っていれば送信元に知らせる）
+static void ip_reasm_timer(void) {
+    struct ip_reasm *entry;
+    struct timeval now, diff;
+    uint8_t head[IP_HDR_SIZE_MAX + 8];
+    size_t head_len;
+    ip_addr_t src, dst;
+
+    gettimeofday(&now, NULL);
+    while (1) {
+        mutex_lock(&reasm_mutex);
+        entry = reasm_oldest;
+        if (entry)
+            timersub(&now, &entry->first, &diff);
+        if (!entry || diff.tv_sec < IP_REASM_TIMEOUT) {
+            mutex_unlock(&reasm_mutex);
+            break;
+        }
+        head_len = entry->head_len;
+        memcpy(head, entry->head, head_len);
+        src = entry->iface->unicast;
+        dst = entry->src;
+        ip_reasm_free(entry);
+        reasm_stats.timeouts++;
+        mutex_unlock(&reasm_mutex);
+        if (head_len)
+            icmp_output(ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_FRAGMENT, 0, head, head_len, src, dst);
+    }
+}
+
+void ip_reasm_get_stats(struct ip_reasm_stats *stats) {
+    mutex_lock(&reasm_mutex);
+    *stats = reasm_stats;
+    mutex_unlock(&reasm_mutex);
+}
+
+static void ip_forward(uint8_t *data, size_t len, struct ip_iface *iface);
+
 static void ip_input(const uint8_t *data, size_t len, struct net_device *dev) {
     struct ip_hdr *hdr;
     uint8_t v;
     uint16_t hlen, total, offset;
-    struct ip_iface *iface;
+    struct ip_iface *iface, *primary;
     char addr[IP_ADDR_STR_LEN];
+    uint8_t *payload;
+    size_t plen;
 
     // 入力データの長さがIPヘッダの最小サイズより小さい場合はエラー
     if (len < IP_HDR_SIZE_MIN) {
@@ -373,62 +1366,78 @@ static void ip_input(const uint8_t *data, size_t len, struct net_device *dev) {
         return;
     }
 
-    // 今回はIPのフラグメントをサポートしないのでフラグメントだったら処理せず中断する
-    // フラグメントかどうかの判断...MF(More Flagments)ビットが立っている or フラグメントオフセットに値がある
-    offset = ntoh16(hdr->offset);
-    if (offset & 0x2000 || offset & 0x1fff) {
-        errorf("fragment does not support");
-        return;
-    }
-
     // IPデータグラムのフィルタリング
     
-    // デバイスに紐づくIPインタフェースを取得
+    // デバイスに紐づくIPインタフェース（代表）を取得
     // IPインタフェースを取得できなかったら中断する
-    if (dev->ifaces)
-        iface = (struct ip_iface *)dev->ifaces;
-    else
+    primary = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    if (!primary)
+        return;
+
+    // NATのエントリや規則に合致すればアドレスとポートを書き換える（書き換えた宛先で自ホスト宛か転送するかを決める）
+    if (nat_input((uint8_t *)data, total) == -1)
         return;
     
     // 宛先IPアドレスの検証
-    // 以下のいずれにも一致しない場合は「他ホスト宛」と判断して中断する（エラーメッセージは出力しない）
-    if (hdr->dst != IP_ADDR_BROADCAST) {
-        for (; iface; iface = iface->next) {
-            if (iface->broadcast == hdr->dst || iface->unicast == hdr->dst)
-                break;
-        }
-    }
-    if (!iface)
+    // デバイスに設定されたアドレス（ユニキャストとブロードキャスト）のいずれにも一致しない場合は「他ホスト宛」と判断して中断する（エラーメッセージは出力しない）
+    // NOTE: アドレスの数によらずハッシュ表を1回引くだけで決まる
+    if (hdr->dst == IP_ADDR_BROADCAST)
+        iface = primary;
+    else
+        iface = ip_iface_lookup(dev, hdr->dst);
+    if (!iface) {
+        // ルータとして動作している場合は他ホスト宛のデータグラムを転送する
+        // NOTE: 受信キューのエントリはソフトウェア割り込みの処理が終わるまで解放されないので、そのまま書き換えて送信に使う
+        if (atomic_load_explicit(&forwarding, memory_order_relaxed))
+            ip_forward((uint8_t *)data, total, primary);
         return;
+    }
 
     debugf("dev=%s, iface=%s, protocol=%u, total=%u", dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), hdr->protocol, total);
     ip_dump(data, total);
 
+    // フラグメントかどうかの判断...MF(More Flagments)ビットが立っている or フラグメントオフセットに値がある
+    // フラグメントは揃うまで溜めておき、揃ったら再構築したペイロードを上位プロトコルに渡す
+    payload = (uint8_t *)hdr + hlen;
+    plen = total - hlen;
+    offset = ntoh16(hdr->offset);
+    if (offset & IP_OFFSET_MF || offset & IP_OFFSET_MASK) {
+        payload = ip_reasm_input(hdr, payload, plen, iface, &plen);
+        if (!payload)
+            return;
+    }
+
 
     // 上位プロトコルへのデータの振り分け
 
     // プロトコルの検索
-    // プロトコルリスト(protocols)を巡回
-    // IPヘッダのプロトコル番号と一致するプロトコルの入力関数を呼び出す（入力関数にはIPデータグラムのペイロードを渡す）
-    // 入力関数から戻ったらreturnする
+    // IPヘッダのプロトコル番号で表を引いて入力関数を呼び出す（入力関数にはIPデータグラムのペイロードを渡す）
     // 合致するプロトコルが見つからない場合は何もしない
-    struct ip_protocol *entry;
-    for (entry = protocols; entry; entry = entry->next) {
-        if (entry->type == hdr->protocol) {
-            entry->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
-            return;
-        }
-    }
+    struct ip_protocol *entry = &protocols[hdr->protocol];
+    if (entry->handler)
+        entry->handler(payload, plen, hdr->src, hdr->dst, iface);
     /* unsupported protocol */
+    if (payload != (uint8_t *)hdr + hlen)
+        memory_free(payload);
 }
 
-static int ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst) {
+// 宛先キャッシュの解決済みのアドレスがまだ使えるか（近隣の世代番号が変わっていないか）
+static int ip_dst_resolved(struct ip_dst *cache) {
+    return cache->resolved && atomic_load_explicit(cache->neighbor, memory_order_acquire) == cache->neighbor_gen;
+}
+
+static int ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst, struct ip_dst *cache) {
     uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
+    const atomic_uint *neighbor = NULL;
+    unsigned int gen = 0;
     int ret;
     
     if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) { // ARPによるアドレス解決が必要なデバイスのための処理
         
-        if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
+        if (cache && ip_dst_resolved(cache)) {
+            // 宛先キャッシュに解決済みのアドレスがあればARPを引かない
+            memcpy(hwaddr, cache->ha, NET_DEVICE_ADDR_LEN);
+        } else if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
             // 宛先がブロードキャストIPアドレスの場合にはARPによるアドレス解決は行わず
             // そのデバイスのブロードキャストHWアドレスを使う
             memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
@@ -437,10 +1446,22 @@ static int ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t
 
             // arp_resolve()を呼び出してアドレスを解決する
             // 戻り値がARPRESOLVE_FOUNDでなかったらその値をこの関数の戻り値として返す
-            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
+            // NOTE: 解決待ちの間はARP側でパケットを保留し、応答を受け取った時に送信される
+            // NOTE: 世代番号は解決する前に読む（解決している間に変わった場合は次の送信で解決し直す）
+            if (cache) {
+                neighbor = arp_generation(NET_IFACE(iface), dst);
+                gen = atomic_load_explicit(neighbor, memory_order_acquire);
+            }
+            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr, data, len);
             if (ret != ARP_RESOLVE_FOUND) {
                 return ret;
             }
+            if (cache) {
+                memcpy(cache->ha, hwaddr, NET_DEVICE_ADDR_LEN);
+                cache->neighbor = neighbor;
+                cache->neighbor_gen = gen;
+                cache->resolved = 1;
+            }
         }
     }
 
@@ -449,17 +1470,86 @@ static int ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t
     return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
 }
 
-// IPデータグラムを生成
-static ssize_t ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset) {
-    uint8_t buf[IP_TOTAL_SIZE_MAX];
+// 先頭以外のフラグメントのヘッダをdstに作って長さを返す（オプションはcopiedフラグが立っているものだけ残す、RFC 791）
+static uint16_t ip_fragment_header(const uint8_t *hdr, uint16_t hlen, uint8_t *dst) {
+    uint16_t i, n, optlen;
+
+    memcpy(dst, hdr, IP_HDR_SIZE_MIN);
+    n = IP_HDR_SIZE_MIN;
+    for (i = IP_HDR_SIZE_MIN; i < hlen; i += optlen) {
+        if (hdr[i] == IP_OPTION_EOL)
+            break;
+        if (hdr[i] == IP_OPTION_NOP) {
+            optlen = 1;
+            continue;
+        }
+        optlen = i + 1 < hlen ? hdr[i + 1] : 0;
+        if (optlen < 2 || optlen > hlen - i)
+            break;
+        if (hdr[i] & IP_OPTION_COPIED) {
+            memcpy(dst + n, hdr + i, optlen);
+            n += optlen;
+        }
+    }
+    // 4byte単位になるようにEOLで埋める
+    while (n & 3)
+        dst[n++] = IP_OPTION_EOL;
+    ((struct ip_hdr *)dst)->vhl = (IP_VERSION_IPV4 << 4) | (n >> 2);
+    return n;
+}
+
+// IPデータグラムをMTUに収まるフラグメントに分けて送信する
+// NOTE: 各フラグメントのヘッダは直前のフラグメント（送信済み）のペイロードの末尾に上書きして作るので、ペイロードはコピーしない
+// NOTE: 先頭以外のフラグメントのヘッダは元のヘッダより長くならないので、bufの先頭より前にはみ出さない
+static int ip_output_fragment(struct ip_iface *iface, uint8_t *buf, uint16_t total, ip_addr_t nexthop, struct ip_dst *cache) {
+    uint8_t first[IP_HDR_SIZE_MAX], rest[IP_HDR_SIZE_MAX], *tmpl;
+    struct ip_hdr *hdr;
+    uint16_t hlen, restlen, len, payload, off, size, flags;
+
+    hlen = (buf[0] & 0x0f) << 2;
+    memcpy(first, buf, hlen);
+    payload = total - hlen;
+    flags = ntoh16(((struct ip_hdr *)first)->offset);
+    if (flags & IP_OFFSET_DF) {
+        errorf("too long with DF, dev=%s, mtu=%u < %u", NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, total);
+        return -1;
+    }
+    restlen = ip_fragment_header(first, hlen, rest);
+    for (off = 0; off < payload; off += size) {
+        // 元のデータグラムが先頭のフラグメントでなければ、すでに複製するオプションだけになっている
+        if (off == 0 || (flags & IP_OFFSET_MASK)) {
+            tmpl = first;
+            len = hlen;
+        } else {
+            tmpl = rest;
+            len = restlen;
+        }
+        // 最後以外のフラグメントのペイロードは8byteの倍数にする
+        size = (NET_IFACE(iface)->dev->mtu - len) & ~7;
+        if (size > payload - off)
+            size = payload - off;
+        // このフラグメントのペイロード（buf + hlen + off）の直前にヘッダを置く
+        hdr = (struct ip_hdr *)(buf + hlen + off - len);
+        memcpy(hdr, tmpl, len);
+        hdr->total = hton16(len + size);
+        hdr->offset = hton16((flags & ~IP_OFFSET_MASK) | (off + size < payload ? IP_OFFSET_MF : 0) | ((flags & IP_OFFSET_MASK) + (off >> 3)));
+        hdr->sum = 0;
+        hdr->sum = cksum16((uint16_t *)hdr, len, 0);
+        if (ip_output_device(iface, (uint8_t *)hdr, len + size, nexthop, cache) == -1) {
+            errorf("ip_output_device() failure, offset=%u", off);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// bufにIPデータグラムを生成して長さを返す
+static uint16_t ip_build(uint8_t *buf, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t id, uint16_t offset) {
     struct ip_hdr *hdr;
     uint16_t hlen, total;
-    char addr[IP_ADDR_STR_LEN];
 
     hdr = (struct ip_hdr *) buf;
 
-    // IPデータグラムの生成
-    
     // IPヘッダの各フィールドに値を設定
     // IPヘッダの長さはIP_HDR_SIZE_MINを固定とする（オプションなし）
     // TOS=0, TTL=255とする
@@ -481,32 +1571,192 @@ static ssize_t ip_output_core(struct ip_iface *iface, uint8_t protocol, const ui
 
     // IPヘッダの直後にデータを配置する
     memcpy(hdr+1, data, len);
+    return total;
+}
+
+// IPデータグラムを生成
+static ssize_t ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset, struct ip_dst *cache) {
+    uint8_t buf[IP_TOTAL_SIZE_MAX];
+    uint16_t total;
+    char addr[IP_ADDR_STR_LEN];
+
+    total = ip_build(buf, protocol, data, len, src, dst, id, offset);
 
     debugf("dev=%s, dst=%s, protocol=%u, len=%u", NET_IFACE(iface)->dev->name, ip_addr_ntop(dst, addr, sizeof(addr)), protocol, total);
     ip_dump(buf, total);
 
+    // MTUを超える場合はフラグメントに分けて送る
+    if (total > NET_IFACE(iface)->dev->mtu)
+        return ip_output_fragment(iface, buf, total, nexthop, cache);
+
     // 生成したIPデータグラムを実際にデバイスから送信するための関数に渡す
-    return ip_output_device(iface, buf, total, nexthop);
+    return ip_output_device(iface, buf, total, nexthop, cache);
 }
 
-static uint16_t ip_generate_id(void) {
-    static mutex_t mutex = MUTEX_INITIALIZER;
-    static uint16_t id = 128;
-    uint16_t ret;
+/*
+    Forwarding
+    NOTE: Forwarding functions must be called from the softirq thread
+*/
 
-    mutex_lock(&mutex);
-    ret = id++;
-    mutex_unlock(&mutex);
+// 転送できなかったことを送信元に知らせる（先頭以外のフラグメントについては知らせない）
+static void ip_forward_error(const struct ip_hdr *hdr, struct ip_iface *iface, uint8_t type, uint8_t code, uint32_t values) {
+    size_t len;
 
-    return ret;
+    if (ntoh16(hdr->offset) & IP_OFFSET_MASK)
+        return;
+    len = ((hdr->vhl & 0x0f) << 2) + MIN(ntoh16(hdr->total) - ((hdr->vhl & 0x0f) << 2), 8);
+    icmp_output(type, code, values, (const uint8_t *)hdr, len, iface->unicast, hdr->src);
 }
 
-ssize_t ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst) {
-    struct ip_route *route;
+// 溜めておいたデータグラムを送信するデバイスごとにまとめて送る
+static void ip_forward_flush(void) {
+    struct ip_forward_entry *entry;
+    struct net_device *dev;
+    struct net_vec vec[IP_FORWARD_BATCH];
+    int i, j, n, ret;
+
+    for (i = 0; i < forward_num; i++) {
+        dev = forward_batch[i].dev;
+        if (!dev)
+            continue;
+        // 同じデバイスから出ていくものを集めてまとめて渡す
+        for (j = i, n = 0; j < forward_num; j++) {
+            entry = &forward_batch[j];
+            if (entry->dev != dev)
+                continue;
+            vec[n].data = entry->data;
+            vec[n].len = entry->len;
+            vec[n].dst = entry->ha;
+            n++;
+            entry->dev = NULL;
+        }
+        ret = net_device_output_batch(dev, NET_PROTOCOL_TYPE_IP, vec, n);
+        if (ret == -1)
+            ret = 0;
+        forward_stats.forwarded += ret;
+        forward_stats.dropped += n - ret;
+    }
+    forward_num = 0;
+}
+
+static void ip_forward(uint8_t *data, size_t len, struct ip_iface *iface) {
+    struct ip_hdr *hdr;
+    struct ip_nexthop nh;
+    struct ip_iface *out;
+    struct ip_forward_entry *entry;
+    ip_addr_t nexthop;
+    uint16_t old, new;
+    int ret;
+
+    hdr = (struct ip_hdr *)data;
+    // ブロードキャストやマルチキャストは転送しない
+    if (hdr->dst == IP_ADDR_BROADCAST || (ntoh32(hdr->dst) & 0xf0000000) == 0xe0000000 ||
+        hdr->src == IP_ADDR_BROADCAST || (ntoh32(hdr->src) & 0xf0000000) == 0xe0000000) {
+        forward_stats.dropped++;
+        return;
+    }
+    if (hdr->ttl <= 1) {
+        forward_stats.ttl_exceeded++;
+        ip_forward_error(hdr, iface, ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_TTL, 0);
+        return;
+    }
+    // マルチパスの経路では同じフローが同じ中継先を通るように5タプルのハッシュ値で選ぶ
+    if (ip_route_nexthop(hdr->dst, ip_flow_hash(data, len, route_seed), &nh) == -1) {
+        forward_stats.no_route++;
+        ip_forward_error(hdr, iface, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_NET_UNREACH, 0);
+        return;
+    }
+    out = nh.iface;
+    nexthop = nh.addr;
+    if (nexthop == out->broadcast) {
+        forward_stats.dropped++;
+        return;
+    }
+    if (len > NET_IFACE(out)->dev->mtu && (ntoh16(hdr->offset) & IP_OFFSET_DF)) {
+        forward_stats.frag_needed++;
+        ip_forward_error(hdr, iface, ICMP_TYPE_DEST_UNREACH, ICMP_CODE_FRAGMENT_NEEDED, hton32(NET_IFACE(out)->dev->mtu));
+        return;
+    }
+    // TTLを減らしてチェックサムは差分だけ更新する（TTLとプロトコル番号の16bitが変わる）
+    memcpy(&old, &hdr->ttl, sizeof(old));
+    hdr->ttl--;
+    memcpy(&new, &hdr->ttl, sizeof(new));
+    hdr->sum = cksum16_adjust(hdr->sum, old, new);
+    if (len > NET_IFACE(out)->dev->mtu) {
+        // フラグメントに分けるとバッファを書き換えてしまうので、まとめずにすぐに送る
+        if (ip_output_fragment(out, data, len, nexthop, NULL) == -1) {
+            forward_stats.dropped++;
+            return;
+        }
+        forward_stats.fragmented++;
+        forward_stats.forwarded++;
+        return;
+    }
+    if (forward_num == IP_FORWARD_BATCH)
+        ip_forward_flush();
+    entry = &forward_batch[forward_num];
+    memset(entry->ha, 0, sizeof(entry->ha));
+    if (NET_IFACE(out)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
+        // NOTE: 解決待ちの間はARP側でコピーして保留し、応答を受け取った時に送信される
+        ret = arp_resolve(NET_IFACE(out), nexthop, entry->ha, data, len);
+        if (ret != ARP_RESOLVE_FOUND) {
+            if (ret == ARP_RESOLVE_ERROR)
+                forward_stats.dropped++;
+            return;
+        }
+    }
+    entry->dev = NET_IFACE(out)->dev;
+    entry->data = data;
+    entry->len = len;
+    forward_num++;
+}
+
+void ip_set_forwarding(int enable) {
+    atomic_store(&forwarding, enable);
+    infof("forwarding %s", enable ? "enabled" : "disabled");
+}
+
+void ip_forward_get_stats(struct ip_forward_stats *stats) {
+    *stats = forward_stats;
+}
+
+// 5タプルからフローのハッシュ値を求める
+// NOTE: フラグメントは先頭のものも含めてポート番号を除く（同じデータグラムのフラグメントを同じ中継先・キューに入れて順序を保つ）
+uint32_t ip_flow_hash(const uint8_t *data, size_t len, uint32_t seed) {
+    const struct ip_hdr *hdr;
+    uint16_t hlen;
+    uint32_t ports = 0;
+
+    if (len < IP_HDR_SIZE_MIN)
+        return hash32_3words(0, 0, 0, seed);
+    hdr = (const struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if ((hdr->protocol == IP_PROTOCOL_TCP || hdr->protocol == IP_PROTOCOL_UDP) &&
+        !(ntoh16(hdr->offset) & (IP_OFFSET_MF | IP_OFFSET_MASK)) && len >= (size_t)hlen + 4) {
+        memcpy(&ports, data + hlen, sizeof(ports));
+    }
+    return hash32_3words(hdr->src, hdr->dst, ports ^ hdr->protocol, seed);
+}
+
+// IDをcount個まとめて採番して先頭を返す
+// NOTE: IDは（送信元, 宛先, プロトコル）ごとに重複しなければよい（RFC 6864）ので、そのハッシュで選んだカウンタを
+//       アトミックに進める（ロックを取らない）。開始値はカウンタごとにずらして推測されにくくする（RFC 7739）
+// NOTE: DFを付けたデータグラムはフラグメントに分けられない（atomic datagram）のでIDを使わない
+static uint16_t ip_generate_id(ip_addr_t src, ip_addr_t dst, uint8_t protocol, uint16_t offset, uint16_t count) {
+    uint32_t hash;
+
+    if (offset & IP_OFFSET_DF)
+        return 0;
+    hash = hash32_3words(src, dst, protocol, id_seed);
+    return atomic_fetch_add_explicit(&id_space[hash & (IP_ID_SPACE_SIZE - 1)], count, memory_order_relaxed) + (hash >> 16);
+}
+
+// 宛先キャッシュを使って送信する（確立済みのコネクションでは経路もARPも引かない）
+ssize_t ip_output_dst(struct ip_dst *cache, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst) {
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     ip_addr_t nexthop;
-    uint16_t id;
+    uint16_t id, offset;
     
     // 送信元アドレスが指定されていない場合、ブロードキャストアドレスあてへの送信はできない
     if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
@@ -514,46 +1764,138 @@ ssize_t ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t s
         return -1;
     } 
 
-    // 宛先アドレスへの経路情報を取得
-    route = ip_route_lookup(dst);
-    if (!route) {
+    // 宛先アドレスへの経路情報を取得（キャッシュが有効なら引かない）
+    iface = ip_dst_lookup(cache, dst, src, protocol, data, len);
+    if (!iface) {
         errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
         return -1;
     }
     
     // インタフェースのIPアドレスと異なるIPアドレスで
     // 送信できないように制限（強いエンドシステム）
-    iface = route->iface;
     if (src != IP_ADDR_ANY && src != iface->unicast) {
         errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
         return -1;
     }
 
     // nexthop ... IPパケットの次の送り先（IPヘッダの宛先とは異なる）
-    nexthop = (route->nexthop != IP_ADDR_ANY)? route->nexthop: dst;
+    nexthop = cache->nexthop;
 
-    // フラグメンテーションをサポートしないのでＭＴＵを超える場合はエラーを返す
-    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
-        errorf("too long, dev=%s, mtu=%u < %zu", NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
+    // IPデータグラムの最大長を超える場合はエラーを返す（MTUを超える分はip_output_core()でフラグメントに分ける）
+    if (len > IP_PAYLOAD_SIZE_MAX) {
+        errorf("too long, len=%zu", len);
         return -1;
     }
 
     // IPデータグラムのIDを採番
-    id = ip_generate_id();
+    offset = cache->df ? IP_OFFSET_DF : 0;
+    id = ip_generate_id(iface->unicast, dst, protocol, offset, 1);
     
     // IPデータグラムを生成して出力するための関数を呼ぶ
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, offset, cache) == -1) {
         errorf("ip_output_core() failure");
         return -1;
     }
     return len;
 }
 
+// 同じ宛先への複数のデータグラムをまとめて送信する（vecのdstは使わない, 送信できた数を返す）
+// 経路とARPは1回だけ引き、IDはまとめて採番し、ヘッダを付けたデータグラムはデバイスにまとめて渡す
+int ip_output_batch(struct ip_dst *cache, uint8_t protocol, const struct net_vec *vec, int num, ip_addr_t src, ip_addr_t dst) {
+    uint8_t buf[IP_TOTAL_SIZE_MAX];
+    struct net_vec out[IP_OUTPUT_BATCH];
+    struct ip_iface *iface;
+    struct net_device *dev;
+    uint8_t ha[NET_DEVICE_ADDR_LEN] = {};
+    char addr[IP_ADDR_STR_LEN];
+    size_t used = 0;
+    uint16_t id, offset, total;
+    int i, n = 0, sent = 0, ret;
+
+    if (num <= 0)
+        return 0;
+    if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
+        errorf("ip routing does not implement");
+        return -1;
+    }
+    iface = ip_dst_lookup(cache, dst, src, protocol, vec[0].data, vec[0].len);
+    if (!iface) {
+        errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
+        return -1;
+    }
+    if (src != IP_ADDR_ANY && src != iface->unicast) {
+        errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
+        return -1;
+    }
+    dev = NET_IFACE(iface)->dev;
+    for (i = 0; i < num; i++) {
+        if (vec[i].len > IP_PAYLOAD_SIZE_MAX || IP_HDR_SIZE_MIN + vec[i].len > dev->mtu)
+            break;
+    }
+    // フラグメントに分ける必要があるものを含む場合やアドレスが未解決の場合は1つずつ送る（ARPの解決待ちはARP側で保留される）
+    if (i < num || (dev->flags & NET_DEVICE_FLAG_NEED_ARP && !ip_dst_resolved(cache))) {
+        for (i = 0; i < num; i++) {
+            if (ip_output_dst(cache, protocol, vec[i].data, vec[i].len, src, dst) == -1)
+                break;
+        }
+        return i ? i : -1;
+    }
+    if (dev->flags & NET_DEVICE_FLAG_NEED_ARP)
+        memcpy(ha, cache->ha, NET_DEVICE_ADDR_LEN);
+    offset = cache->df ? IP_OFFSET_DF : 0;
+    id = ip_generate_id(iface->unicast, dst, protocol, offset, num);
+    for (i = 0; i < num; i++) {
+        if (n == IP_OUTPUT_BATCH || used + IP_HDR_SIZE_MIN + vec[i].len > sizeof(buf)) {
+            ret = net_device_output_batch(dev, NET_PROTOCOL_TYPE_IP, out, n);
+            if (ret == -1)
+                return sent ? sent : -1;
+            sent += ret;
+            if (ret < n)
+                return sent;
+            n = 0;
+            used = 0;
+        }
+        total = ip_build(buf + used, protocol, vec[i].data, vec[i].len, iface->unicast, dst, offset ? id : id + i, offset);
+        debugf("dev=%s, dst=%s, protocol=%u, len=%u", dev->name, ip_addr_ntop(dst, addr, sizeof(addr)), protocol, total);
+        ip_dump(buf + used, total);
+        out[n].data = buf + used;
+        out[n].len = total;
+        out[n].dst = ha;
+        n++;
+        used += total;
+    }
+    ret = net_device_output_batch(dev, NET_PROTOCOL_TYPE_IP, out, n);
+    if (ret == -1)
+        return sent ? sent : -1;
+    return sent + ret;
+}
+
+ssize_t ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst) {
+    struct ip_dst cache = {};
+
+    return ip_output_dst(&cache, protocol, data, len, src, dst);
+}
+
 int ip_init(void) {
+    struct timeval interval = {1, 0};
+
     // プロトコルスタックにIPの入力関数を登録する
     if (net_protocol_register(NET_PROTOCOL_TYPE_IP, ip_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
     }
+    addr_seed = random();
+    route_seed = random();
+    id_seed = random();
+    // 転送するデータグラムはソフトウェア割り込みの処理の区切りでまとめて送る
+    if (net_protocol_set_flush(NET_PROTOCOL_TYPE_IP, ip_forward_flush) == -1) {
+        errorf("net_protocol_set_flush() failure");
+        return -1;
+    }
+    // フラグメントの再構築のタイムアウトを確認するタイマー
+    if (net_timer_register(interval, ip_reasm_timer) == -1) {
+        errorf("net_timer_register() failure");
+        return -1;
+    }
     return 0;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <stdatomic.h>
 
 #include "net.h"
 
@@ -15,6 +16,16 @@
 #define IP_TOTAL_SIZE_MAX UINT16_MAX /* maximum value of uint16 */
 #define IP_PAYLOAD_SIZE_MAX (IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MIN)
 
+// フラグとフラグメントオフセット（offsetフィールド）
+#define IP_OFFSET_DF   0x4000 // Don't Fragment
+#define IP_OFFSET_MF   0x2000 // More Fragments
+#define IP_OFFSET_MASK 0x1fff // 8byte単位のフラグメントオフセット
+
+// オプションの種別（先頭の1byte）
+#define IP_OPTION_EOL    0x00 // End of Option List
+#define IP_OPTION_NOP    0x01 // No Operation
+#define IP_OPTION_COPIED 0x80 // フラグメントに分ける時に全てのフラグメントへ複製する
+
 #define IP_ADDR_LEN 4
 #define IP_ADDR_STR_LEN 16 /* "ddd.ddd.ddd.ddd\0" */
 
@@ -35,6 +46,22 @@ struct ip_endpoint {
     uint16_t port;
 };
 
+// IPヘッダを表現するための構造体
+// この構造体にキャストすることでバイト列をIPヘッダと見なしてアクセスできる
+struct ip_hdr {
+    uint8_t vhl; // バージョン(4bit)とIPヘッダ長(4bit)をまとめて8bitとして扱う
+    uint8_t tos;
+    uint16_t total;
+    uint16_t id;
+    uint16_t offset; // フラグ(3bit)とフラグメントオフセット(13bit)をまとめて16bitとして扱う
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t sum;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint8_t options[]; // オプション（可変長なのでフレキシブル配列メンバとする）
+};
+
 struct ip_iface {
     struct net_iface iface; // インタフェース構造体
     struct ip_iface *next; // 次のIPインタフェースへのポインタ
@@ -43,6 +70,22 @@ struct ip_iface {
     ip_addr_t broadcast; // ブロードキャストアドレス
 };
 
+/*
+ * 宛先キャッシュ（コネクションごとに経路とARPの解決結果を覚えておく）
+ * NOTE: 経路や近隣の情報が変わると世代番号が進み、次の送信で引き直される
+ */
+struct ip_dst {
+    unsigned int genid; // 作成した時の世代番号
+    ip_addr_t dst;
+    ip_addr_t nexthop;
+    struct ip_iface *iface;
+    int resolved;       // haが有効
+    const atomic_uint *neighbor; // haを解決した時の近隣の世代番号（ARPが進めたら解決し直す）
+    unsigned int neighbor_gen;
+    int df;             // DFを立てて送る（MTUを超える場合はフラグメント化せずにエラーにする）
+    uint8_t ha[NET_DEVICE_ADDR_LEN];
+};
+
 extern const ip_addr_t IP_ADDR_ANY;
 extern const ip_addr_t IP_ADDR_BROADCAST;
 
@@ -53,17 +96,71 @@ extern char *ip_addr_ntop(ip_addr_t n, char *p, size_t size);
 extern int ip_endpoint_pton(const char *p, struct ip_endpoint *n);
 extern char *ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
+// マルチパスの経路で次の中継先を選ぶ方法
+#define IP_ROUTE_MULTIPATH_HASH       0 // ハッシュ値を重みの合計で割った余り（RFC 2992）
+#define IP_ROUTE_MULTIPATH_RENDEZVOUS 1 // Rendezvous hashing（中継先が増減しても他の中継先のフローは移らない）
+
+#define IP_ROUTE_NEXTHOP_MAX 8
+
+extern int ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface);
+extern int ip_route_del(ip_addr_t network, ip_addr_t netmask);
+extern int ip_route_add_nexthop(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface, uint8_t weight);
+extern int ip_route_del_nexthop(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface);
+extern void ip_route_set_multipath(int mode);
 extern int ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
 extern struct ip_iface *ip_route_get_iface(ip_addr_t dst);
+extern ip_addr_t ip_route_get_nexthop(ip_addr_t dst);
 
 
 extern struct ip_iface *ip_iface_alloc(const char *addr, const char *netmask);
 extern int ip_iface_register(struct net_device *dev, struct ip_iface * iface);
 extern struct ip_iface *ip_iface_select(ip_addr_t addr);
+extern struct ip_iface *ip_iface_lookup(struct net_device *dev, ip_addr_t addr);
+
+// Path MTU Discovery（RFC 1191）
+#define IP_PMTU_MIN 552     // これより小さいMTUを知らされてもこの値で止める
+#define IP_PMTU_TIMEOUT 600 // seconds
+
+extern uint16_t ip_pmtu_get(ip_addr_t dst);
+extern void ip_pmtu_input(const uint8_t *data, size_t len, uint16_t mtu);
+
+extern void ip_dst_invalidate(void);
+extern struct ip_iface *ip_dst_iface(struct ip_dst *cache, ip_addr_t dst);
+extern void ip_confirm_neighbor(struct ip_dst *cache);
 
 extern ssize_t ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+extern ssize_t ip_output_dst(struct ip_dst *cache, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+extern int ip_output_batch(struct ip_dst *cache, uint8_t protocol, const struct net_vec *vec, int num, ip_addr_t src, ip_addr_t dst);
+
+// フラグメントの再構築の統計情報
+struct ip_reasm_stats {
+    unsigned long fragments;  // 受け取ったフラグメント
+    unsigned long reassembled; // 再構築できたデータグラム
+    unsigned long timeouts;   // 時間内に揃わなかったデータグラム
+    unsigned long evicted;    // メモリの上限を超えたので捨てたデータグラム
+    unsigned long failed;     // 不正なフラグメントやメモリ不足で捨てたデータグラム
+    unsigned long mem;        // 使用中のメモリ（bytes）
+};
+
+extern void ip_reasm_get_stats(struct ip_reasm_stats *stats);
+
+// 転送（ルータとして動作する場合）の統計情報
+struct ip_forward_stats {
+    unsigned long forwarded;    // 転送したデータグラム
+    unsigned long fragmented;   // MTUを超えるのでフラグメントに分けて転送したデータグラム
+    unsigned long ttl_exceeded; // TTLが尽きたので捨てたデータグラム
+    unsigned long no_route;     // 経路がないので捨てたデータグラム
+    unsigned long frag_needed;  // MTUを超えるがDFが立っているので捨てたデータグラム
+    unsigned long dropped;      // その他の理由（アドレス解決や送信の失敗など）で捨てたデータグラム
+};
+
+extern void ip_set_forwarding(int enable);
+extern void ip_forward_get_stats(struct ip_forward_stats *stats);
+
+extern uint32_t ip_flow_hash(const uint8_t *data, size_t len, uint32_t seed);
 
 extern int ip_protocol_register(uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+extern int ip_protocol_set_pmtu(uint8_t type, int (*pmtu)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t mtu));
 
 extern int ip_init(void);
 
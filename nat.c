@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "nat.h"
+
+/*
+ * NAT（アドレスとポートの変換）
+ *   コネクション追跡: 5タプルをキーにしたハッシュ表で、往路(ORIG)と復路(REPLY)のどちらの向きでも1回の表引きで見つける
+ *   変換: 新しいフローにだけ規則を適用し（DNATで宛先、SNATで送信元とポート）、以降はエントリの通りに書き換える
+ *   チェックサム: 書き換えたフィールドの差分だけ更新する（IP, TCP, UDP, ICMP）
+ *   タイムアウト: 1秒刻みのタイマーホイールで管理し、パケットごとの更新は期限を書き換えるだけにする
+ * NOTE: 変換とタイマーは割り込み処理のスレッドでしか動かないのでロックは取らない
+ * NOTE: フラグメントとICMPのエラーメッセージ（中に含まれるヘッダ）は変換しない
+ */
+
+#define NAT_DIR_ORIG  0
+#define NAT_DIR_REPLY 1
+
+#define NAT_WHEEL_SIZE 256 // slots (1 second each)
+
+#define NAT_PORT_MIN 1024
+#define NAT_PORT_TRIES 128 // SNATで空いているポートを探す回数
+
+#define NAT_TCP_FLG_FIN 0x01
+#define NAT_TCP_FLG_RST 0x04
+
+#define NAT_ICMP_TYPE_ECHOREPLY 0
+#define NAT_ICMP_TYPE_ECHO      8
+
+struct nat_tuple {
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t sport; // ICMPはEchoのID（sport, dportとも同じ値）
+    uint16_t dport;
+    uint8_t protocol;
+};
+
+struct nat_hnode {
+    struct nat_hnode *next;
+    uint8_t dir;
+};
+
+struct nat_conn {
+    struct nat_hnode hnode[2];  // 往路と復路のタプルでそれぞれハッシュ表に繋ぐ
+    struct nat_tuple tuple[2];  // 届いた時のタプル（変換後のタプルは反対向きのタプルを入れ替えたもの）
+    struct nat_conn *prev;      // タイマーホイールのスロット（空きエントリのリスト）
+    struct nat_conn *next;
+    uint32_t expire;
+    uint8_t slot;
+    uint8_t closing;            // TCPのFINかRSTを見た（以降は短いタイムアウトのまま延ばさない）
+};
+
+struct nat_snat {
+    struct nat_snat *next;
+    ip_addr_t network;
+    ip_addr_t netmask;
+    struct ip_iface *iface;
+    ip_addr_t to;
+};
+
+struct nat_dnat {
+    struct nat_dnat *next;
+    uint8_t protocol;
+    struct ip_endpoint match;
+    int num;
+    struct ip_endpoint backends[NAT_BACKEND_MAX];
+};
+
+struct nat_tcp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t off;
+    uint8_t flg;
+    uint16_t wnd;
+    uint16_t sum;
+    uint16_t up;
+};
+
+struct nat_udp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint16_t len;
+    uint16_t sum;
+};
+
+struct nat_icmp_hdr {
+    uint8_t type;
+    uint8_t code;
+    uint16_t sum;
+    uint16_t id;
+    uint16_t seq;
+};
+
+/* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex */
+static struct nat_snat *snats;
+static struct nat_dnat *dnats;
+
+static struct nat_conn *conns;
+static struct nat_conn *conn_free;
+static struct nat_hnode **buckets;
+static uint32_t bucket_mask;
+static uint32_t seed;
+static struct nat_conn *wheel[NAT_WHEEL_SIZE];
+static uint32_t nat_clock; // seconds
+static struct nat_stats stats;
+
+static uint32_t nat_tuple_hash(const struct nat_tuple *t) {
+    return hash32_3words(t->src, t->dst, ((uint32_t)t->sport << 16 | t->dport) ^ t->protocol, seed);
+}
+
+static int nat_tuple_equal(const struct nat_tuple *a, const struct nat_tuple *b) {
+    return a->src == b->src && a->dst == b->dst && a->sport == b->sport && a->dport == b->dport && a->protocol == b->protocol;
+}
+
+static struct nat_conn *nat_conn_of(struct nat_hnode *node) {
+    return (struct nat_conn *)((uint8_t *)(node - node->dir) - offsetof(struct nat_conn, hnode));
+}
+
+static struct nat_conn *nat_lookup(const struct nat_tuple *t, int *dir) {
+    struct nat_hnode *node;
+    struct nat_conn *conn;
+
+    for (node = buckets[nat_tuple_hash(t) & bucket_mask]; node; node = node->next) {
+        conn = nat_conn_of(node);
+        if (nat_tuple_equal(&conn->tuple[node->dir], t)) {
+            *dir = node->dir;
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+static void nat_hash_add(struct nat_conn *conn, int dir) {
+    struct nat_hnode **head;
+
+    head = &buckets[nat_tuple_hash(&conn->tuple[dir]) & bucket_mask];
+    conn->hnode[dir].dir = dir;
+    conn->hnode[dir].next = *head;
+    *head = &conn->hnode[dir];
+}
+
+static void nat_hash_del(struct nat_conn *conn, int dir) {
+    struct nat_hnode **p;
+
+    for (p = &buckets[nat_tuple_hash(&conn->tuple[dir]) & bucket_mask]; *p != &conn->hnode[dir]; p = &(*p)->next)
+        ;
+    *p = conn->hnode[dir].next;
+}
+
+/*
+    Timer Wheel
+    NOTE: 期限が延びてもスロットは移さず、そのスロットを処理する時に移し直す
+*/
+
+static void nat_wheel_link(struct nat_conn *conn) {
+    conn->slot = conn->expire & (NAT_WHEEL_SIZE - 1);
+    conn->prev = NULL;
+    conn->next = wheel[conn->slot];
+    if (conn->next)
+        conn->next->prev = conn;
+    wheel[conn->slot] = conn;
+}
+
+static void nat_wheel_unlink(struct nat_conn *conn) {
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        wheel[conn->slot] = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+}
+
+static void nat_conn_refresh(struct nat_conn *conn, uint32_t timeout) {
+    uint32_t expire;
+
+    expire = nat_clock + timeout;
+    // 期限が早まる場合（TCPの終了）だけはすぐにスロットを移す
+    if (expire < conn->expire) {
+        nat_wheel_unlink(conn);
+        conn->expire = expire;
+        nat_wheel_link(conn);
+        return;
+    }
+    conn->expire = expire;
+}
+
+static void nat_conn_free(struct nat_conn *conn) {
+    nat_hash_del(conn, NAT_DIR_ORIG);
+    nat_hash_del(conn, NAT_DIR_REPLY);
+    nat_wheel_unlink(conn);
+    conn->next = conn_free;
+    conn_free = conn;
+    stats.conns--;
+}
+
+static void nat_timer(void) {
+    struct nat_conn *conn, *next;
+    uint8_t slot;
+
+    nat_clock++;
+    slot = nat_clock & (NAT_WHEEL_SIZE - 1);
+    for (conn = wheel[slot]; conn; conn = next) {
+        next = conn->next;
+        if (conn->expire <= nat_clock) {
+            nat_conn_free(conn);
+            stats.expired++;
+        } else if ((conn->expire & (NAT_WHEEL_SIZE - 1)) != slot) {
+            nat_wheel_unlink(conn);
+            nat_wheel_link(conn);
+        }
+    }
+}
+
+/*
+    Rules
+*/
+
+static struct nat_dnat *nat_dnat_select(const struct nat_tuple *t) {
+    struct nat_dnat *rule;
+
+    for (rule = dnats; rule; rule = rule->next) {
+        if (rule->protocol == t->protocol && rule->match.addr == t->dst && (!rule->match.port || rule->match.port == t->dport))
+            return rule;
+    }
+    return NULL;
+}
+
+static struct nat_snat *nat_snat_select(const struct nat_tuple *t, struct ip_iface *iface) {
+    struct nat_snat *rule;
+
+    for (rule = snats; rule; rule = rule->next) {
+        if ((t->src & rule->netmask) == rule->network && (!rule->iface || rule->iface == iface))
+            return rule;
+    }
+    return NULL;
+}
+
+// 変換後の送信元ポート（ICMPはID）を復路のタプルが重ならないように選ぶ（元のポートが空いていればそのまま使う）
+static int nat_port_select(struct nat_tuple *reply, uint16_t port) {
+    uint32_t start, range, i;
+    uint16_t candidate;
+    int dir;
+
+    range = 65536 - NAT_PORT_MIN;
+    start = nat_tuple_hash(reply) % range;
+    for (i = 0; i < NAT_PORT_TRIES; i++) {
+        candidate = hton16(NAT_PORT_MIN + (start + i) % range);
+        // ICMPのIDには予約された範囲がないので元の値を使ってよい
+        if (i == 0 && (ntoh16(port) >= NAT_PORT_MIN || reply->protocol == IP_PROTOCOL_ICMP))
+            candidate = port;
+        reply->dport = candidate;
+        if (reply->protocol == IP_PROTOCOL_ICMP)
+            reply->sport = candidate;
+        if (!nat_lookup(reply, &dir))
+            return 0;
+    }
+    return -1;
+}
+
+// 新しいフローに規則を適用してエントリを作る（0: 変換しない, -1: 捨てる）
+static int nat_conn_create(const struct nat_tuple *t, struct nat_conn **conn) {
+    struct nat_tuple out, reply;
+    struct nat_dnat *dnat;
+    struct nat_snat *snat;
+    struct ip_endpoint *backend;
+    struct ip_iface *iface;
+    int dir;
+
+    out = *t;
+    dnat = nat_dnat_select(t);
+    if (dnat) {
+        // 同じフローは同じバックエンドへ
+        backend = &dnat->backends[hash32_3words(t->src, t->sport, 0, seed) % dnat->num];
+        out.dst = backend->addr;
+        if (backend->port)
+            out.dport = backend->port;
+        if (out.protocol == IP_PROTOCOL_ICMP)
+            out.sport = out.dport;
+    }
+    // 送信元の変換は宛先（DNAT後）への経路で出ていくインタフェースで決める
+    // NOTE: 自ホスト宛て（ゲートウェイへのpingなど）は転送しないので送信元を変換しない
+    iface = ip_iface_select(out.dst) ? NULL : ip_route_get_iface(out.dst);
+    snat = iface ? nat_snat_select(t, iface) : NULL;
+    if (snat && iface)
+        out.src = snat->to != IP_ADDR_ANY ? snat->to : iface->unicast;
+    if (!dnat && (!snat || !iface))
+        return 0;
+    reply.src = out.dst;
+    reply.dst = out.src;
+    reply.sport = out.dport;
+    reply.dport = out.sport;
+    reply.protocol = out.protocol;
+    if (out.src != t->src) {
+        if (nat_port_select(&reply, t->sport) == -1) {
+            stats.no_port++;
+            return -1;
+        }
+    } else if (nat_lookup(&reply, &dir)) {
+        stats.no_port++;
+        return -1;
+    }
+    if (!conn_free) {
+        stats.table_full++;
+        return -1;
+    }
+    *conn = conn_free;
+    conn_free = conn_free->next;
+    (*conn)->tuple[NAT_DIR_ORIG] = *t;
+    (*conn)->tuple[NAT_DIR_REPLY] = reply;
+    nat_hash_add(*conn, NAT_DIR_ORIG);
+    nat_hash_add(*conn, NAT_DIR_REPLY);
+    (*conn)->closing = 0;
+    // タイマーホイールにはnat_input()で期限を決めてから入れる
+    stats.conns++;
+    stats.created++;
+    return 1;
+}
+
+/*
+    Translation
+*/
+
+static void nat_rewrite_addr(ip_addr_t *field, ip_addr_t addr, struct ip_hdr *hdr, uint16_t *l4sum) {
+    if (*field == addr)
+        return;
+    hdr->sum = cksum16_adjust32(hdr->sum, *field, addr);
+    if (l4sum)
+        *l4sum = cksum16_adjust32(*l4sum, *field, addr);
+    *field = addr;
+}
+
+static void nat_rewrite_port(uint16_t *field, uint16_t port, uint16_t *l4sum) {
+    if (*field == port)
+        return;
+    if (l4sum)
+        *l4sum = cksum16_adjust(*l4sum, *field, port);
+    *field = port;
+}
+
+// 反対向きのタプル（to）を入れ替えた値に書き換える
+static void nat_rewrite(struct ip_hdr *hdr, uint8_t *l4, const struct nat_tuple *to) {
+    struct nat_udp_hdr *udp;
+    struct nat_tcp_hdr *tcp;
+    struct nat_icmp_hdr *icmp;
+    uint16_t *sum = NULL;
+
+    switch (hdr->protocol) {
+        case IP_PROTOCOL_TCP:
+            tcp = (struct nat_tcp_hdr *)l4;
+            nat_rewrite_addr(&hdr->src, to->dst, hdr, &tcp->sum);
+            nat_rewrite_addr(&hdr->dst, to->src, hdr, &tcp->sum);
+            nat_rewrite_port(&tcp->src, to->dport, &tcp->sum);
+            nat_rewrite_port(&tcp->dst, to->sport, &tcp->sum);
+            break;
+        case IP_PROTOCOL_UDP:
+            udp = (struct nat_udp_hdr *)l4;
+            // チェックサムが0（計算していない）ならそのまま
+            if (udp->sum)
+                sum = &udp->sum;
+            nat_rewrite_addr(&hdr->src, to->dst, hdr, sum);
+            nat_rewrite_addr(&hdr->dst, to->src, hdr, sum);
+            nat_rewrite_port(&udp->src, to->dport, sum);
+            nat_rewrite_port(&udp->dst, to->sport, sum);
+            if (sum && !*sum)
+                *sum = 0xffff;
+            break;
+        case IP_PROTOCOL_ICMP:
+            // ICMPのチェックサムは疑似ヘッダを含まない
+            icmp = (struct nat_icmp_hdr *)l4;
+            nat_rewrite_addr(&hdr->src, to->dst, hdr, NULL);
+            nat_rewrite_addr(&hdr->dst, to->src, hdr, NULL);
+            nat_rewrite_port(&icmp->id, to->sport, &icmp->sum);
+            break;
+    }
+}
+
+// 受信したデータグラムのタプルを取り出す（変換の対象外なら-1）
+static int nat_tuple_parse(struct ip_hdr *hdr, size_t len, struct nat_tuple *t, uint8_t **l4) {
+    uint16_t hlen, offset;
+    struct nat_icmp_hdr *icmp;
+
+    hlen = (hdr->vhl & 0x0f) << 2;
+    offset = ntoh16(hdr->offset);
+    if (offset & IP_OFFSET_MF || offset & IP_OFFSET_MASK)
+        return -1;
+    *l4 = (uint8_t *)hdr + hlen;
+    t->src = hdr->src;
+    t->dst = hdr->dst;
+    t->protocol = hdr->protocol;
+    switch (hdr->protocol) {
+        case IP_PROTOCOL_TCP:
+            if (len < hlen + sizeof(struct nat_tcp_hdr))
+                return -1;
+            t->sport = ((struct nat_tcp_hdr *)*l4)->src;
+            t->dport = ((struct nat_tcp_hdr *)*l4)->dst;
+            return 0;
+        case IP_PROTOCOL_UDP:
+            if (len < hlen + sizeof(struct nat_udp_hdr))
+                return -1;
+            t->sport = ((struct nat_udp_hdr *)*l4)->src;
+            t->dport = ((struct nat_udp_hdr *)*l4)->dst;
+            return 0;
+        case IP_PROTOCOL_ICMP:
+            if (len < hlen + sizeof(struct nat_icmp_hdr))
+                return -1;
+            icmp = (struct nat_icmp_hdr *)*l4;
+            if (icmp->type != NAT_ICMP_TYPE_ECHO && icmp->type != NAT_ICMP_TYPE_ECHOREPLY)
+                return -1;
+            t->sport = t->dport = icmp->id;
+            return 0;
+    }
+    return -1;
+}
+
+// 受信したデータグラムを変換する（変換すると宛先が変わるので、自ホスト宛てか転送するかを決める前に呼び出す）
+int nat_input(uint8_t *data, size_t len) {
+    struct ip_hdr *hdr;
+    struct nat_tuple t;
+    struct nat_conn *conn;
+    uint8_t *l4;
+    uint32_t timeout;
+    int dir, ret, created;
+
+    if (!conns)
+        return 0;
+    hdr = (struct ip_hdr *)data;
+    if (nat_tuple_parse(hdr, len, &t, &l4) == -1)
+        return 0;
+    conn = nat_lookup(&t, &dir);
+    created = 0;
+    if (!conn) {
+        ret = nat_conn_create(&t, &conn);
+        if (ret != 1)
+            return ret;
+        dir = NAT_DIR_ORIG;
+        created = 1;
+    }
+    switch (t.protocol) {
+        case IP_PROTOCOL_TCP:
+            // FINかRSTを一度見たら、その後のパケット（終了時の最後のACKなど）でも期限を延ばさない
+            if (((struct nat_tcp_hdr *)l4)->flg & (NAT_TCP_FLG_FIN | NAT_TCP_FLG_RST))
+                conn->closing = 1;
+            timeout = conn->closing ? NAT_TIMEOUT_TCP_CLOSING : NAT_TIMEOUT_TCP;
+            break;
+        case IP_PROTOCOL_UDP:
+            timeout = NAT_TIMEOUT_UDP;
+            break;
+        default:
+            timeout = NAT_TIMEOUT_ICMP;
+            break;
+    }
+    if (created) {
+        conn->expire = nat_clock + timeout;
+        nat_wheel_link(conn);
+    } else {
+        nat_conn_refresh(conn, timeout);
+    }
+    nat_rewrite(hdr, l4, &conn->tuple[!dir]);
+    stats.translated++;
+    return 0;
+}
+
+int nat_snat_add(ip_addr_t network, ip_addr_t netmask, struct ip_iface *iface, ip_addr_t to) {
+    struct nat_snat *rule;
+
+    rule = memory_alloc(sizeof(*rule));
+    if (!rule) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    rule->network = network & netmask;
+    rule->netmask = netmask;
+    rule->iface = iface;
+    rule->to = to;
+    rule->next = snats;
+    snats = rule;
+    return 0;
+}
+
+int nat_dnat_add(uint8_t protocol, const struct ip_endpoint *match, const struct ip_endpoint *to) {
+    struct nat_dnat *rule;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+
+    for (rule = dnats; rule; rule = rule->next) {
+        if (rule->protocol == protocol && rule->match.addr == match->addr && rule->match.port == match->port)
+            break;
+    }
+    if (!rule) {
+        rule = memory_alloc(sizeof(*rule));
+        if (!rule) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        rule->protocol = protocol;
+        rule->match = *match;
+        rule->next = dnats;
+        dnats = rule;
+    }
+    if (rule->num >= NAT_BACKEND_MAX) {
+        errorf("too many backends, match=%s", ip_endpoint_ntop(match, ep1, sizeof(ep1)));
+        return -1;
+    }
+    rule->backends[rule->num++] = *to;
+    infof("protocol=%u, match=%s, to=%s, backends=%d", protocol,
+        ip_endpoint_ntop(match, ep1, sizeof(ep1)), ip_endpoint_ntop(to, ep2, sizeof(ep2)), rule->num);
+    return 0;
+}
+
+void nat_get_stats(struct nat_stats *s) {
+    *s = stats;
+}
+
+int nat_init(unsigned int max) {
+    struct timeval interval = {1, 0};
+    uint32_t size;
+    unsigned int i;
+
+    if (conns) {
+        errorf("already initialized");
+        return -1;
+    }
+    if (!max)
+        max = NAT_CONN_MAX_DEFAULT;
+    // エントリ1つにつき2つ（往路と復路）のノードを繋ぐので、バケットはその数以上にする
+    for (size = 1; size < max * 2; size <<= 1)
+        ;
+    conns = memory_alloc(sizeof(*conns) * max);
+    buckets = memory_alloc(sizeof(*buckets) * size);
+    if (!conns || !buckets) {
+        errorf("memory_alloc() failure");
+        memory_free(conns);
+        memory_free(buckets);
+        conns = NULL;
+        buckets = NULL;
+        return -1;
+    }
+    bucket_mask = size - 1;
+    for (i = max; i > 0; i--) {
+        conns[i-1].next = conn_free;
+        conn_free = &conns[i-1];
+    }
+    seed = random();
+    if (net_timer_register(interval, nat_timer) == -1) {
+        errorf("net_timer_register() failure");
+        return -1;
+    }
+    infof("initialized, max=%u, buckets=%u", max, size);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef NAT_H
+#define NAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ip.h"
+
+#define NAT_CONN_MAX_DEFAULT 65536
+#define NAT_BACKEND_MAX 16
+
+/* seconds */
+#define NAT_TIMEOUT_TCP         300
+#define NAT_TIMEOUT_TCP_CLOSING 10  /* after FIN or RST */
+#define NAT_TIMEOUT_UDP         30
+#define NAT_TIMEOUT_ICMP        30
+
+struct nat_stats {
+    unsigned long conns;      /* tracked now */
+    unsigned long created;
+    unsigned long expired;
+    unsigned long translated; /* packets */
+    unsigned long no_port;    /* no free port for SNAT */
+    unsigned long table_full;
+};
+
+/* NOTE: must not be call after net_run() */
+extern int nat_init(unsigned int max);
+// 送信元がnetwork/netmaskでifaceから出ていくフローの送信元をtoに変換する（toがIP_ADDR_ANYならifaceのアドレス）
+extern int nat_snat_add(ip_addr_t network, ip_addr_t netmask, struct ip_iface *iface, ip_addr_t to);
+// 宛先がmatchのフローの宛先をtoに変換する（同じmatchで複数登録するとフローごとに振り分ける）
+extern int nat_dnat_add(uint8_t protocol, const struct ip_endpoint *match, const struct ip_endpoint *to);
+
+/* NOTE: called from ip_input() in the interrupt thread */
+extern int nat_input(uint8_t *data, size_t len);
+
+extern void nat_get_stats(struct nat_stats *stats);
+
+#endif
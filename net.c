@@ -12,14 +12,23 @@
 #include "arp.h"
 #include "udp.h"
 #include "tcp.h"
+#include "capture.h"
+#include "qdisc.h"
 
 struct net_protocol {
     struct net_protocol *next;
     uint16_t type; // プロトコルの種別（net.hにNET_PROTOCOL_TYPE_XXXとして定義）
     struct queue_head queue; /* input queue 受信キュー*/
     void (*handler) (const uint8_t *data, size_t len, struct net_device *dev); // プロトコルの入力関数へのポインタ
+    void (*flush) (void); // まとめて処理したエントリを解放する前に呼び出す関数（なければNULL）
 };
 
+// ソフトウェア割り込みで1度にまとめて処理するエントリの数
+#define NET_SOFTIRQ_BATCH 32
+
+// Ethertypeから入力関数を引く表の大きさ（登録されているプロトコルが衝突しないハッシュ関数を登録時に選ぶ）
+#define NET_PROTOCOL_TABLE_SIZE 16
+
 struct net_protocol_queue_entry {
     struct net_device *dev;
     size_t len;
@@ -46,6 +55,9 @@ static struct net_protocol *protocols;
 static struct net_timer *timers;
 static struct net_event *events;
 
+static struct net_protocol *protocol_table[NET_PROTOCOL_TABLE_SIZE];
+static unsigned int protocol_shift;
+
 struct net_device *net_device_alloc(void) {
     struct net_device *dev; // net_deviceの情報を指すポインタ
 
@@ -70,6 +82,57 @@ int net_device_register(struct net_device *dev) {
     return 0;
 }
 
+// MTUの変更（ドライバが対応していれば実デバイスにも反映する）
+int net_device_set_mtu(struct net_device *dev, uint16_t mtu) {
+    if (dev->ops->set_mtu) {
+        if (dev->ops->set_mtu(dev, mtu) == -1) {
+            errorf("failure, dev=%s, mtu=%u", dev->name, mtu);
+            return -1;
+        }
+    } else if (mtu > dev->mtu) {
+        // 対応していないドライバは今より大きなMTUを扱えるとは限らない
+        errorf("not supported, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    dev->mtu = mtu;
+    infof("dev=%s, mtu=%u", dev->name, mtu);
+    return 0;
+}
+
+static unsigned int net_protocol_index(uint16_t type, unsigned int shift) {
+    return (type ^ (type >> shift)) & (NET_PROTOCOL_TABLE_SIZE - 1);
+}
+
+// 登録されている全てのプロトコルが別のスロットに入るシフト量を探して表を作り直す（完全ハッシュ）
+static int net_protocol_rehash(void) {
+    struct net_protocol *proto;
+    unsigned int shift, index;
+
+    for (shift = 1; shift < 16; shift++) {
+        memset(protocol_table, 0, sizeof(protocol_table));
+        for (proto = protocols; proto; proto = proto->next) {
+            index = net_protocol_index(proto->type, shift);
+            if (protocol_table[index])
+                break;
+            protocol_table[index] = proto;
+        }
+        if (!proto) {
+            protocol_shift = shift;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static struct net_protocol *net_protocol_lookup(uint16_t type) {
+    struct net_protocol *proto;
+
+    proto = protocol_table[net_protocol_index(type, protocol_shift)];
+    if (!proto || proto->type != type)
+        return NULL;
+    return proto;
+}
+
 /* NOTE: must not be call after net_run() */
 int net_protocol_register(uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev)) {
     struct net_protocol *proto;
@@ -97,10 +160,34 @@ int net_protocol_register(uint16_t type, void (*handler)(const uint8_t *data, si
     proto->next = protocols;
     protocols = proto;
 
+    // 受信時に1回の表引きで入力関数が決まるようにする
+    if (net_protocol_rehash() == -1) {
+        errorf("no perfect hash, type=0x%04x", type);
+        protocols = proto->next;
+        memory_free(proto);
+        net_protocol_rehash();
+        return -1;
+    }
+
     infof("registered, type=0x%04x", type);
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+// 入力関数に渡したデータはflushが戻るまで解放しないので、入力関数はデータを溜めておいてflushでまとめて処理できる
+int net_protocol_set_flush(uint16_t type, void (*flush)(void)) {
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->flush = flush;
+            return 0;
+        }
+    }
+    errorf("not found, type=0x%04x", type);
+    return -1;
+}
+
 static int net_device_open(struct net_device *dev) {
     // デバイスの状態を確認
     // デバイスの状態を確認（既にUP状態の場合はエラーを返す）
@@ -118,6 +205,15 @@ static int net_device_open(struct net_device *dev) {
             return -1;
         }
     }
+    // 送信キューイング規則が設定されていれば送信スレッドを起動する
+    if (dev->qdisc) {
+        if (qdisc_start(dev) == -1) {
+            errorf("qdisc_start() failure, dev=%s", dev->name);
+            if (dev->ops->close)
+                dev->ops->close(dev);
+            return -1;
+        }
+    }
     // UPフラグを立てる
     dev->flags |= NET_DEVICE_FLAG_UP;
     infof("dev=%s, state=%s", dev->name, NET_DEVICE_STATE(dev));
@@ -131,6 +227,10 @@ static int net_device_close(struct net_device *dev) {
         return -1;
     }
 
+    // ドライバを閉じる前に送信スレッドを止める
+    if (dev->qdisc)
+        qdisc_stop(dev);
+
     // デバイスドライバのクローズ関数を呼び出す
     // クローズ関数が設定されていない場合は呼び出しをスキップ
     // エラーが返されてたらこの関数もエラーを返す
@@ -148,25 +248,31 @@ static int net_device_close(struct net_device *dev) {
 }
 
 /* NOTE: must not be call after net_run() */
+// 同じ種別のインタフェースを複数登録できる（最初に登録したものがそのデバイスの代表になる）
 int net_device_add_iface(struct net_device *dev, struct net_iface *iface) {
-    struct net_iface *entry;
+    struct net_iface **p;
 
-    for (entry = dev->ifaces; entry; entry = entry->next) {
-        if (entry->family == iface->family) {
-            /* NOTE: For simplicity, only one iface can be added per family. */
-            errorf("already exists, dev=%s, family%d", dev->name, entry->family);
-            return -1;
-        }
-    }
     iface->dev = dev;
 
-    // デバイスのインタフェースリストの先頭にifaceを挿入
-    iface->next = dev->ifaces;
-    dev->ifaces = iface;
+    // デバイスのインタフェースリストの末尾にifaceを追加
+    for (p = &dev->ifaces; *p; p = &(*p)->next)
+        ;
+    iface->next = NULL;
+    *p = iface;
 
     return 0;
 }
 
+struct net_device *net_device_get_by_name(const char *name) {
+    struct net_device *dev;
+
+    for (dev = devices; dev; dev = dev->next) {
+        if (strncmp(dev->name, name, sizeof(dev->name)) == 0)
+            return dev;
+    }
+    return NULL;
+}
+
 struct net_iface *net_device_get_iface(struct net_device *dev, int family) {
     // デバイスに紐づくインタフェースを巡回
     // . familyが一致するインタフェースを返す
@@ -195,6 +301,12 @@ int net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data
 
     debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, len);
     debugdump(data, len);
+    if (dev->capture)
+        capture_packet(dev, CAPTURE_DIR_OUT, type, data, len);
+
+    // 送信キューイング規則が設定されていればキューに積んで送信スレッドに任せる
+    if (dev->qdisc)
+        return qdisc_enqueue(dev, type, data, len, dst);
 
     // デバイスドライバの出力関数を呼び出す（エラーが返されたらこの関数もエラーを返す）
     if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
@@ -204,6 +316,49 @@ int net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data
     return 0;
 }
 
+// 複数のデータをまとめて送信する（ドライバが対応していれば1回の呼び出しで渡す）
+// 送信できた数を返す（途中で失敗したら残りは送らない）
+int net_device_output_batch(struct net_device *dev, uint16_t type, const struct net_vec *vec, int num) {
+    int i, ret;
+
+    if (!NET_DEVICE_IS_UP(dev)) {
+        errorf("not opened dev=%s", dev->name);
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        if (vec[i].len > dev->mtu) {
+            errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, vec[i].len);
+            return -1;
+        }
+        debugf("dev=%s, type=0x%04x, len=%zu", dev->name, type, vec[i].len);
+        debugdump(vec[i].data, vec[i].len);
+        if (dev->capture)
+            capture_packet(dev, CAPTURE_DIR_OUT, type, vec[i].data, vec[i].len);
+    }
+
+    // 送信キューイング規則が設定されていればキューに積む（ドライバにまとめて渡すのは送信スレッド）
+    if (dev->qdisc) {
+        for (i = 0; i < num; i++) {
+            if (qdisc_enqueue(dev, type, vec[i].data, vec[i].len, vec[i].dst) == -1)
+                break;
+        }
+        return i;
+    }
+    if (!dev->ops->transmit_batch) {
+        for (i = 0; i < num; i++) {
+            if (dev->ops->transmit(dev, type, vec[i].data, vec[i].len, vec[i].dst) == -1) {
+                errorf("device transmit failure, dev=%s, len=%zu", dev->name, vec[i].len);
+                break;
+            }
+        }
+        return i;
+    }
+    ret = dev->ops->transmit_batch(dev, type, vec, num);
+    if (ret < num)
+        errorf("device transmit failure, dev=%s, num=%d, transmitted=%d", dev->name, num, ret);
+    return ret;
+}
+
 /* NOTE: must not be call after net_run() */
 int net_timer_register(struct timeval interval, void (*handler)(void)) {
     struct net_timer *timer;
@@ -256,54 +411,76 @@ int net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net
     struct net_protocol_queue_entry *entry;
 
     debugf("start...");
+    // ボンディングのメンバが受信したパケットはボンディングデバイスが受信したものとして扱う
+    if (dev->master)
+        dev = dev->master;
+    if (dev->capture)
+        capture_packet(dev, CAPTURE_DIR_IN, type, data, len);
+
+    // プロトコルのtypeが一致するものを表から引く
+    proto = net_protocol_lookup(type);
+    if (!proto) {
+        /* unsupported protocol */
+        return 0;
+    }
 
-    for (proto = protocols; proto; proto = proto->next) {
-        // プロトコルのtypeが一致
-        if (proto->type == type) {
-            // entryのメモリ確保
-            entry = memory_alloc(sizeof(*entry) + len);
-            if (!entry) {
-                errorf("memory_alloc() failure");
-                return -1;
-            }
-            
-            // 新しいエントリへメタデータの設定と受信データのコピー
-            entry->len = len;
-            entry->dev = dev;
-            memcpy(entry->data, data, len);
-
-            // エントリをキューへ格納
-            queue_push(&proto->queue, entry);
-            
-            debugf("queue pushed (num:%u), dev=%s, type=0x04x, len=%zu", proto->queue.num, dev->name, type, len);
-            debugdump(data, len);
+    // 受信キューを経由せずにその場でプロトコルの入力関数を呼び出す（割り込み処理のスレッドから呼び出すドライバのみ）
+    // NOTE: dataはプロトコルが書き換えてよいバッファで渡し（転送ではヘッダを書き換えて送る）、この関数から戻るまで保持すること
+    if (dev->flags & NET_DEVICE_FLAG_DIRECT_INPUT) {
+        proto->handler(data, len, dev);
+        if (proto->flush)
+            proto->flush();
+        return 0;
+    }
 
-            // プロトコルの受信キューへエントリを追加した後、
-            // ソフトウェア割り込みを発生させる
-            intr_raise_irq(INTR_IRQ_SOFTIRQ);
-            return 0;
-        }
+    // entryのメモリ確保
+    entry = memory_alloc(sizeof(*entry) + len);
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
     }
-    /* unsupported protocol */
+
+    // 新しいエントリへメタデータの設定と受信データのコピー
+    entry->len = len;
+    entry->dev = dev;
+    memcpy(entry->data, data, len);
+
+    // エントリをキューへ格納
+    queue_push(&proto->queue, entry);
+
+    debugf("queue pushed (num:%u), dev=%s, type=0x04x, len=%zu", proto->queue.num, dev->name, type, len);
+    debugdump(data, len);
+
+    // プロトコルの受信キューへエントリを追加した後、
+    // ソフトウェア割り込みを発生させる
+    intr_raise_irq(INTR_IRQ_SOFTIRQ);
     return 0;
 }
 
 // ソフトウェア割り込みが発生した際に呼び出してもらう関数
 int net_softirq_handler(void) {
     struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
+    struct net_protocol_queue_entry *entry, *batch[NET_SOFTIRQ_BATCH];
+    int num, i;
 
     // プロトコルリストを巡回（全てのプロトコルを確認）
     for (proto = protocols; proto; proto = proto->next) {
         while (1) {
             // 受信キューからエントリを取り出す（エントリが存在する間処理を繰り返す）
-            entry = queue_pop(&proto->queue);
-            if (!entry) break;
-            debugdump(entry->data, entry->len);
-
-            // プロトコルの入力関数を呼び出す
-            proto->handler(entry->data, entry->len, entry->dev);
-            memory_free(entry);
+            for (num = 0; num < NET_SOFTIRQ_BATCH; num++) {
+                entry = queue_pop(&proto->queue);
+                if (!entry) break;
+                debugdump(entry->data, entry->len);
+
+                // プロトコルの入力関数を呼び出す
+                proto->handler(entry->data, entry->len, entry->dev);
+                batch[num] = entry;
+            }
+            if (!num) break;
+            if (proto->flush)
+                proto->flush();
+            for (i = 0; i < num; i++)
+                memory_free(batch[i]);
         }
     }
     return 0;
@@ -354,6 +531,12 @@ int net_run(void) {
     for (dev = devices; dev; dev = dev->next) {
         net_device_open(dev);
     }
+
+    // 周りのノードのARPキャッシュを更新してもらう（再起動でアドレスが変わった場合など）
+    for (dev = devices; dev; dev = dev->next) {
+        if (NET_DEVICE_IS_UP(dev) && (dev->flags & NET_DEVICE_FLAG_NEED_ARP))
+            arp_announce(dev);
+    }
     
     debugf("running ...");
     return 0;
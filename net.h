@@ -12,12 +12,14 @@
 #define NET_DEVICE_TYPE_DUMMY     0x0000
 #define NET_DEVICE_TYPE_LOOPBACK  0x0001
 #define NET_DEVICE_TYPE_ETHERNET  0x0002
+#define NET_DEVICE_TYPE_NETEM     0x0003
 
 #define NET_DEVICE_FLAG_UP        0x0001
 #define NET_DEVICE_FLAG_LOOPBACK  0x0010
 #define NET_DEVICE_FLAG_BROADCAST 0x0020
 #define NET_DEVICE_FLAG_P2P       0x0040
 #define NET_DEVICE_FLAG_NEED_ARP  0x0100
+#define NET_DEVICE_FLAG_DIRECT_INPUT 0x0200 /* deliver received data to the protocol without queuing (see net_input_handler) */
 
 #define NET_DEVICE_ADDR_LEN 16
 
@@ -53,6 +55,9 @@ struct net_device {
     };
     struct net_device_ops *ops;
     void *priv;
+    struct capture *capture; /* NULL: capture disabled (see capture.h) */
+    struct qdisc *qdisc; /* NULL: transmit synchronously (see qdisc.h) */
+    struct net_device *master; /* NULL: not enslaved (see driver/bond.h) */
 };
 
 
@@ -65,20 +70,33 @@ struct net_iface {
     /* depends on implementation of protocols. */
 };
 
+// まとめて送信するデータの1つ分（net_device_output_batch()）
+struct net_vec {
+    const uint8_t *data;
+    size_t len;
+    const void *dst;
+};
+
 struct net_device_ops {
     int (*open)(struct net_device *dev);
     int (*close)(struct net_device *dev);
     int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+    int (*transmit_batch)(struct net_device *dev, uint16_t type, const struct net_vec *vec, int num); /* optional: returns the number of transmitted packets */
+    int (*set_mtu)(struct net_device *dev, uint16_t mtu); /* optional: validate and apply to the underlying device */
 };
 
 extern struct net_device *net_device_alloc(void);
 extern int net_device_register(struct net_device *dev);
+extern int net_device_set_mtu(struct net_device *dev, uint16_t mtu);
 
 extern int net_device_add_iface(struct net_device *dev, struct net_iface *iface);
+extern struct net_device *net_device_get_by_name(const char *name);
 extern struct net_iface *net_device_get_iface(struct net_device *dev, int family);
 
 extern int net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+extern int net_device_output_batch(struct net_device *dev, uint16_t type, const struct net_vec *vec, int num);
 extern int net_protocol_register(uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+extern int net_protocol_set_flush(uint16_t type, void (*flush)(void));
 
 extern int net_timer_register(struct timeval timeval, void (*handler)(void));
 extern int net_timer_handler(void);
@@ -68,6 +68,11 @@ int intr_raise_irq(unsigned int irq) {
     return pthread_kill(tid, (int)irq);
 }
 
+// 呼び出し元が割り込み処理スレッドかどうか（割り込みハンドラの中から自分自身を待たないようにするため）
+int intr_in_interrupt(void) {
+    return pthread_equal(tid, pthread_self()) != 0;
+}
+
 // タイマーのための周期処理
 static int intr_timer_setup(struct itimerspec *interval) {
     timer_t id;
@@ -22,6 +22,7 @@
 
 extern int intr_request_irq(unsigned int irq, int (*handler) (unsigned int irq, void *id), int flags, const char *name, void *dev);
 extern int intr_raise_irq(unsigned int irq);
+extern int intr_in_interrupt(void);
 
 extern int intr_run(void);
 extern void intr_shutdown(void);
@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "qdisc.h"
+
+/*
+ * 送信キューイング規則（qdisc）
+ * net_device_output() はキューに積むだけで、デバイスごとの送信スレッドがドライバの transmit を呼び出す
+ *   pfifo    : 単一のFIFO（上限を超えたら末尾をドロップ）
+ *   fq_codel : フローごとのキューをDRRで巡回し、各キューの滞留時間をCoDelで制御する（RFC 8290）
+ */
+
+#define QDISC_FQ_FLOWS 1024
+#define QDISC_CODEL_TARGET   5000   /* micro seconds */
+#define QDISC_CODEL_INTERVAL 100000 /* micro seconds */
+
+struct qdisc_packet {
+    struct qdisc_packet *next;
+    uint64_t tstamp; /* enqueue time */
+    uint16_t type;
+    int has_dst;
+    uint8_t dst[NET_DEVICE_ADDR_LEN];
+    size_t len;
+    uint8_t data[];
+};
+
+struct qdisc_flow {
+    struct qdisc_flow *next; /* new_flows or old_flows */
+    int listed;
+    struct qdisc_packet *head;
+    struct qdisc_packet *tail;
+    unsigned int qlen;
+    size_t backlog; /* bytes */
+    int deficit;
+    /* CoDel */
+    uint64_t first_above_time;
+    uint64_t drop_next;
+    unsigned int count;
+    unsigned int lastcount;
+    int dropping;
+};
+
+struct qdisc_flow_list {
+    struct qdisc_flow *head;
+    struct qdisc_flow *tail;
+};
+
+struct qdisc {
+    int kind;
+    unsigned int limit;
+    unsigned int qlen;
+    int quantum;
+    uint32_t perturb; // ハッシュの偏りを外部から狙われないための乱数
+    struct qdisc_flow *flows;
+    unsigned int nflows;
+    struct qdisc_flow_list new_flows;
+    struct qdisc_flow_list old_flows;
+    mutex_t mutex;
+    struct sched_ctx ctx;
+    pthread_t thread;
+    int running;
+    struct qdisc_stats stats;
+};
+
+static uint64_t qdisc_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t qdisc_isqrt(uint32_t x) {
+    uint32_t r = 0, bit = 1u << 30;
+
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+/*
+ * Flow list
+ */
+
+static void qdisc_flow_list_add(struct qdisc_flow_list *list, struct qdisc_flow *flow) {
+    flow->next = NULL;
+    if (list->tail)
+        list->tail->next = flow;
+    else
+        list->head = flow;
+    list->tail = flow;
+}
+
+static struct qdisc_flow *qdisc_flow_list_pop(struct qdisc_flow_list *list) {
+    struct qdisc_flow *flow;
+
+    flow = list->head;
+    if (flow) {
+        list->head = flow->next;
+        if (!list->head)
+            list->tail = NULL;
+        flow->next = NULL;
+    }
+    return flow;
+}
+
+/*
+ * Flow queue
+ * NOTE: must be called after mutex locked
+ */
+
+static void qdisc_flow_push(struct qdisc *q, struct qdisc_flow *flow, struct qdisc_packet *pkt) {
+    pkt->next = NULL;
+    if (flow->tail)
+        flow->tail->next = pkt;
+    else
+        flow->head = pkt;
+    flow->tail = pkt;
+    flow->qlen++;
+    flow->backlog += pkt->len;
+    q->qlen++;
+}
+
+static struct qdisc_packet *qdisc_flow_pop(struct qdisc *q, struct qdisc_flow *flow) {
+    struct qdisc_packet *pkt;
+
+    pkt = flow->head;
+    if (pkt) {
+        flow->head = pkt->next;
+        if (!flow->head)
+            flow->tail = NULL;
+        flow->qlen--;
+        flow->backlog -= pkt->len;
+        q->qlen--;
+    }
+    return pkt;
+}
+
+// 5タプルでフローを分類する（IP以外のプロトコルはプロトコル種別ごとに1つのフロー）
+static unsigned int qdisc_classify(struct qdisc *q, uint16_t type, const uint8_t *data, size_t len) {
+    if (q->nflows == 1)
+        return 0;
+    if (type != NET_PROTOCOL_TYPE_IP)
+        return hash32_3words(type, 0, 0, q->perturb) % q->nflows;
+    return ip_flow_hash(data, len, q->perturb) % q->nflows;
+}
+
+/*
+ * CoDel (RFC 8289)
+ * NOTE: must be called after mutex locked
+ */
+
+static void qdisc_drop(struct qdisc *q, struct qdisc_packet *pkt) {
+    memory_free(pkt);
+}
+
+static uint64_t qdisc_codel_control_law(uint64_t t, unsigned int count) {
+    return t + QDISC_CODEL_INTERVAL / qdisc_isqrt(count ? count : 1);
+}
+
+static int qdisc_codel_should_drop(struct qdisc *q, struct qdisc_flow *flow, struct qdisc_packet *pkt, uint64_t now) {
+    if (!pkt) {
+        flow->first_above_time = 0;
+        return 0;
+    }
+    // 滞留時間が目標値を下回っているか、キューに1パケット分しか残っていなければ問題ない
+    if (now - pkt->tstamp < QDISC_CODEL_TARGET || flow->backlog <= (size_t)q->quantum) {
+        flow->first_above_time = 0;
+        return 0;
+    }
+    if (!flow->first_above_time) {
+        flow->first_above_time = now + QDISC_CODEL_INTERVAL;
+        return 0;
+    }
+    return now >= flow->first_above_time;
+}
+
+static struct qdisc_packet *qdisc_codel_dequeue(struct qdisc *q, struct qdisc_flow *flow) {
+    struct qdisc_packet *pkt;
+    uint64_t now;
+    int drop;
+
+    now = qdisc_now();
+    pkt = qdisc_flow_pop(q, flow);
+    drop = qdisc_codel_should_drop(q, flow, pkt, now);
+    if (flow->dropping) {
+        if (!drop) {
+            flow->dropping = 0;
+        } else {
+            // ドロップ状態の間は制御則に従って間隔を詰めながらドロップする
+            while (flow->dropping && now >= flow->drop_next) {
+                qdisc_drop(q, pkt);
+                q->stats.codel_dropped++;
+                flow->count++;
+                pkt = qdisc_flow_pop(q, flow);
+                if (!qdisc_codel_should_drop(q, flow, pkt, now))
+                    flow->dropping = 0;
+                else
+                    flow->drop_next = qdisc_codel_control_law(flow->drop_next, flow->count);
+            }
+        }
+    } else if (drop) {
+        qdisc_drop(q, pkt);
+        q->stats.codel_dropped++;
+        pkt = qdisc_flow_pop(q, flow);
+        flow->dropping = 1;
+        // 直前のドロップ状態から間もなければカウントを引き継ぐ
+        if (flow->count > flow->lastcount + 1 && now - flow->drop_next < 16 * QDISC_CODEL_INTERVAL)
+            flow->count = flow->count - flow->lastcount;
+        else
+            flow->count = 1;
+        flow->lastcount = flow->count;
+        flow->drop_next = qdisc_codel_control_law(now, flow->count);
+    }
+    return pkt;
+}
+
+/*
+ * Scheduler
+ * NOTE: must be called after mutex locked
+ */
+
+static struct qdisc_packet *qdisc_dequeue(struct qdisc *q) {
+    struct qdisc_flow_list *list;
+    struct qdisc_flow *flow;
+    struct qdisc_packet *pkt;
+
+    if (q->kind == QDISC_KIND_PFIFO)
+        return qdisc_flow_pop(q, &q->flows[0]);
+    while (1) {
+        // 新しいフローを優先する（少量しか送らないフローの遅延を小さくする）
+        list = q->new_flows.head ? &q->new_flows : &q->old_flows;
+        flow = list->head;
+        if (!flow)
+            return NULL;
+        if (flow->deficit <= 0) {
+            flow->deficit += q->quantum;
+            qdisc_flow_list_pop(list);
+            qdisc_flow_list_add(&q->old_flows, flow);
+            continue;
+        }
+        pkt = qdisc_codel_dequeue(q, flow);
+        if (!pkt) {
+            qdisc_flow_list_pop(list);
+            // 空になった新しいフローは一巡するまで古いフローとして扱う（優先され続けないように）
+            if (list == &q->new_flows && q->old_flows.head)
+                qdisc_flow_list_add(&q->old_flows, flow);
+            else
+                flow->listed = 0;
+            continue;
+        }
+        flow->deficit -= pkt->len;
+        return pkt;
+    }
+}
+
+// 上限を超えたら最もバイト数の多いフローの先頭を捨てる
+static void qdisc_overlimit(struct qdisc *q) {
+    struct qdisc_flow *flow, *fat = NULL;
+    unsigned int i;
+
+    for (i = 0; i < q->nflows; i++) {
+        flow = &q->flows[i];
+        if (!fat || flow->backlog > fat->backlog)
+            fat = flow;
+    }
+    qdisc_drop(q, qdisc_flow_pop(q, fat));
+    q->stats.dropped++;
+}
+
+static void *qdisc_thread(void *arg) {
+    struct net_device *dev;
+    struct qdisc *q;
+    struct qdisc_packet *pkt;
+    int ret;
+
+    dev = (struct net_device *)arg;
+    q = dev->qdisc;
+    mutex_lock(&q->mutex);
+    while (q->running) {
+        pkt = qdisc_dequeue(q);
+        if (!pkt) {
+            sched_sleep(&q->ctx, &q->mutex, NULL);
+            continue;
+        }
+        q->stats.dequeued++;
+        // ドライバの送信はロックを保持せずに行う（送信中もキューイングは止まらない）
+        mutex_unlock(&q->mutex);
+        ret = dev->ops->transmit(dev, pkt->type, pkt->data, pkt->len, pkt->has_dst ? pkt->dst : NULL);
+        if (ret == -1)
+            errorf("device transmit failure, dev=%s, len=%zu", dev->name, pkt->len);
+        memory_free(pkt);
+        mutex_lock(&q->mutex);
+        if (ret == -1)
+            q->stats.tx_errors++;
+    }
+    mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+int qdisc_enqueue(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst) {
+    struct qdisc *q;
+    struct qdisc_packet *pkt;
+    struct qdisc_flow *flow;
+
+    q = dev->qdisc;
+    pkt = memory_alloc(sizeof(*pkt) + len);
+    if (!pkt) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    pkt->type = type;
+    if (dst) {
+        memcpy(pkt->dst, dst, dev->alen);
+        pkt->has_dst = 1;
+    }
+    pkt->len = len;
+    memcpy(pkt->data, data, len);
+    pkt->tstamp = qdisc_now();
+
+    mutex_lock(&q->mutex);
+    if (!q->running) {
+        mutex_unlock(&q->mutex);
+        memory_free(pkt);
+        errorf("not running, dev=%s", dev->name);
+        return -1;
+    }
+    if (q->kind == QDISC_KIND_PFIFO && q->qlen >= q->limit) {
+        q->stats.dropped++;
+        mutex_unlock(&q->mutex);
+        memory_free(pkt);
+        return -1;
+    }
+    flow = &q->flows[qdisc_classify(q, type, data, len)];
+    qdisc_flow_push(q, flow, pkt);
+    q->stats.enqueued++;
+    if (q->kind == QDISC_KIND_FQ_CODEL) {
+        if (!flow->listed) {
+            flow->listed = 1;
+            flow->deficit = q->quantum;
+            qdisc_flow_list_add(&q->new_flows, flow);
+        }
+        if (q->qlen > q->limit)
+            qdisc_overlimit(q);
+    }
+    sched_wakeup(&q->ctx);
+    mutex_unlock(&q->mutex);
+    return 0;
+}
+
+int qdisc_start(struct net_device *dev) {
+    struct qdisc *q;
+    int err;
+
+    q = dev->qdisc;
+    q->quantum = dev->mtu + dev->hlen;
+    sched_ctx_init(&q->ctx);
+    q->running = 1;
+    err = pthread_create(&q->thread, NULL, qdisc_thread, dev);
+    if (err) {
+        errorf("pthread_create() failure, err=%d", err);
+        q->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void qdisc_stop(struct net_device *dev) {
+    struct qdisc *q;
+    struct qdisc_packet *pkt;
+    unsigned int i;
+
+    q = dev->qdisc;
+    mutex_lock(&q->mutex);
+    if (!q->running) {
+        mutex_unlock(&q->mutex);
+        return;
+    }
+    q->running = 0;
+    sched_interrupt(&q->ctx);
+    mutex_unlock(&q->mutex);
+    pthread_join(q->thread, NULL);
+    // 送信されずに残ったパケットは破棄する
+    for (i = 0; i < q->nflows; i++) {
+        while ((pkt = qdisc_flow_pop(q, &q->flows[i])))
+            qdisc_drop(q, pkt);
+        q->flows[i].listed = 0;
+    }
+    q->new_flows.head = q->new_flows.tail = NULL;
+    q->old_flows.head = q->old_flows.tail = NULL;
+}
+
+int qdisc_get_stats(struct net_device *dev, struct qdisc_stats *stats) {
+    struct qdisc *q;
+    unsigned int i;
+
+    q = dev->qdisc;
+    if (!q) {
+        errorf("no qdisc, dev=%s", dev->name);
+        return -1;
+    }
+    mutex_lock(&q->mutex);
+    *stats = q->stats;
+    stats->backlog = q->qlen;
+    stats->flows = 0;
+    for (i = 0; i < q->nflows; i++) {
+        if (q->flows[i].qlen)
+            stats->flows++;
+    }
+    mutex_unlock(&q->mutex);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int qdisc_attach(struct net_device *dev, int kind, unsigned int limit) {
+    struct qdisc *q;
+
+    if (dev->qdisc) {
+        errorf("already attached, dev=%s", dev->name);
+        return -1;
+    }
+    if (kind != QDISC_KIND_PFIFO && kind != QDISC_KIND_FQ_CODEL) {
+        errorf("unknown kind, kind=%d", kind);
+        return -1;
+    }
+    q = memory_alloc(sizeof(*q));
+    if (!q) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    q->kind = kind;
+    q->limit = limit ? limit : QDISC_LIMIT_DEFAULT;
+    q->nflows = kind == QDISC_KIND_FQ_CODEL ? QDISC_FQ_FLOWS : 1;
+    q->flows = memory_alloc(sizeof(*q->flows) * q->nflows);
+    if (!q->flows) {
+        errorf("memory_alloc() failure");
+        memory_free(q);
+        return -1;
+    }
+    q->perturb = random();
+    mutex_init(&q->mutex);
+    dev->qdisc = q;
+    infof("dev=%s, kind=%s, limit=%u", dev->name, kind == QDISC_KIND_FQ_CODEL ? "fq_codel" : "pfifo", q->limit);
+    return 0;
+}
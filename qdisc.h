@@ -0,0 +1,33 @@
+#ifndef QDISC_H
+#define QDISC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+#define QDISC_KIND_PFIFO    1
+#define QDISC_KIND_FQ_CODEL 2
+
+#define QDISC_LIMIT_DEFAULT 1024 /* packets */
+
+struct qdisc_stats {
+    unsigned long enqueued;
+    unsigned long dequeued;
+    unsigned long dropped;     /* over limit */
+    unsigned long codel_dropped; /* sojourn time above target */
+    unsigned long tx_errors;
+    unsigned int backlog;      /* packets */
+    unsigned int flows;        /* active flows */
+};
+
+/* NOTE: must not be call after net_run() */
+extern int qdisc_attach(struct net_device *dev, int kind, unsigned int limit);
+extern int qdisc_get_stats(struct net_device *dev, struct qdisc_stats *stats);
+
+/* NOTE: called from net_device_open()/net_device_close()/net_device_output() only when dev->qdisc is set */
+extern int qdisc_start(struct net_device *dev);
+extern void qdisc_stop(struct net_device *dev);
+extern int qdisc_enqueue(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+
+#endif
@@ -43,6 +43,15 @@
 #define TCP_USER_TIMEOUT_TIME 30 /* seconds */
 #define TCP_MSL 120 /* seconds */
 
+#define TCP_DEFAULT_MSS 536 /* RFC 879 */
+#define TCP_SEND_BATCH 32 // tcp_send()でまとめて送るセグメントの数
+
+// TCPオプションの種別
+#define TCP_OPT_EOL 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_MSS_LEN 4
+
 // 疑似ヘッダの構造体（チェックサム計算時に使用する）
 struct pseudo_hdr {
     uint32_t src;
@@ -72,6 +81,7 @@ struct tcp_segment_info {
     uint16_t len;
     uint16_t wnd;
     uint16_t up;
+    uint16_t mss; // MSSオプションの値（オプションがなければ0）
 };
 
 // コントロールブロックの構造体
@@ -104,6 +114,7 @@ struct tcp_pcb {
     // uint8_t buf[65535]; /* receive buffer */
     uint8_t buf[16]; /* receive buffer */
     struct sched_ctx ctx;
+    struct ip_dst dst; // 宛先キャッシュ（経路とARPを毎回引かない）
     // PCB構造体のメンバに受信キューが追加
     struct queue_head queue; /* retransmit queue */
 };
@@ -112,10 +123,10 @@ struct tcp_queue_entry {
     struct timeval first; // 初回送信時刻
     struct timeval last;  // 最終送信時刻
     unsigned int rto; /* micro seconds 再送タイムアウト（前回の再送時刻からこの時間が経過したら再送を実施） */
-    uint32_t seq; // セグメントのシーケンス番号（その他の情報は再送を実施するタイミングでPCBから値を取得）
-    uint8_t flg; // セグメントの制御フラグ（その他の情報は再送を実施するタイミングでPCBから値を取得）
+    uint32_t seq; // セグメントのシーケンス番号
+    uint8_t flg; // セグメントの制御フラグ
     size_t len;
-    uint8_t data[];
+    uint8_t data[]; // 送信したセグメント（再送時にACKとウィンドウだけPCBの値に書き換える）
 };
 
 static mutex_t mutex = MUTEX_INITIALIZER;
@@ -169,6 +180,8 @@ static struct tcp_pcb *tcp_pcb_alloc(void) {
             // CLOSED状態に初期化する
             pcb->state = TCP_PCB_STATE_CLOSED;
             sched_ctx_init(&pcb->ctx);
+            // 経路の途中でフラグメント化させずにPath MTU Discoveryを行う
+            pcb->dst.df = 1;
             return pcb;
         }
     }
@@ -235,45 +248,98 @@ static int tcp_pcb_id(struct tcp_pcb *pcb) {
     return indexof(pcbs, pcb);
 }
 
-// TCPセグメントの送信
-static ssize_t tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign) {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
+// 経路上のデバイスのMTUから自分が受信できるMSSを求める
+static uint16_t tcp_local_mss(ip_addr_t dst) {
+    struct ip_iface *iface;
+
+    iface = ip_route_get_iface(dst);
+    if (!iface)
+        return TCP_DEFAULT_MSS;
+    return NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+}
+
+// 宛先までの経路のMTU（Path MTU）から送信するセグメントの最大長を求める
+static uint16_t tcp_path_mss(ip_addr_t dst) {
+    uint16_t mtu;
+
+    mtu = ip_pmtu_get(dst);
+    if (!mtu)
+        return TCP_DEFAULT_MSS;
+    return mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+}
+
+// TCPセグメントの生成（bufにチェックサムまで書き込んでセグメントの長さを返す）
+static uint16_t tcp_segment_build(uint8_t *buf, uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign) {
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
     uint16_t psum;
-    uint16_t total;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
+    uint16_t hlen, total, mss;
+    uint8_t *opt;
 
     hdr = (struct tcp_hdr *)buf;
+    hlen = sizeof(*hdr);
+
+    // SYNセグメントにはMSSオプションを付けて受信できるセグメントの大きさを相手に伝える
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        mss = tcp_local_mss(foreign->addr);
+        opt = (uint8_t *)(hdr + 1);
+        opt[0] = TCP_OPT_MSS;
+        opt[1] = TCP_OPT_MSS_LEN;
+        opt[2] = mss >> 8;
+        opt[3] = mss & 0xff;
+        hlen += TCP_OPT_MSS_LEN;
+    }
 
     // TCPセグメントの生成
     hdr->src = local->port;
     hdr->dst = foreign->port;
     hdr->seq = hton32(seq);
     hdr->ack = hton32(ack);
-    hdr->off = (sizeof(*hdr) >> 2) << 4; // 32bitを単位としたdataのoffset
+    hdr->off = (hlen >> 2) << 4; // 32bitを単位としたdataのoffset
     hdr->flg = flg;
     hdr->wnd = hton16(wnd);
     hdr->sum = 0;
     hdr->up = 0;
-    memcpy(hdr + 1, data, len);
+    memcpy(buf + hlen, data, len);
     pseudo.src = local->addr;
     pseudo.dst = foreign->addr;
     pseudo.zero = 0;
     pseudo.protocol = IP_PROTOCOL_TCP;
-    total = sizeof(*hdr) + len;
+    total = hlen + len;
     pseudo.len = hton16(total);
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
     hdr->sum = cksum16((uint16_t *)hdr, total, psum);
-    debugf("%s => %s, len=%zu (payload=%z)",
+    return total;
+}
+
+// 生成済みのTCPセグメントの送信
+// NOTE: dstはPCBの宛先キャッシュ（PCBを持たないRSTなどはNULL）
+static int tcp_segment_send(uint8_t *seg, uint16_t total, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst *dst) {
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+
+    debugf("%s => %s, len=%u",
         ip_endpoint_ntop(local, ep1, sizeof(ep1)),
         ip_endpoint_ntop(foreign, ep2, sizeof(ep2)),
-        total, len);
-    tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
+        total);
+    tcp_dump(seg, total);
+    if (dst) {
+        if (ip_output_dst(dst, IP_PROTOCOL_TCP, seg, total, local->addr, foreign->addr) == -1)
+            return -1;
+    } else if (ip_output(IP_PROTOCOL_TCP, seg, total, local->addr, foreign->addr) == -1) {
         return -1;
     }
+    return 0;
+}
+
+// TCPセグメントの送信
+static ssize_t tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst *dst) {
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
+    uint16_t total;
+
+    total = tcp_segment_build(buf, seq, ack, flg, wnd, data, len, local, foreign);
+    if (tcp_segment_send(buf, total, local, foreign, dst) == -1)
+        return -1;
     return len;
 }
 
@@ -282,21 +348,22 @@ static ssize_t tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint1
 * NOTE: TCP Retransmit functions must be called after mutex locked
 */
 
-static int tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len) {
+// 格納したエントリを返す（エントリのセグメントはそのまま送信に使える）
+static struct tcp_queue_entry *tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *seg, size_t len) {
     struct tcp_queue_entry *entry;
 
     entry = memory_alloc(sizeof(*entry) + len);
     if (!entry) {
         errorf("memory_alloc() failure");
-        return -1;
+        return NULL;
     }
     entry->rto = TCP_DEFAULT_RTO; // 再送タイムアウトにデフォルト値を設定
     // セグメントのシーケンス番号と制御フラグをコピー
     entry->seq = seq;
     entry->flg = flg;
-    // TCPセグメントのデータ部分をコピー（制御フラグのみでデータがない場合は0バイトのコピー）
+    // 生成済みのTCPセグメントをヘッダごとコピー
     entry->len = len;
-    memcpy(entry->data, data, entry->len);
+    memcpy(entry->data, seg, entry->len);
     // 最終送信時刻にも同じ値を得れておく（0回目の再送時刻）
     gettimeofday(&entry->first, NULL);
     entry->last = entry->first;
@@ -304,9 +371,9 @@ static int tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t f
     if (!queue_push(&pcb->queue, entry)) {
         errorf("queue_push() failure");
         memory_free(entry);
-        return -1;
+        return NULL;
     }
-    return 0;
+    return entry;
 }
 
 static void tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb) {
@@ -333,6 +400,9 @@ static void tcp_retransmit_queue_emit(void *arg, void *data) {
     struct tcp_pcb *pcb;
     struct tcp_queue_entry *entry;
     struct timeval now, diff, timeout;
+    struct tcp_hdr *hdr;
+    uint32_t ack;
+    uint16_t wnd;
 
     pcb = (struct tcp_pcb *)arg;
     entry = (struct tcp_queue_entry *)data;
@@ -350,7 +420,15 @@ static void tcp_retransmit_queue_emit(void *arg, void *data) {
     timeval_add_usec(&timeout, entry->rto);
     // 再送予定時刻を過ぎていたらTCPセグメントを再送する
     if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, entry->data, entry->len, &pcb->local, &pcb->foreign);
+        // ACKとウィンドウを最新の値に書き換える（チェックサムは差分だけ更新するので、データの長さによらない）
+        hdr = (struct tcp_hdr *)entry->data;
+        ack = hton32(pcb->rcv.nxt);
+        wnd = hton16(pcb->rcv.wnd);
+        hdr->sum = cksum16_adjust32(hdr->sum, hdr->ack, ack);
+        hdr->ack = ack;
+        hdr->sum = cksum16_adjust(hdr->sum, hdr->wnd, wnd);
+        hdr->wnd = wnd;
+        tcp_segment_send(entry->data, entry->len, &pcb->local, &pcb->foreign, &pcb->dst);
         // 最終送信時刻を更新
         entry->last = now;
         // 再送タイムアウト（次の再送までの時間）を2倍の値で設定
@@ -362,21 +440,109 @@ static void tcp_retransmit_queue_emit_all(struct tcp_pcb *pcb) {
     queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
 }
 
+// MSSを超えるセグメントを分け直してすぐに送る（Path MTUが小さくなった時, 元のセグメントは経路の途中で捨てられている）
+static void tcp_retransmit_queue_resegment(struct tcp_pcb *pcb, uint16_t mss) {
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    struct tcp_queue_entry *entry;
+    struct tcp_hdr *hdr;
+    unsigned int num;
+    uint16_t hlen, total;
+    size_t plen, off, slen;
+    uint8_t flg;
+
+    // 先頭から順に取り出して末尾に戻す（順序は変わらない）
+    for (num = pcb->queue.num; num; num--) {
+        entry = queue_pop(&pcb->queue);
+        hdr = (struct tcp_hdr *)entry->data;
+        hlen = (hdr->off >> 4) << 2;
+        plen = entry->len - hlen;
+        if (plen <= mss) {
+            queue_push(&pcb->queue, entry);
+            continue;
+        }
+        for (off = 0; off < plen; off += slen) {
+            slen = MIN(mss, plen - off);
+            // FINとPSHは最後のセグメントだけに付ける
+            flg = entry->flg;
+            if (off + slen < plen)
+                flg &= ~(TCP_FLG_FIN | TCP_FLG_PSH);
+            total = tcp_segment_build(buf, entry->seq + off, pcb->rcv.nxt, flg, pcb->rcv.wnd, entry->data + hlen + off, slen, &pcb->local, &pcb->foreign);
+            tcp_retransmit_queue_add(pcb, entry->seq + off, flg, buf, total);
+            tcp_segment_send(buf, total, &pcb->local, &pcb->foreign, &pcb->dst);
+        }
+        debugf("resegmented, seq=%u, len=%zu, mss=%u", entry->seq, plen, mss);
+        memory_free(entry);
+    }
+}
+
 // TCPの送信関数
 static ssize_t tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len) {
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
     uint32_t seq;
+    uint16_t total;
 
     seq = pcb->snd.nxt;
     // SYNフラグが指定されるのは初回送信時なのでiss（初期送信シーケンス番号）を使う
     if (TCP_FLG_ISSET(flg, TCP_FLG_SYN))
         seq = pcb->iss;
-    // シーケンス番号を消費するセグメントだけ再送キューへ格納する
+    // PCBの情報を使ってTCPセグメントを生成
+    total = tcp_segment_build(buf, seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    // シーケンス番号を消費するセグメントだけ再送キューへ格納する（再送時は生成済みのセグメントを使う）
     // （単純なACKセグメントやRSTセグメントは対象外）
     if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
-        tcp_retransmit_queue_add(pcb, seq, flg, data, len);
+        tcp_retransmit_queue_add(pcb, seq, flg, buf, total);
+    }
+    if (tcp_segment_send(buf, total, &pcb->local, &pcb->foreign, &pcb->dst) == -1)
+        return -1;
+    return len;
+}
+
+// まとめておいたセグメントをip_output_batch()で送信する
+static int tcp_output_flush(struct tcp_pcb *pcb, struct net_vec *vec, int *num) {
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+    int i, n;
+
+    n = *num;
+    *num = 0;
+    if (!n)
+        return 0;
+    for (i = 0; i < n; i++) {
+        debugf("%s => %s, len=%zu",
+            ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)),
+            ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)),
+            vec[i].len);
+        tcp_dump(vec[i].data, vec[i].len);
+    }
+    // NOTE: 送れなかったセグメントも再送キューに残っているので、再送で回復する
+    if (ip_output_batch(&pcb->dst, IP_PROTOCOL_TCP, vec, n, pcb->local.addr, pcb->foreign.addr) == -1)
+        return -1;
+    return 0;
+}
+
+// tcp_output()と同じだが、すぐに送らずに再送キューのセグメントをvecにまとめる（いっぱいになったら送信する）
+static ssize_t tcp_output_queue(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len, struct net_vec *vec, int *num) {
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    struct tcp_queue_entry *entry;
+    uint16_t total;
+
+    total = tcp_segment_build(buf, pcb->snd.nxt, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    entry = tcp_retransmit_queue_add(pcb, pcb->snd.nxt, flg, buf, total);
+    if (!entry) {
+        // 再送キューに入れられなかった場合は順序を保つために溜めた分を送ってから直接送る
+        if (tcp_output_flush(pcb, vec, num) == -1)
+            return -1;
+        if (tcp_segment_send(buf, total, &pcb->local, &pcb->foreign, &pcb->dst) == -1)
+            return -1;
+        return len;
     }
-    // PCBの情報を使ってTCPセグメントを送信
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    vec[*num].data = entry->data;
+    vec[*num].len = entry->len;
+    vec[*num].dst = NULL;
+    (*num)++;
+    if (*num == TCP_SEND_BATCH && tcp_output_flush(pcb, vec, num) == -1)
+        return -1;
+    return len;
 }
 
 /* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
@@ -391,9 +557,9 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
             return;
         // 使用していないポートに何か飛んで来たらRSTを返す
         if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK))
-            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
+            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign, NULL);
         else 
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
         return;
     }
     
@@ -404,7 +570,7 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
                 return;
             /* 2nd check for an ACK */
             if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
                 return;
             }
             /* 3rd check for an SYN */
@@ -419,6 +585,7 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
                 pcb->rcv.wnd = sizeof(pcb->buf); // 受信ウィンドウのサイズを設定
                 pcb->rcv.nxt = seg->seq + 1; // 次に受信を期待するシーケンス番号（ACKで使われる）
                 pcb->irs = seg->seq; // 初期受信シーケンス番号の保存
+                pcb->mss = MIN(tcp_local_mss(foreign->addr), seg->mss ? seg->mss : TCP_DEFAULT_MSS); // 送信するセグメントの最大長
                 pcb->iss = random(); // 初期送信シーケンス番号の採番
                 tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
                 pcb->snd.nxt = pcb->iss + 1; // 次に送信するシーケンス番号
@@ -441,7 +608,7 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
             if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
                 // 送信していないシーケンス番号に対するACKだったらRSTを返す
                 if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
-                    tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+                    tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
                     return;
                 }
                 // まだACKの応答が得られていないシーケンス番号に対するものだったら受け入れる
@@ -466,6 +633,8 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
                 pcb->rcv.nxt = seg->seq + 1;
                 // 相手の初期シーケンス番号を保存する
                 pcb->irs = seg->seq;
+                // 送信するセグメントの最大長を決める（相手がMSSオプションを付けていなければデフォルト値）
+                pcb->mss = MIN(tcp_local_mss(pcb->foreign.addr), seg->mss ? seg->mss : TCP_DEFAULT_MSS);
 
                 // ACKを受け入れた際の処理
                 // ・未確認のシーケンス番号を更新（ACKの値は「次に受信すべきシーケンス番号」を示すのでACKの値と同一のシーケンス番号の確認は取れていない）
@@ -473,6 +642,8 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
                 if (acceptable) {
                     pcb->snd.una = seg->ack; // seg->ack: サーバ側のpcb->rcv.nxt
                     tcp_retransmit_queue_cleanup(pcb);
+                    // 相手に届いていることが分かったので次の中継先の到達性の確認にする
+                    ip_confirm_neighbor(&pcb->dst);
                 }
                 if (pcb->snd.una > pcb->iss) {
                     // ESTABLISHED状態へ移行
@@ -614,7 +785,7 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
             } else {
                 // if the segment acknowledgement is not acceptable, form a reset segment,
                 // <SEQ=SEG.ACK><CTL=RST>
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign, NULL);
                 return;
             }
             /* fall through */
@@ -628,6 +799,8 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
                 pcb->snd.una = seg->ack;
             
                 tcp_retransmit_queue_cleanup(pcb);
+                // ACKが進んだので次の中継先の到達性の確認にする（ARPキャッシュのエントリが期限切れにならない）
+                ip_confirm_neighbor(&pcb->dst);
                 /* ignore: Users should receive positive acknowledgements for buffers
                         which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
                 
@@ -725,6 +898,28 @@ static void tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uin
     return;
 }
 
+// オプションからMSSの値を取り出す（見つからなければ0）
+static uint16_t tcp_option_mss(const struct tcp_hdr *hdr, uint16_t hlen) {
+    const uint8_t *opt, *end;
+
+    opt = (const uint8_t *)(hdr + 1);
+    end = (const uint8_t *)hdr + hlen;
+    while (opt < end) {
+        if (*opt == TCP_OPT_EOL)
+            break;
+        if (*opt == TCP_OPT_NOP) {
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            break; /* malformed */
+        if (opt[0] == TCP_OPT_MSS && opt[1] == TCP_OPT_MSS_LEN)
+            return (opt[2] << 8) | opt[3];
+        opt += opt[1];
+    }
+    return 0;
+}
+
 // TCPセグメントの入力
 static void tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface) {
     struct tcp_hdr *hdr;
@@ -775,6 +970,10 @@ static void tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t
     foreign.addr = src;
     foreign.port = hdr->src;
     hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        errorf("invalid header length, hlen=%u, len=%zu", hlen, len);
+        return;
+    }
     seg.seq = ntoh32(hdr->seq);
     seg.ack = ntoh32(hdr->ack);
     seg.len = len - hlen; // contextの長さ
@@ -786,6 +985,7 @@ static void tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t
     }
     seg.wnd = ntoh16(hdr->wnd);
     seg.up = ntoh16(hdr->up);
+    seg.mss = tcp_option_mss(hdr, hlen);
     mutex_lock(&mutex);
     tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
     mutex_unlock(&mutex);
@@ -864,6 +1064,33 @@ static void event_handler(void *arg) {
     mutex_unlock(&mutex);
 }
 
+// 送信したセグメントがPath MTUを超えたことをICMPで知らされた時の処理（dataはセグメントの先頭8byte以上、自分の送信したセグメントでなければ-1を返す）
+static int tcp_pmtu_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t mtu) {
+    const struct tcp_hdr *hdr;
+    struct ip_endpoint local, foreign;
+    struct tcp_pcb *pcb;
+    uint32_t seq;
+
+    if (len < 8)
+        return -1;
+    hdr = (const struct tcp_hdr *)data;
+    local.addr = src;
+    local.port = hdr->src;
+    foreign.addr = dst;
+    foreign.port = hdr->dst;
+    seq = ntoh32(hdr->seq);
+    mutex_lock(&mutex);
+    pcb = tcp_pcb_select(&local, &foreign);
+    // 偽のICMPを受け入れないように、送信済みで確認応答を受けていないシーケンス番号であることを確かめる（RFC 5927）
+    if (!pcb || pcb->state == TCP_PCB_STATE_LISTEN || seq < pcb->snd.una || seq >= pcb->snd.nxt) {
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    tcp_retransmit_queue_resegment(pcb, mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr)));
+    mutex_unlock(&mutex);
+    return 0;
+}
+
 int tcp_init(void) {
     struct timeval retransmit_interval = {0, 100000};
     struct timeval user_timeout_interval = {0, 1000000};
@@ -874,6 +1101,10 @@ int tcp_init(void) {
         errorf("ip_protocol_register() failure");
         return -1;
     }
+    if (ip_protocol_set_pmtu(IP_PROTOCOL_TCP, tcp_pmtu_input) == -1) {
+        errorf("ip_protocol_set_pmtu() failure");
+        return -1;
+    }
     net_event_subscribe(event_handler, NULL);
     
     if (net_timer_register(retransmit_interval, tcp_retransmit_timer) == -1) {
@@ -1012,9 +1243,10 @@ int tcp_close(int id) {
 
 ssize_t tcp_send(int id, uint8_t *data, size_t len) {
     struct tcp_pcb *pcb;
+    struct net_vec vec[TCP_SEND_BATCH];
     ssize_t sent = 0;
-    struct ip_iface *iface;
     size_t mss, cap, slen;
+    int num = 0;
 
     mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
@@ -1027,19 +1259,15 @@ RETRY:
     switch (pcb->state) {
         case TCP_PCB_STATE_ESTABLISHED:
         case TCP_PCB_STATE_CLOSE_WAIT: // まだ送信したいデータがあればユーザーがsendtoと使用する
-            // 送信に使われるインタフェースを取得
-            iface = ip_route_get_iface(pcb->foreign.addr);
-            if (!iface) {
-                errorf("iface not found");
-                mutex_unlock(&mutex);
-                return -1;
-            }
-            // MSS(Max Segment Size)を計算
-            mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+            // MSS(Max Segment Size)はコネクション確立時に決めた値を使う（Path MTUが小さくなっていればそれに合わせる）
+            mss = MIN(pcb->mss ? pcb->mss : TCP_DEFAULT_MSS, tcp_path_mss(pcb->foreign.addr));
             while (sent < (ssize_t)len) {
                 // 相手がpcb->bufからbufに取り出してないサイズを引く
                 cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
                 if (!cap) {
+                    // 休止する前にまとめておいたセグメントを送る（ACKが返ってこない）
+                    if (tcp_output_flush(pcb, vec, &num) == -1)
+                        goto FAILURE;
                     if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
                         debugf("interrupted");
                         if (!sent) {
@@ -1052,16 +1280,14 @@ RETRY:
                     goto RETRY;
                 }
                 slen = MIN(MIN(mss, len - sent), cap);
-                if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1) {
-                    errorf("tcp_output() failure");
-                    pcb->state = TCP_PCB_STATE_CLOSED;
-                    tcp_pcb_release(pcb);
-                    mutex_unlock(&mutex);
-                    return -1;
-                }
+                // 経路の検索やデバイスへの受け渡しを1回で済ませるため、セグメントはまとめて送る
+                if (tcp_output_queue(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen, vec, &num) == -1)
+                    goto FAILURE;
                 pcb->snd.nxt += slen;
                 sent += slen;
             }
+            if (tcp_output_flush(pcb, vec, &num) == -1)
+                goto FAILURE;
             break;
         case TCP_PCB_STATE_LAST_ACK:
             errorf("connection closing");
@@ -1074,6 +1300,12 @@ RETRY:
     }
     mutex_unlock(&mutex);
     return sent;
+FAILURE:
+    errorf("tcp_output() failure");
+    pcb->state = TCP_PCB_STATE_CLOSED;
+    tcp_pcb_release(pcb);
+    mutex_unlock(&mutex);
+    return -1;
 }
 
 ssize_t tcp_receive(int id, uint8_t *buf, size_t size) {
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/dummy.h"
+
+/*
+ * 2つのdummyデバイスの間で転送（ルータとして動作）する性能を測る
+ * 受信側のデバイスのトラフィックジェネレータから他ネットワーク宛のUDPを流し、送信側のデバイスから出た数を数える
+ * usage: bench_forward.exe [seconds] [len] [pps]
+ * NOTE: ログの出力が支配的になるので stderr は /dev/null などに捨てて実行すること
+ */
+
+#define BENCH_IN_ADDR   "10.0.0.1"
+#define BENCH_OUT_ADDR  "10.1.0.1"
+#define BENCH_SRC_ADDR  "10.0.0.2"
+#define BENCH_DST_ADDR  "10.1.0.2"
+#define BENCH_NETMASK   "255.255.255.0"
+#define BENCH_PORT 7
+#define BENCH_PEER_PORT 10007
+
+static struct net_device *setup_device(const char *addr) {
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    dev = dummy_init();
+    if (!dev) {
+        errorf("dummy_init() failure");
+        return NULL;
+    }
+    iface = ip_iface_alloc(addr, BENCH_NETMASK);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return NULL;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return NULL;
+    }
+    return dev;
+}
+
+int main(int argc, char *argv[]) {
+    struct net_device *in, *out;
+    struct dummy_generator gen;
+    struct dummy_stats rx, tx;
+    struct ip_forward_stats stats;
+    struct timeval start, end, diff;
+    double sec;
+    int duration;
+
+    duration = argc > 1 ? atoi(argv[1]) : 3;
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    in = setup_device(BENCH_IN_ADDR);
+    out = setup_device(BENCH_OUT_ADDR);
+    if (!in || !out) {
+        errorf("setup_device() failure");
+        return -1;
+    }
+    ip_set_forwarding(1);
+    if (net_run() == -1) {
+        errorf("net_run() failure");
+        return -1;
+    }
+
+    memset(&gen, 0, sizeof(gen));
+    gen.mode = DUMMY_GEN_UDP;
+    ip_addr_pton(BENCH_SRC_ADDR, &gen.src);
+    ip_addr_pton(BENCH_DST_ADDR, &gen.dst);
+    gen.sport = hton16(BENCH_PEER_PORT);
+    gen.dport = hton16(BENCH_PORT);
+    gen.len = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+    gen.pps = argc > 3 ? strtoul(argv[3], NULL, 10) : 0;
+    gettimeofday(&start, NULL);
+    if (dummy_generator_start(in, &gen) == -1) {
+        errorf("dummy_generator_start() failure");
+        return -1;
+    }
+    sleep(duration);
+    dummy_generator_stop(in);
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    sec = diff.tv_sec + diff.tv_usec / 1000000.0;
+
+    dummy_get_stats(in, &rx);
+    dummy_get_stats(out, &tx);
+    ip_forward_get_stats(&stats);
+    printf("len=%zu, duration=%.3fs\n", gen.len, sec);
+    printf("rx: %lu packets (%.0f pps), %lu dropped\n", rx.rx_packets, rx.rx_packets / sec, rx.rx_dropped);
+    printf("tx: %lu packets (%.0f pps), %lu bytes\n", tx.tx_packets, tx.tx_packets / sec, tx.tx_bytes);
+    printf("forward: forwarded=%lu, fragmented=%lu, ttl_exceeded=%lu, no_route=%lu, frag_needed=%lu, dropped=%lu\n",
+        stats.forwarded, stats.fragmented, stats.ttl_exceeded, stats.no_route, stats.frag_needed, stats.dropped);
+
+    net_shutdown();
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "nat.h"
+
+#include "driver/dummy.h"
+
+/*
+ * NATの性能を測る
+ *   1. 作ったUDPデータグラムを直接nat_input()に渡し、フローを作る速さと既存のフローを変換する速さを測る
+ *   2. 2つのdummyデバイスの間で送信元を変換（マスカレード）しながら転送する性能を測る
+ *   3. 送信を止めた後、UDPのタイムアウトで全てのフローが消えることを確かめる
+ * usage: bench_nat.exe [flows] [seconds] [len]
+ * NOTE: ログの出力が支配的になるので stderr は /dev/null などに捨てて実行すること
+ */
+
+#define BENCH_IN_ADDR     "10.0.0.1"
+#define BENCH_IN_NETMASK  "255.255.255.0"
+#define BENCH_OUT_ADDR    "10.1.0.1"
+#define BENCH_OUT_NETMASK "255.255.0.0"
+#define BENCH_SRC_ADDR    "10.0.0.2"
+#define BENCH_DST_ADDR    "10.1.0.2"
+#define BENCH_PORT 7
+#define BENCH_PEER_PORT 10007
+
+struct bench_udp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint16_t len;
+    uint16_t sum;
+};
+
+static struct net_device *setup_device(const char *addr, const char *netmask) {
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    dev = dummy_init();
+    if (!dev) {
+        errorf("dummy_init() failure");
+        return NULL;
+    }
+    iface = ip_iface_alloc(addr, netmask);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return NULL;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return NULL;
+    }
+    return dev;
+}
+
+// i番目のフローのデータグラムを作る（宛先アドレスと送信元ポートでフローを分ける）
+static void build_packet(uint8_t *buf, unsigned long i, ip_addr_t src, ip_addr_t net) {
+    struct ip_hdr *hdr;
+    struct bench_udp_hdr *udp;
+
+    memset(buf, 0, IP_HDR_SIZE_MIN + sizeof(*udp));
+    hdr = (struct ip_hdr *)buf;
+    hdr->vhl = (IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2);
+    hdr->total = hton16(IP_HDR_SIZE_MIN + sizeof(*udp));
+    hdr->ttl = 64;
+    hdr->protocol = IP_PROTOCOL_UDP;
+    hdr->src = src;
+    hdr->dst = net | hton32(i % 0xfffe + 1);
+    hdr->sum = cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0);
+    udp = (struct bench_udp_hdr *)(hdr + 1);
+    udp->src = hton16(1024 + i / 0xfffe);
+    udp->dst = hton16(BENCH_PORT);
+    udp->len = hton16(sizeof(*udp));
+}
+
+static double elapsed(struct timeval *start) {
+    struct timeval end, diff;
+
+    gettimeofday(&end, NULL);
+    timersub(&end, start, &diff);
+    return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+    struct net_device *in, *out;
+    struct ip_iface *iface;
+    struct dummy_generator gen;
+    struct dummy_stats rx, tx;
+    struct nat_stats stats;
+    struct timeval start;
+    ip_addr_t src, net, network, netmask;
+    uint8_t buf[IP_HDR_SIZE_MIN + sizeof(struct bench_udp_hdr)];
+    unsigned long flows, i;
+    double sec;
+    int duration;
+
+    flows = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    duration = argc > 2 ? atoi(argv[2]) : 3;
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    in = setup_device(BENCH_IN_ADDR, BENCH_IN_NETMASK);
+    out = setup_device(BENCH_OUT_ADDR, BENCH_OUT_NETMASK);
+    if (!in || !out) {
+        errorf("setup_device() failure");
+        return -1;
+    }
+    if (nat_init(flows + 1) == -1) {
+        errorf("nat_init() failure");
+        return -1;
+    }
+    ip_addr_pton(BENCH_IN_ADDR, &network);
+    ip_addr_pton(BENCH_IN_NETMASK, &netmask);
+    iface = (struct ip_iface *)net_device_get_iface(out, NET_IFACE_FAMILY_IP);
+    if (nat_snat_add(network, netmask, iface, IP_ADDR_ANY) == -1) {
+        errorf("nat_snat_add() failure");
+        return -1;
+    }
+
+    // 1. フローの作成と変換
+    ip_addr_pton(BENCH_SRC_ADDR, &src);
+    ip_addr_pton(BENCH_OUT_ADDR, &net);
+    net &= hton32(0xffff0000);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < flows; i++) {
+        build_packet(buf, i, src, net);
+        nat_input(buf, sizeof(buf));
+    }
+    sec = elapsed(&start);
+    nat_get_stats(&stats);
+    printf("create: %lu flows in %.3fs (%.0f flows/s), conns=%lu, no_port=%lu, table_full=%lu\n",
+        flows, sec, flows / sec, stats.conns, stats.no_port, stats.table_full);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < flows; i++) {
+        build_packet(buf, i, src, net);
+        nat_input(buf, sizeof(buf));
+    }
+    sec = elapsed(&start);
+    printf("lookup: %lu packets in %.3fs (%.0f pps)\n", flows, sec, flows / sec);
+
+    // 2. 送信元を変換しながら転送
+    ip_set_forwarding(1);
+    if (net_run() == -1) {
+        errorf("net_run() failure");
+        return -1;
+    }
+    memset(&gen, 0, sizeof(gen));
+    gen.mode = DUMMY_GEN_UDP;
+    gen.src = src;
+    ip_addr_pton(BENCH_DST_ADDR, &gen.dst);
+    gen.sport = hton16(BENCH_PEER_PORT);
+    gen.dport = hton16(BENCH_PORT);
+    gen.len = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+    gettimeofday(&start, NULL);
+    if (dummy_generator_start(in, &gen) == -1) {
+        errorf("dummy_generator_start() failure");
+        return -1;
+    }
+    sleep(duration);
+    dummy_generator_stop(in);
+    sec = elapsed(&start);
+
+    dummy_get_stats(in, &rx);
+    dummy_get_stats(out, &tx);
+    nat_get_stats(&stats);
+    printf("forward: len=%zu, duration=%.3fs\n", gen.len, sec);
+    printf("rx: %lu packets (%.0f pps), %lu dropped\n", rx.rx_packets, rx.rx_packets / sec, rx.rx_dropped);
+    printf("tx: %lu packets (%.0f pps), %lu bytes\n", tx.tx_packets, tx.tx_packets / sec, tx.tx_bytes);
+    printf("nat: conns=%lu, created=%lu, expired=%lu, translated=%lu, no_port=%lu, table_full=%lu\n",
+        stats.conns, stats.created, stats.expired, stats.translated, stats.no_port, stats.table_full);
+
+    // 3. 期限切れ（送信が止まってからNAT_TIMEOUT_UDP秒経てば全てのフローが消える）
+    sleep(NAT_TIMEOUT_UDP + 2);
+    nat_get_stats(&stats);
+    printf("expire: after %ds idle, conns=%lu, expired=%lu\n", NAT_TIMEOUT_UDP + 2, stats.conns, stats.expired);
+    if (stats.conns || !stats.expired) {
+        errorf("flows did not expire, conns=%lu", stats.conns);
+        net_shutdown();
+        return -1;
+    }
+
+    net_shutdown();
+    return 0;
+}
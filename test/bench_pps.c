@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "icmp.h"
+#include "udp.h"
+#include "tcp.h"
+
+#include "driver/dummy.h"
+
+/*
+ * dummyデバイスのトラフィックジェネレータで受信処理の性能を測る
+ * usage: bench_pps.exe [icmp|udp|tcp] [seconds] [len] [pps]
+ * NOTE: ログの出力が支配的になるので stderr は /dev/null などに捨てて実行すること
+ * NOTE: icmpではEcho応答の数が制限される（icmp_set_ratelimit()）ので、応答しなかった数も表示する
+ */
+
+#define BENCH_LOCAL_ADDR "10.0.0.1"
+#define BENCH_PEER_ADDR  "10.0.0.2"
+#define BENCH_NETMASK    "255.255.255.0"
+#define BENCH_PORT 7
+#define BENCH_PEER_PORT 10007
+
+static volatile sig_atomic_t terminate;
+static unsigned long received;
+
+static void on_signal(int s) {
+    (void)s;
+    terminate = 1;
+    net_raise_event();
+}
+
+// アプリケーションまで届いたデータを読み捨てる
+static void *receiver(void *arg) {
+    int mode = *(int *)arg;
+    struct ip_endpoint local, foreign;
+    uint8_t buf[65536];
+    ssize_t ret;
+    int soc;
+
+    ip_endpoint_pton(BENCH_LOCAL_ADDR ":7", &local);
+    if (mode == DUMMY_GEN_UDP) {
+        soc = udp_open();
+        if (soc == -1 || udp_bind(soc, &local) == -1)
+            return NULL;
+        while (!terminate) {
+            ret = udp_recvfrom(soc, buf, sizeof(buf), &foreign);
+            if (ret < 0)
+                break;
+            __atomic_add_fetch(&received, ret, __ATOMIC_RELAXED);
+        }
+        udp_close(soc);
+    } else if (mode == DUMMY_GEN_TCP) {
+        soc = tcp_open_rfc793(&local, NULL, 0);
+        if (soc == -1)
+            return NULL;
+        while (!terminate) {
+            ret = tcp_receive(soc, buf, sizeof(buf));
+            if (ret <= 0)
+                break;
+            __atomic_add_fetch(&received, ret, __ATOMIC_RELAXED);
+        }
+        tcp_close(soc);
+    }
+    return NULL;
+}
+
+static struct net_device *setup(void) {
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return NULL;
+    }
+    dev = dummy_init();
+    if (!dev) {
+        errorf("dummy_init() failure");
+        return NULL;
+    }
+    iface = ip_iface_alloc(BENCH_LOCAL_ADDR, BENCH_NETMASK);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return NULL;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return NULL;
+    }
+    if (net_run() == -1) {
+        errorf("net_run() failure");
+        return NULL;
+    }
+    return dev;
+}
+
+int main(int argc, char *argv[]) {
+    struct net_device *dev;
+    struct dummy_generator gen;
+    struct dummy_stats stats;
+    struct icmp_stats icmp;
+    struct timeval start, end, diff;
+    pthread_t thread;
+    double sec;
+    int mode = DUMMY_GEN_UDP, duration = 3;
+
+    if (argc > 1) {
+        if (strcmp(argv[1], "icmp") == 0)
+            mode = DUMMY_GEN_ICMP;
+        else if (strcmp(argv[1], "tcp") == 0)
+            mode = DUMMY_GEN_TCP;
+    }
+    if (argc > 2)
+        duration = atoi(argv[2]);
+    signal(SIGINT, on_signal);
+    dev = setup();
+    if (!dev) {
+        errorf("setup() failure");
+        return -1;
+    }
+    pthread_create(&thread, NULL, receiver, &mode);
+
+    memset(&gen, 0, sizeof(gen));
+    gen.mode = mode;
+    ip_addr_pton(BENCH_PEER_ADDR, &gen.src);
+    ip_addr_pton(BENCH_LOCAL_ADDR, &gen.dst);
+    gen.sport = hton16(BENCH_PEER_PORT);
+    gen.dport = hton16(BENCH_PORT);
+    gen.len = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+    gen.pps = argc > 4 ? strtoul(argv[4], NULL, 10) : 0;
+    gen.verify = 1;
+    gettimeofday(&start, NULL);
+    if (dummy_generator_start(dev, &gen) == -1) {
+        errorf("dummy_generator_start() failure");
+        return -1;
+    }
+    sleep(duration);
+    dummy_generator_stop(dev);
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &diff);
+    sec = diff.tv_sec + diff.tv_usec / 1000000.0;
+
+    dummy_get_stats(dev, &stats);
+    printf("mode=%s, len=%zu, duration=%.3fs\n", mode == DUMMY_GEN_ICMP ? "icmp" : (mode == DUMMY_GEN_TCP ? "tcp" : "udp"), gen.len, sec);
+    printf("rx: %lu packets (%.0f pps), %lu dropped\n", stats.rx_packets, stats.rx_packets / sec, stats.rx_dropped);
+    printf("tx: %lu packets, %lu bytes, verified=%lu, errors=%lu\n", stats.tx_packets, stats.tx_bytes, stats.tx_verified, stats.tx_errors);
+    printf("app: %lu bytes (%.1f Mbps)\n", received, received * 8 / sec / 1000000.0);
+    if (mode == DUMMY_GEN_ICMP) {
+        icmp_get_stats(&icmp);
+        printf("icmp: replies=%lu, rate limited=%lu\n", icmp.replies, icmp.reply_limited);
+    }
+
+    terminate = 1;
+    net_shutdown();
+    return stats.tx_errors ? -1 : 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/dummy.h"
+
+/*
+ * 経路表の検索性能を測る（線形リストを巡回する以前の方式と比較する）
+ * usage: bench_route.exe [routes] [lookups]
+ * NOTE: 以前の方式は経路数に比例して遅くなるので、検索回数を減らして測る
+ */
+
+#define BENCH_LOCAL_ADDR "10.0.0.1"
+#define BENCH_NETMASK    "255.255.255.0"
+
+#define BENCH_LIST_LOOKUPS_MAX 20000
+
+struct bench_route {
+    ip_addr_t network;
+    ip_addr_t netmask;
+    ip_addr_t nexthop;
+    int deleted;
+};
+
+static struct bench_route *routes;
+static int num;
+
+// 以前のip_route_lookup()と同じく全ての経路を巡回してロンゲストマッチを探す
+static ip_addr_t list_lookup(ip_addr_t dst) {
+    struct bench_route *route, *candidate = NULL;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        route = &routes[i];
+        if (route->deleted)
+            continue;
+        if ((dst & route->netmask) == route->network) {
+            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask))
+                candidate = route;
+        }
+    }
+    if (!candidate)
+        return IP_ADDR_ANY;
+    return candidate->nexthop != IP_ADDR_ANY ? candidate->nexthop : dst;
+}
+
+// 実際の経路表に近い分布（/24が多く、/8〜/32まで）のプレフィックス長を選ぶ
+static int random_prefixlen(void) {
+    int r = random() % 100;
+
+    if (r < 60)
+        return 24;
+    if (r < 75)
+        return 16 + random() % 8;
+    if (r < 90)
+        return 8 + random() % 8;
+    return 25 + random() % 8;
+}
+
+// 経路に当たる宛先を多めに混ぜる
+static ip_addr_t random_dst(void) {
+    struct bench_route *route;
+
+    if (random() % 4 == 0)
+        return (ip_addr_t)random() ^ ((ip_addr_t)random() << 16);
+    route = &routes[random() % num];
+    return route->network | ((ip_addr_t)random() & ~route->netmask);
+}
+
+static double elapsed(struct timeval *start) {
+    struct timeval end, diff;
+
+    gettimeofday(&end, NULL);
+    timersub(&end, start, &diff);
+    return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+static int verify(int lookups) {
+    ip_addr_t dst;
+    int i, errors = 0;
+
+    for (i = 0; i < lookups; i++) {
+        dst = random_dst();
+        if (ip_route_get_nexthop(dst) != list_lookup(dst))
+            errors++;
+    }
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    struct net_device *dev;
+    struct ip_iface *iface;
+    struct timeval start;
+    struct bench_route *route;
+    ip_addr_t *dsts, acc = 0;
+    int lookups, list_lookups, i, len, errors;
+    double sec;
+
+    num = argc > 1 ? atoi(argv[1]) : 100000;
+    lookups = argc > 2 ? atoi(argv[2]) : 10000000;
+    srandom(1);
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    dev = dummy_init();
+    iface = ip_iface_alloc(BENCH_LOCAL_ADDR, BENCH_NETMASK);
+    if (!dev || !iface || ip_iface_register(dev, iface) == -1) {
+        errorf("setup failure");
+        return -1;
+    }
+
+    // 比較用の経路（ip_iface_register()で登録されたものも含める）
+    routes = calloc(num + 1, sizeof(*routes));
+    dsts = calloc(lookups, sizeof(*dsts));
+    if (!routes || !dsts) {
+        errorf("calloc() failure");
+        return -1;
+    }
+    routes[0].netmask = iface->netmask;
+    routes[0].network = iface->unicast & iface->netmask;
+    gettimeofday(&start, NULL);
+    for (i = 1; i <= num; ) {
+        route = &routes[i];
+        len = random_prefixlen();
+        route->netmask = hton32(0xffffffff << (32 - len));
+        route->network = ((ip_addr_t)random() ^ ((ip_addr_t)random() << 16)) & route->netmask;
+        route->nexthop = (ip_addr_t)random() | 1;
+        if (ip_route_add(route->network, route->netmask, route->nexthop, iface) == -1)
+            continue; /* duplicated prefix */
+        i++;
+    }
+    num++;
+    sec = elapsed(&start);
+    printf("routes: %d (%.0f inserts/s)\n", num, (num - 1) / sec);
+
+    for (i = 0; i < lookups; i++)
+        dsts[i] = random_dst();
+    gettimeofday(&start, NULL);
+    for (i = 0; i < lookups; i++)
+        acc += ip_route_get_nexthop(dsts[i]);
+    sec = elapsed(&start);
+    printf("lpm:  %d lookups, %.3fs, %.0f lookups/s\n", lookups, sec, lookups / sec);
+
+    list_lookups = lookups < BENCH_LIST_LOOKUPS_MAX ? lookups : BENCH_LIST_LOOKUPS_MAX;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < list_lookups; i++)
+        acc += list_lookup(dsts[i]);
+    sec = elapsed(&start);
+    printf("list: %d lookups, %.3fs, %.0f lookups/s\n", list_lookups, sec, list_lookups / sec);
+
+    // 半分の経路を削除しても以前の方式と同じ結果になることを確かめる
+    errors = verify(list_lookups);
+    for (i = 1; i < num; i += 2) {
+        if (ip_route_del(routes[i].network, routes[i].netmask) == 0)
+            routes[i].deleted = 1;
+    }
+    errors += verify(list_lookups);
+    printf("verify: %d errors (%d lookups, before and after deleting half of the routes)\n", errors, list_lookups * 2);
+    fprintf(stderr, "%u\n", acc); /* keep the lookups */
+    return errors ? -1 : 0;
+}
@@ -23,6 +23,8 @@
 #define UDP_SOURCE_PORT_MIN 49152
 #define UDP_SOURCE_PORT_MAX 65535
 
+#define UDP_SENDTO_BATCH 64 // udp_sendto_batch()でip_output_batch()に一度に渡す数
+
 // 疑似ヘッダの構造体（チェックサム計算時に使用する）
 struct pseudo_hdr {
     uint32_t src;     // 送信元アドレス
@@ -38,6 +40,7 @@ struct udp_pcb {
     struct ip_endpoint local;  // 自分のアドレス＆ポート番号
     struct queue_head queue; /* receive queue */
     struct sched_ctx ctx; // コンテキストの初期化
+    struct ip_dst dst; // 宛先キャッシュ（同じ相手に送り続ける場合に経路とARPを毎回引かない）
 };
 
 // 受信キューのエントリの構造体
@@ -110,6 +113,7 @@ static void udp_pcb_release(struct udp_pcb *pcb) {
     pcb->state = UDP_PCB_STATE_FREE;
     pcb->local.addr = IP_ADDR_ANY;
     pcb->local.port = 0;
+    memset(&pcb->dst, 0, sizeof(pcb->dst));
 
     while (1) { // Discard the entries in the queue
         // 受信キューを空にする
@@ -303,11 +307,63 @@ int udp_bind(int id, struct ip_endpoint *local) {
     return 0;
 }
 
-// UDPのAPI：送信
-// ifaceのaddrとポート番号を調べてudp_outputを呼ぶ
-ssize_t udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign) {
+// bufにUDPデータグラムを生成して長さを返す
+static uint16_t udp_build(uint8_t *buf, struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len) {
+    struct udp_hdr *hdr;
+    struct pseudo_hdr pseudo;
+    uint16_t total, psum = 0;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+
+    hdr = (struct udp_hdr *)buf;
+
+    // UDPデータグラムの生成
+    // UDPのチェックサムは疑似ヘッダとUDPヘッダ、dataの3つから計算する
+    total = sizeof(*hdr) + len;
+    pseudo.src = src->addr;
+    pseudo.dst = dst->addr;
+    pseudo.zero = 0;
+    pseudo.protocol = IP_PROTOCOL_UDP;
+    pseudo.len = hton16(total);
+    hdr->src = src->port;
+    hdr->dst = dst->port;
+    hdr->len = hton16(total);
+    hdr->sum = 0;
+    memcpy(hdr + 1, data, len);
+    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    
+    debugf("%s => %s, len=%zu (payload=%zu)",
+        ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
+    udp_dump((uint8_t *)hdr, total);
+    return total;
+}
+
+// NOTE: cacheは宛先キャッシュ（呼び出し側で排他すること）
+static ssize_t udp_output_dst(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len, struct ip_dst *cache) {
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    uint16_t total;
+
+    // IPのペイロードに載せきれないほど大きなデータが渡されたらエラーを返す
+    if (len > IP_PAYLOAD_SIZE_MAX - sizeof(struct udp_hdr)) {
+        errorf("too long");
+        return -1;
+    }
+    // NOTE: 送信に使うデバイスのMTUを超える場合はIPでフラグメントに分けて送られる
+    total = udp_build(buf, src, dst, data, len);
+
+    // IPの送信関数を呼び出す
+    if (ip_output_dst(cache, IP_PROTOCOL_UDP, buf, total, src->addr, dst->addr) == -1) {
+        errorf("ip_output_dst() failure");
+        return -1;
+    }
+
+    return len;
+}
+
+// 送信の準備：送信元のアドレスとポートを決めて、宛先キャッシュの写しを取る
+static int udp_sendto_prepare(int id, struct ip_endpoint *foreign, struct ip_endpoint *local, struct ip_dst *dst) {
     struct udp_pcb *pcb;
-    struct ip_endpoint local; // 送信を頼むifaceのendpoint
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     uint32_t p;
@@ -322,10 +378,10 @@ ssize_t udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreig
         mutex_unlock(&mutex);
         return -1;
     }
-    local.addr = pcb->local.addr;
-    if (local.addr == IP_ADDR_ANY) {
+    local->addr = pcb->local.addr;
+    if (local->addr == IP_ADDR_ANY) {
         // IPの経路情報から宛先に到達可能なインタフェースを取得
-        iface = ip_route_get_iface(foreign->addr);
+        iface = ip_dst_iface(&pcb->dst, foreign->addr);
         // 見つからなければエラー
         if (!iface) {
             errorf("iface not found that can reach foreign address, addr=%s", ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
@@ -333,14 +389,14 @@ ssize_t udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreig
             return -1;
         }
         // 取得したインタフェースのアドレスを使う
-        local.addr = iface->unicast;
-        debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+        local->addr = iface->unicast;
+        debugf("select local address, addr=%s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
     }
     // 自分の使うポート番号が設定されていなかったら送信元ポートを自動的に選択する
     if (!pcb->local.port) {
         // 送信元ポート番号の範囲から使用可能なポートを探してPCBに割り当てる（使用されていないポートを探す）
         for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.addr, hton16(p))) {
+            if (!udp_pcb_select(local->addr, hton16(p))) {
                 // このPCBで使用するポートに設定する
                 pcb->local.port = hton16(p);
                 debugf("dinamic assign local port, port=%d", p);
@@ -349,13 +405,88 @@ ssize_t udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreig
         }
         // 使用可能なポートがなかったらエラーを返す
         if (!pcb->local.port) {
-            debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+            debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
+            mutex_unlock(&mutex);
             return -1;
         }
     }
-    local.port = pcb->local.port;
+    local->port = pcb->local.port;
+    // 宛先キャッシュは写しを使い、引き直した場合だけPCBに書き戻す（送信中はmutexを解放する）
+    *dst = pcb->dst;
     mutex_unlock(&mutex);
-    return udp_output(&local, foreign, data, len);
+    return 0;
+}
+
+// 送信中に宛先キャッシュを引き直していたらPCBに書き戻す
+static void udp_sendto_update(int id, const struct ip_dst *dst, const struct ip_dst *old) {
+    struct udp_pcb *pcb;
+
+    if (dst->genid != old->genid || dst->dst != old->dst || dst->iface != old->iface || dst->resolved != old->resolved || dst->neighbor_gen != old->neighbor_gen) {
+        mutex_lock(&mutex);
+        pcb = udp_pcb_get(id);
+        if (pcb)
+            pcb->dst = *dst;
+        mutex_unlock(&mutex);
+    }
+}
+
+// UDPのAPI：送信
+// ifaceのaddrとポート番号を調べてudp_outputを呼ぶ
+ssize_t udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign) {
+    struct ip_endpoint local; // 送信を頼むifaceのendpoint
+    struct ip_dst dst, old;
+    ssize_t ret;
+
+    if (udp_sendto_prepare(id, foreign, &local, &dst) == -1)
+        return -1;
+    old = dst;
+    ret = udp_output_dst(&local, foreign, data, len, &dst);
+    udp_sendto_update(id, &dst, &old);
+    return ret;
+}
+
+// UDPのAPI：まとめて送信（同じ宛先へのnum個のデータを送り、送信できた数を返す）
+// NOTE: 経路の検索やデバイスへの受け渡しはip_output_batch()でまとめて行う（vecのdstは使わない）
+int udp_sendto_batch(int id, const struct net_vec *vec, int num, struct ip_endpoint *foreign) {
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    struct net_vec out[UDP_SENDTO_BATCH];
+    struct ip_endpoint local;
+    struct ip_dst dst, old;
+    size_t used = 0;
+    int i, n = 0, sent = 0, ret = 0;
+
+    for (i = 0; i < num; i++) {
+        if (vec[i].len > IP_PAYLOAD_SIZE_MAX - sizeof(struct udp_hdr)) {
+            errorf("too long, len=%zu", vec[i].len);
+            return -1;
+        }
+    }
+    if (udp_sendto_prepare(id, foreign, &local, &dst) == -1)
+        return -1;
+    old = dst;
+    for (i = 0; i < num; i++) {
+        if (n == UDP_SENDTO_BATCH || used + sizeof(struct udp_hdr) + vec[i].len > sizeof(buf)) {
+            ret = ip_output_batch(&dst, IP_PROTOCOL_UDP, out, n, local.addr, foreign->addr);
+            if (ret != n)
+                break;
+            sent += ret;
+            n = 0;
+            used = 0;
+        }
+        out[n].data = buf + used;
+        out[n].len = udp_build(buf + used, &local, foreign, vec[i].data, vec[i].len);
+        out[n].dst = NULL;
+        used += out[n].len;
+        n++;
+    }
+    if (i == num && n)
+        ret = ip_output_batch(&dst, IP_PROTOCOL_UDP, out, n, local.addr, foreign->addr);
+    udp_sendto_update(id, &dst, &old);
+    if (ret == -1) {
+        errorf("ip_output_batch() failure");
+        return sent ? sent : -1;
+    }
+    return sent + ret;
 }
 
 // UDPのAPI：受信
@@ -417,47 +548,9 @@ ssize_t udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *fore
 }
 
 ssize_t udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len) {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
-    struct udp_hdr *hdr;
-    struct pseudo_hdr pseudo;
-    uint16_t total, psum = 0;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
-
-    // IPのペイロードに載せきれないほど大きなデータが渡されたらエラーを返す
-    if (len > IP_PAYLOAD_SIZE_MAX - sizeof(*hdr)) {
-        errorf("too long");
-        return -1;
-    }
-    hdr = (struct udp_hdr *)buf;
-
-    // UDPデータグラムの生成
-    // UDPのチェックサムは疑似ヘッダとUDPヘッダ、dataの3つから計算する
-    total = sizeof(*hdr) + len;
-    pseudo.src = src->addr;
-    pseudo.dst = dst->addr;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_UDP;
-    pseudo.len = hton16(total);
-    hdr->src = src->port;
-    hdr->dst = dst->port;
-    hdr->len = hton16(total);
-    hdr->sum = 0;
-    memcpy(hdr + 1, data, len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
-    
-    debugf("%s => %s, len=%zu (payload=%zu)",
-        ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
-    udp_dump((uint8_t *)hdr, total);
+    struct ip_dst cache = {};
 
-    // IPの送信関数を呼び出す
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
-        errorf("ip_output() failure");
-        return -1;
-    }
-
-    return len;
+    return udp_output_dst(src, dst, data, len, &cache);
 }
 
 static void event_handler(void *arg) {
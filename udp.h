@@ -14,6 +14,7 @@ extern int udp_open(void);
 extern int udp_bind(int index, struct ip_endpoint *local);
 extern int udp_close(int id);
 extern ssize_t udp_sendto(int id, uint8_t *buf, size_t len, struct ip_endpoint *foreign);
+extern int udp_sendto_batch(int id, const struct net_vec *vec, int num, struct ip_endpoint *foreign);
 extern ssize_t udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
 
 #endif
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <ctype.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -158,6 +159,139 @@ queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), voi
     }
 }
 
+/*
+ * Ring
+ * NOTE: Each slot has a sequence number so that producers can reserve slots with CAS only.
+ *       ring_peek()/ring_release() must be called from a single consumer thread.
+ */
+
+#define RING_CACHELINE 64
+
+struct ring_slot {
+    atomic_size_t seq;
+    size_t pos;
+    uint8_t data[] __attribute__((aligned(16)));
+};
+
+struct ring {
+    size_t mask;
+    size_t stride;
+    uint8_t *slots;
+    _Alignas(RING_CACHELINE) atomic_size_t head; /* consumer */
+    _Alignas(RING_CACHELINE) atomic_size_t tail; /* producers */
+};
+
+#define RING_SLOT(r, p) ((struct ring_slot *)((r)->slots + ((p) & (r)->mask) * (r)->stride))
+#define RING_SLOT_OF(d) ((struct ring_slot *)((uint8_t *)(d) - offsetof(struct ring_slot, data)))
+
+struct ring *
+ring_alloc(unsigned int num, size_t size)
+{
+    struct ring *ring;
+    size_t n, i;
+
+    // スロット数は2のべき乗に切り上げる（インデックス計算をマスクで済ませるため）
+    for (n = 1; n < num; n <<= 1);
+    ring = memory_alloc(sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->mask = n - 1;
+    ring->stride = (sizeof(struct ring_slot) + size + 15) & ~(size_t)15;
+    ring->slots = memory_alloc(ring->stride * n);
+    if (!ring->slots) {
+        memory_free(ring);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        atomic_init(&RING_SLOT(ring, i)->seq, i);
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ring;
+}
+
+void
+ring_free(struct ring *ring)
+{
+    if (!ring) {
+        return;
+    }
+    memory_free(ring->slots);
+    memory_free(ring);
+}
+
+void *
+ring_reserve(struct ring *ring)
+{
+    struct ring_slot *slot;
+    size_t pos, seq;
+    intptr_t diff;
+
+    pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1) {
+        slot = RING_SLOT(ring, pos);
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                slot->pos = pos;
+                return slot->data;
+            }
+        } else if (diff < 0) {
+            /* full */
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+void
+ring_commit(struct ring *ring, void *data)
+{
+    struct ring_slot *slot;
+
+    slot = RING_SLOT_OF(data);
+    atomic_store_explicit(&slot->seq, slot->pos + 1, memory_order_release);
+}
+
+void *
+ring_peek(struct ring *ring)
+{
+    struct ring_slot *slot;
+    size_t pos;
+
+    pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    slot = RING_SLOT(ring, pos);
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+        /* empty (or not committed yet) */
+        return NULL;
+    }
+    slot->pos = pos;
+    return slot->data;
+}
+
+void
+ring_release(struct ring *ring, void *data)
+{
+    struct ring_slot *slot;
+
+    slot = RING_SLOT_OF(data);
+    atomic_store_explicit(&slot->seq, slot->pos + ring->mask + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, slot->pos + 1, memory_order_relaxed);
+}
+
+unsigned int
+ring_count(struct ring *ring)
+{
+    size_t head, tail;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return tail - head;
+}
+
 /*
  * Byteorder
  */
@@ -248,3 +382,50 @@ cksum16(uint16_t *addr, uint16_t count, uint32_t init)
     }
     return ~(uint16_t)sum;
 }
+
+/*
+ * RFC 1624: HC' = ~(~HC + ~m + m')
+ * NOTE: values are taken as stored in the packet (no byte order conversion)
+ */
+uint16_t
+cksum16_adjust(uint16_t sum, uint16_t old, uint16_t new)
+{
+    uint32_t acc;
+
+    acc = (uint16_t)~sum + (uint16_t)~old + new;
+    while (acc >> 16) {
+        acc = (acc & 0xffff) + (acc >> 16);
+    }
+    return ~(uint16_t)acc;
+}
+
+/* NOTE: for 32-bit fields and IPv4 addresses covered by a pseudo header */
+uint16_t
+cksum16_adjust32(uint16_t sum, uint32_t old, uint32_t new)
+{
+    sum = cksum16_adjust(sum, old & 0xffff, new & 0xffff);
+    return cksum16_adjust(sum, old >> 16, new >> 16);
+}
+
+/*
+ * Hash
+ */
+
+#define HASH_ROT32(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+/* NOTE: final mix of Bob Jenkins' lookup3 (same as jhash_3words() in Linux) */
+uint32_t
+hash32_3words(uint32_t a, uint32_t b, uint32_t c, uint32_t seed)
+{
+    a += 0xdeadbeef + seed;
+    b += 0xdeadbeef + seed;
+    c += 0xdeadbeef + seed;
+    c ^= b; c -= HASH_ROT32(b, 14);
+    a ^= c; a -= HASH_ROT32(c, 11);
+    b ^= a; b -= HASH_ROT32(a, 25);
+    c ^= b; c -= HASH_ROT32(b, 16);
+    a ^= c; a -= HASH_ROT32(c, 4);
+    b ^= a; b -= HASH_ROT32(a, 14);
+    c ^= b; c -= HASH_ROT32(b, 24);
+    return c;
+}
@@ -91,6 +91,27 @@ queue_peek(struct queue_head *queue);
 extern void
 queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg);
 
+/*
+ * Ring (bounded, lock-free, multi-producer/single-consumer)
+ */
+
+struct ring;
+
+extern struct ring *
+ring_alloc(unsigned int num, size_t size);
+extern void
+ring_free(struct ring *ring);
+extern void *
+ring_reserve(struct ring *ring);
+extern void
+ring_commit(struct ring *ring, void *data);
+extern void *
+ring_peek(struct ring *ring);
+extern void
+ring_release(struct ring *ring, void *data);
+extern unsigned int
+ring_count(struct ring *ring);
+
 /*
  * Byteorder
  */
@@ -110,5 +131,16 @@ ntoh32(uint32_t n);
 
 extern uint16_t
 cksum16(uint16_t *addr, uint16_t count, uint32_t init);
+extern uint16_t
+cksum16_adjust(uint16_t sum, uint16_t old, uint16_t new);
+extern uint16_t
+cksum16_adjust32(uint16_t sum, uint32_t old, uint32_t new);
+
+/*
+ * Hash
+ */
+
+extern uint32_t
+hash32_3words(uint32_t a, uint32_t b, uint32_t c, uint32_t seed);
 
 #endif